@@ -0,0 +1,140 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "arena.hpp"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace mk {
+namespace libjson {
+
+// Arena
+// =====
+
+// Each chunk starts with this header. Its size is a multiple of the
+// alignment, so the memory following it is correctly aligned.
+struct alignas(max_align_t) Arena::Chunk {
+  Chunk *next;
+  size_t size;
+};
+
+static constexpr size_t alignment = alignof(max_align_t);
+
+static constexpr size_t min_chunk = 64 * 1024;
+
+Arena::Arena() noexcept {}
+
+void *Arena::allocate(size_t size) {
+  if (size > SIZE_MAX - alignment) {
+    throw std::bad_alloc{};
+  }
+  size = (size + alignment - 1) & ~(alignment - 1);
+  if ((size_t)(end_ - cur_) < size) {
+    // Grow geometrically so that a large document only needs a handful of
+    // chunks, and the next release() coalesces them anyway.
+    add_chunk(size > capacity_ ? size : capacity_);
+  }
+  void *ptr = cur_;
+  cur_ += size;
+  return ptr;
+}
+
+void Arena::add_chunk(size_t size) {
+  if (size < min_chunk) {
+    size = min_chunk;
+  }
+  if (size > SIZE_MAX - sizeof(Chunk)) {
+    throw std::bad_alloc{};
+  }
+  auto chunk = static_cast<Chunk *>(malloc(sizeof(Chunk) + size));
+  if (!chunk) {
+    throw std::bad_alloc{};
+  }
+  chunk->next = chunks_;
+  chunk->size = size;
+  chunks_ = chunk;
+  capacity_ += size;
+  cur_ = reinterpret_cast<char *>(chunk + 1);
+  end_ = cur_ + size;
+}
+
+void Arena::free_chunks() noexcept {
+  while (chunks_) {
+    Chunk *next = chunks_->next;
+    free(chunks_);
+    chunks_ = next;
+  }
+  cur_ = end_ = nullptr;
+  capacity_ = 0;
+}
+
+void Arena::release() noexcept {
+  if (!chunks_) {
+    return;
+  }
+  if (chunks_->next) {
+    size_t capacity = capacity_;
+    free_chunks();
+    try {
+      add_chunk(capacity);
+    } catch (const std::bad_alloc &) {
+      return;  // We will allocate again on demand
+    }
+  }
+  cur_ = reinterpret_cast<char *>(chunks_ + 1);
+  end_ = cur_ + chunks_->size;
+}
+
+bool Arena::owns(const void *ptr) const noexcept {
+  auto address = (uintptr_t)ptr;
+  for (Chunk *chunk = chunks_; chunk; chunk = chunk->next) {
+    auto begin = (uintptr_t)(chunk + 1);
+    if (address >= begin && address - begin < chunk->size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Arena::~Arena() noexcept { free_chunks(); }
+
+// ArenaScope
+// ==========
+
+static thread_local Arena *current_arena = nullptr;
+
+ArenaScope::ArenaScope(Arena *arena) noexcept : previous_{current_arena} {
+  current_arena = arena;
+}
+
+ArenaScope::~ArenaScope() noexcept { current_arena = previous_; }
+
+// Allocation
+// ==========
+
+static thread_local size_t allocations = 0;
+
+void *arena_allocate(size_t size) {
+  allocations += 1;
+  if (current_arena) {
+    return current_arena->allocate(size);
+  }
+  void *ptr = malloc(size > 0 ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc{};
+  }
+  return ptr;
+}
+
+void arena_deallocate(void *ptr) noexcept {
+  if (!current_arena || !current_arena->owns(ptr)) {
+    free(ptr);
+  }
+}
+
+size_t arena_allocations() noexcept { return allocations; }
+
+}  // namespace libjson
+}  // namespace mk
@@ -0,0 +1,117 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <stddef.h>
+
+#include <new>
+
+namespace mk {
+namespace libjson {
+
+// Arena
+// =====
+//
+// Monotonic allocator. Memory is carved out of large chunks and it is only
+// returned when the arena is released or destroyed.
+class Arena {
+ public:
+  Arena() noexcept;
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Returns |size| bytes aligned like malloc(). Throws std::bad_alloc, like
+  // operator new, if we run out of memory.
+  void *allocate(size_t size);
+
+  // Makes all the memory available again. We keep the memory we have
+  // allocated, coalesced into a single chunk, so that a document of the
+  // same size as the previous one does not need to allocate.
+  void release() noexcept;
+
+  // Returns true if |ptr| points into one of our chunks.
+  bool owns(const void *ptr) const noexcept;
+
+  ~Arena() noexcept;
+
+ private:
+  struct Chunk;
+
+  void add_chunk(size_t size);
+
+  void free_chunks() noexcept;
+
+  Chunk *chunks_ = nullptr;
+  char *cur_ = nullptr;
+  char *end_ = nullptr;
+  size_t capacity_ = 0;
+};
+
+// Installs |arena| as the arena used by ArenaAllocator in the current thread
+// until the scope exits. A null |arena| means that we use the heap.
+class ArenaScope {
+ public:
+  explicit ArenaScope(Arena *arena) noexcept;
+
+  ArenaScope(const ArenaScope &) = delete;
+  ArenaScope &operator=(const ArenaScope &) = delete;
+
+  ~ArenaScope() noexcept;
+
+ private:
+  Arena *previous_;
+};
+
+// Allocates from the current arena, if any, and from the heap otherwise.
+// Blocks have no header, so a block must be released while the arena it
+// comes from is current: we recognise its address and leave it to the
+// arena. Any other block is a heap block and we free it.
+void *arena_allocate(size_t size);
+
+void arena_deallocate(void *ptr) noexcept;
+
+// Number of blocks allocated by arena_allocate() in the current thread,
+// which tests use to check that some operations do not allocate.
+size_t arena_allocations() noexcept;
+
+// Stateless allocator, as required by nlohmann::basic_json, that uses the
+// current arena.
+template <typename Type>
+class ArenaAllocator {
+ public:
+  using value_type = Type;
+
+  ArenaAllocator() noexcept {}
+
+  template <typename Other>
+  ArenaAllocator(const ArenaAllocator<Other> &) noexcept {}
+
+  Type *allocate(size_t count) {
+    static_assert(alignof(Type) <= alignof(max_align_t), "Over aligned");
+    if (count > (size_t)-1 / sizeof(Type)) {
+      throw std::bad_alloc{};
+    }
+    return static_cast<Type *>(arena_allocate(count * sizeof(Type)));
+  }
+
+  void deallocate(Type *ptr, size_t) noexcept { arena_deallocate(ptr); }
+};
+
+template <typename Left, typename Right>
+bool operator==(const ArenaAllocator<Left> &,
+                const ArenaAllocator<Right> &) noexcept {
+  return true;
+}
+
+template <typename Left, typename Right>
+bool operator!=(const ArenaAllocator<Left> &,
+                const ArenaAllocator<Right> &) noexcept {
+  return false;
+}
+
+}  // namespace libjson
+}  // namespace mk
+#endif
@@ -30,41 +30,341 @@
 
 #include "base64_encode.hpp"
 
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64_ENCODE_X86 1
+#include <immintrin.h>
+#endif
+
+// Note: this version has been modified to compute the size of the output
+// up front and to encode most of the input using SIMD instructions. The
+// output is the same as the one of the original implementation. We have
+// also added a decoder.
+
 namespace mk {
 namespace libjson {
 
+static const char b64_table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "abcdefghijklmnopqrstuvwxyz"
+    "0123456789+/";
+
+// Encodes [base, base + len) into |out|, which must have room for exactly
+// 4 * ((len + 2) / 3) characters.
+static void encode_scalar(const uint8_t *base, size_t len, char *out) noexcept {
+  for (; len >= 3; len -= 3, base += 3, out += 4) {
+    out[0] = b64_table[base[0] >> 2];
+    out[1] = b64_table[((base[0] & 0x03) << 4) | (base[1] >> 4)];
+    out[2] = b64_table[((base[1] & 0x0f) << 2) | (base[2] >> 6)];
+    out[3] = b64_table[base[2] & 0x3f];
+  }
+  if (len > 0) {
+    uint8_t in1 = (len > 1) ? base[1] : 0;
+    out[0] = b64_table[base[0] >> 2];
+    out[1] = b64_table[((base[0] & 0x03) << 4) | (in1 >> 4)];
+    out[2] = (len > 1) ? b64_table[(in1 & 0x0f) << 2] : '=';
+    out[3] = '=';
+  }
+}
+
+#ifdef BASE64_ENCODE_X86
+
+// Vectorized encoding from Muła and Lemire, "Faster Base64 Encoding and
+// Decoding Using AVX2 Instructions". Each group of three bytes is shuffled
+// into a 32 bit lane, the four 6 bit indexes are moved into separate bytes
+// using multiplications, and the indexes are translated into characters by
+// adding an offset that depends on the range the index belongs to.
+
+#define BASE64_SHUFFLE 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+
+#define BASE64_OFFSETS                                                     \
+  'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,    \
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+
+// Encodes 12 bytes into 16 characters. Reads 16 bytes from |base|.
+__attribute__((target("ssse3"))) static inline __m128i encode_ssse3(
+    const uint8_t *base) noexcept {
+  __m128i in = _mm_loadu_si128((const __m128i *)base);
+  in = _mm_shuffle_epi8(in, _mm_setr_epi8(BASE64_SHUFFLE));
+  __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  __m128i indexes = _mm_or_si128(t1, t3);
+  // Map 0..25 to 13, 26..51 to 0, 52..61 to 1..10, 62 to 11, and 63 to 12,
+  // which are the positions of the offsets for such ranges.
+  __m128i range = _mm_subs_epu8(indexes, _mm_set1_epi8(51));
+  __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indexes);
+  range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+  __m128i offsets =
+      _mm_shuffle_epi8(_mm_setr_epi8(BASE64_OFFSETS), range);
+  return _mm_add_epi8(indexes, offsets);
+}
+
+__attribute__((target("ssse3"))) static size_t encode_blocks_ssse3(
+    const uint8_t *base, size_t len, char *out) noexcept {
+  size_t done = 0;
+  for (; len - done >= 16; done += 12, out += 16) {
+    _mm_storeu_si128((__m128i *)out, encode_ssse3(base + done));
+  }
+  return done;
+}
+
+// Like encode_ssse3() but encodes 24 bytes into 32 characters, reading 28
+// bytes from |base|: we load the two 12 byte groups into separate lanes.
+__attribute__((target("avx2"))) static inline __m256i encode_avx2(
+    const uint8_t *base) noexcept {
+  __m256i in = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)base)),
+      _mm_loadu_si128((const __m128i *)(base + 12)), 1);
+  in = _mm256_shuffle_epi8(in,
+                           _mm256_setr_epi8(BASE64_SHUFFLE, BASE64_SHUFFLE));
+  __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+  __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+  __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+  __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+  __m256i indexes = _mm256_or_si256(t1, t3);
+  __m256i range = _mm256_subs_epu8(indexes, _mm256_set1_epi8(51));
+  __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indexes);
+  range = _mm256_or_si256(range, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+  __m256i offsets = _mm256_shuffle_epi8(
+      _mm256_setr_epi8(BASE64_OFFSETS, BASE64_OFFSETS), range);
+  return _mm256_add_epi8(indexes, offsets);
+}
+
+__attribute__((target("avx2"))) static size_t encode_blocks_avx2(
+    const uint8_t *base, size_t len, char *out) noexcept {
+  size_t done = 0;
+  for (; len - done >= 28; done += 24, out += 32) {
+    _mm256_storeu_si256((__m256i *)out, encode_avx2(base + done));
+  }
+  return done;
+}
+
+#endif  // BASE64_ENCODE_X86
+
+// Encodes the largest multiple of three bytes that the kernel can handle
+// and returns the number of encoded bytes.
+using Encoder = size_t (*)(const uint8_t *, size_t, char *);
+
+static size_t encode_blocks_none(const uint8_t *, size_t, char *) noexcept {
+  return 0;
+}
+
+static Encoder select_encoder() noexcept {
+#ifdef BASE64_ENCODE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return encode_blocks_avx2;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    return encode_blocks_ssse3;
+  }
+#endif
+  return encode_blocks_none;
+}
+
+void base64_encode(const uint8_t *base, size_t len, char *out) noexcept {
+  static const Encoder encode_blocks = select_encoder();
+  size_t done = encode_blocks(base, len, out);
+  encode_scalar(base + done, len - done, out + done / 3 * 4);
+}
+
 std::string base64_encode(const uint8_t *base, size_t len) noexcept {
-  static const std::string b64_table =
-      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-      "abcdefghijklmnopqrstuvwxyz"
-      "0123456789+/";
-  std::string res;
-  uint8_t in[3];
-  uint8_t out[4];
-  int state = 0;
-  auto copy = [&]() {
-    out[0] = (in[0] & 0xfc) >> 2;
-    out[1] = ((in[0] & 0x03) << 4) + ((in[1] & 0xf0) >> 4);
-    out[2] = ((in[1] & 0x0f) << 2) + ((in[2] & 0xc0) >> 6);
-    out[3] = in[2] & 0x3f;
-    for (int idx = 0; idx < 4; ++idx) {
-      res += (idx <= state) ? b64_table[out[idx]] : '=';
-    }
-  };
-  while (len-- > 0) {
-    in[state++] = *(base++);
-    if (state == 3) {
-      copy();
-      state = 0;
+  std::string res(base64_encoded_size(len), '\0');
+  if (len > 0) {
+    base64_encode(base, len, &res[0]);
+  }
+  return res;
+}
+
+// Decoding
+// ========
+
+// Maps each character to its 6 bit value, or to 0xff if it is not part of
+// the base64 alphabet.
+struct DecodeTable {
+  uint8_t values[256];
+
+  DecodeTable() noexcept {
+    memset(values, 0xff, sizeof(values));
+    for (uint8_t idx = 0; idx < 64; ++idx) {
+      values[(uint8_t)b64_table[idx]] = idx;
     }
   }
-  if (state != 0) {
-    for (int idx = state; idx < 3; ++idx) {
-      in[idx] = '\0';
+};
+
+// Decodes |len| characters, which must be a multiple of four, into |out|.
+// The last quantum may be padded.
+static bool decode_scalar(const char *base, size_t len, uint8_t *out) noexcept {
+  static const DecodeTable table;
+  const uint8_t *values = table.values;
+  for (size_t pos = 0; pos < len; pos += 4, out += 3) {
+    uint32_t a = values[(uint8_t)base[pos]];
+    uint32_t b = values[(uint8_t)base[pos + 1]];
+    uint32_t c = values[(uint8_t)base[pos + 2]];
+    uint32_t d = values[(uint8_t)base[pos + 3]];
+    if ((a | b | c | d) <= 0x3f) {
+      uint32_t word = (a << 18) | (b << 12) | (c << 6) | d;
+      out[0] = (uint8_t)(word >> 16);
+      out[1] = (uint8_t)(word >> 8);
+      out[2] = (uint8_t)word;
+      continue;
+    }
+    // Only the last quantum may contain padding. We also require the bits
+    // that the padding discards to be zero, so that each sequence of bytes
+    // has a single encoding.
+    if (pos + 4 != len || base[pos + 3] != '=' || (a | b) > 0x3f) {
+      return false;
+    }
+    out[0] = (uint8_t)((a << 2) | (b >> 4));
+    if (base[pos + 2] == '=') {
+      return (b & 0x0f) == 0;
+    }
+    if (c > 0x3f || (c & 0x03) != 0) {
+      return false;
     }
-    copy();
+    out[1] = (uint8_t)((b << 4) | (c >> 2));
   }
-  return res;
+  return true;
+}
+
+#ifdef BASE64_ENCODE_X86
+
+// Vectorized decoding from the same paper. Characters are validated using
+// two tables indexed by their high and low nibbles, translated into their
+// 6 bit values by adding an offset that depends on the high nibble (and on
+// whether the character is '/'), and packed using multiply-add. A block
+// with an invalid character, including padding, is left to decode_scalar().
+
+#define BASE64_LUT_LO                                                     \
+  0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, \
+      0x1b, 0x1b, 0x1b, 0x1a
+
+#define BASE64_LUT_HI                                                     \
+  0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, \
+      0x10, 0x10, 0x10, 0x10
+
+#define BASE64_LUT_ROLL 0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+
+#define BASE64_PACK 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+// Decodes 16 characters into 12 bytes, writing 16 bytes to |out|.
+__attribute__((target("ssse3"))) static inline bool decode_ssse3(
+    const char *base, uint8_t *out) noexcept {
+  __m128i in = _mm_loadu_si128((const __m128i *)base);
+  __m128i hi_nibbles =
+      _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+  __m128i lo_nibbles = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+  __m128i lo = _mm_shuffle_epi8(_mm_setr_epi8(BASE64_LUT_LO), lo_nibbles);
+  __m128i hi = _mm_shuffle_epi8(_mm_setr_epi8(BASE64_LUT_HI), hi_nibbles);
+  if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi),
+                                       _mm_setzero_si128())) != 0) {
+    return false;
+  }
+  __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+  __m128i roll = _mm_shuffle_epi8(_mm_setr_epi8(BASE64_LUT_ROLL),
+                                  _mm_add_epi8(slash, hi_nibbles));
+  __m128i values = _mm_add_epi8(in, roll);
+  __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  __m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+  _mm_storeu_si128((__m128i *)out,
+                   _mm_shuffle_epi8(words, _mm_setr_epi8(BASE64_PACK)));
+  return true;
+}
+
+__attribute__((target("ssse3"))) static size_t decode_blocks_ssse3(
+    const char *base, size_t len, uint8_t *out) noexcept {
+  size_t done = 0;
+  for (; len - done >= 16 && decode_ssse3(base + done, out); done += 16) {
+    out += 12;
+  }
+  return done;
+}
+
+// Like decode_ssse3() but decodes 32 characters into 24 bytes, writing 32
+// bytes to |out|. We pack each lane and then move the two 12 byte halves
+// next to each other.
+__attribute__((target("avx2"))) static inline bool decode_avx2(
+    const char *base, uint8_t *out) noexcept {
+  __m256i in = _mm256_loadu_si256((const __m256i *)base);
+  __m256i hi_nibbles =
+      _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0f));
+  __m256i lo_nibbles = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+  __m256i lo = _mm256_shuffle_epi8(
+      _mm256_setr_epi8(BASE64_LUT_LO, BASE64_LUT_LO), lo_nibbles);
+  __m256i hi = _mm256_shuffle_epi8(
+      _mm256_setr_epi8(BASE64_LUT_HI, BASE64_LUT_HI), hi_nibbles);
+  if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(lo, hi),
+                                             _mm256_setzero_si256())) != 0) {
+    return false;
+  }
+  __m256i slash = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+  __m256i roll =
+      _mm256_shuffle_epi8(_mm256_setr_epi8(BASE64_LUT_ROLL, BASE64_LUT_ROLL),
+                          _mm256_add_epi8(slash, hi_nibbles));
+  __m256i values = _mm256_add_epi8(in, roll);
+  __m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+  __m256i words = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+  words = _mm256_shuffle_epi8(words,
+                              _mm256_setr_epi8(BASE64_PACK, BASE64_PACK));
+  words = _mm256_permutevar8x32_epi32(
+      words, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+  _mm256_storeu_si256((__m256i *)out, words);
+  return true;
+}
+
+__attribute__((target("avx2"))) static size_t decode_blocks_avx2(
+    const char *base, size_t len, uint8_t *out) noexcept {
+  size_t done = 0;
+  for (; len - done >= 32 && decode_avx2(base + done, out); done += 32) {
+    out += 24;
+  }
+  return done;
+}
+
+#endif  // BASE64_ENCODE_X86
+
+// Decodes the largest multiple of four characters that the kernel can
+// handle and returns the number of decoded characters. The kernels write
+// up to |decode_slack| bytes past the decoded bytes.
+using Decoder = size_t (*)(const char *, size_t, uint8_t *);
+
+static constexpr size_t decode_slack = 8;
+
+static size_t decode_blocks_none(const char *, size_t, uint8_t *) noexcept {
+  return 0;
+}
+
+static Decoder select_decoder() noexcept {
+#ifdef BASE64_ENCODE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return decode_blocks_avx2;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    return decode_blocks_ssse3;
+  }
+#endif
+  return decode_blocks_none;
+}
+
+bool base64_decode(const char *base, size_t len, std::string *out) noexcept {
+  static const Decoder decode_blocks = select_decoder();
+  if (!base || !out || len % 4 != 0) {
+    return false;
+  }
+  size_t size = len / 4 * 3;
+  if (len > 0 && base[len - 1] == '=') {
+    size -= (base[len - 2] == '=') ? 2 : 1;
+  }
+  out->resize(size + decode_slack);
+  auto data = (uint8_t *)&(*out)[0];
+  size_t done = decode_blocks(base, len, data);
+  bool ok = decode_scalar(base + done, len - done, data + done / 4 * 3);
+  out->resize(size);
+  return ok;
 }
 
 }  // namespace libjson
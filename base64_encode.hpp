@@ -38,6 +38,20 @@ namespace libjson {
 
 std::string base64_encode(const uint8_t *base, size_t len) noexcept;
 
+// Returns the size of the base64 encoding of |len| bytes.
+inline size_t base64_encoded_size(size_t len) noexcept {
+  return 4 * ((len + 2) / 3);
+}
+
+// Encodes [base, base + len) into |out|, which must have room for exactly
+// base64_encoded_size(len) characters.
+void base64_encode(const uint8_t *base, size_t len, char *out) noexcept;
+
+// Decodes [base, base + len) into |out|, reusing its memory. Fails if the
+// input is not padded base64 like the one produced by base64_encode(), in
+// which case the content of |out| is unspecified.
+bool base64_decode(const char *base, size_t len, std::string *out) noexcept;
+
 }  // namespace libjson
 }  // namespace mk
 #endif
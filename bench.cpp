@@ -0,0 +1,696 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "libjson.hpp"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base64_encode.hpp"
+#include "nlohmann_json.hpp"
+#include "number_format.hpp"
+#include "utf8_decode.hpp"
+#include "utf8_validate.hpp"
+
+using namespace mk::libjson;
+
+// Harness
+// =======
+//
+// Runs |func| |count| times and prints the average cost per iteration.
+
+static void bench(const char *descr, size_t count,
+                  std::function<void()> func) noexcept {
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; ++i) {
+    func();
+  }
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::nano> elapsed = end - begin;
+  printf("%-48s %12.1f ns/op\n", descr, elapsed.count() / (double)count);
+}
+
+// Runs |func| |count| times and prints the throughput, where |bytes| is
+// the number of bytes processed by each iteration.
+static void bench_bytes(const char *descr, size_t count, size_t bytes,
+                        std::function<void()> func) noexcept {
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; ++i) {
+    func();
+  }
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = end - begin;
+  printf("%-48s %12.1f MB/s\n", descr,
+         (double)bytes * (double)count / elapsed.count() / 1e6);
+}
+
+// Returns a serialized report similar to the ones produced by our
+// measurements: annotations, some HTTP requests with headers and body,
+// and arrays of RTT samples.
+static std::string make_report() noexcept {
+  Json doc;
+  (void)doc.set_string("/annotations/engine_name", "libmeasurement_kit");
+  (void)doc.set_string("/annotations/platform", "linux");
+  (void)doc.set_float("/test_runtime", 12.345678);
+  for (int i = 0; i < 64; ++i) {
+    std::string prefix = "/test_keys/requests/" + std::to_string(i);
+    (void)doc.set_string(prefix + "/request/url",
+                         "https://www.example.com/path/" + std::to_string(i));
+    (void)doc.set_string(prefix + "/response/headers/Content-Type",
+                         "text/html; charset=\"utf-8\"");
+    std::string body;
+    while (body.size() < 4096) {
+      body += "<p class=\"x\">Lorem ipsum dolor sit amet\tè\n</p>";
+    }
+    (void)doc.set_string(prefix + "/response/body", body);
+    (void)doc.set_integer(prefix + "/response/code", 200);
+    for (int j = 0; j < 256; ++j) {
+      (void)doc.push_float(prefix + "/rtts", 0.0123456789 * (j + 1) * (i + 1));
+    }
+  }
+  std::string s;
+  (void)doc.serialize(&s);
+  return s;
+}
+
+// Lookup
+// ======
+//
+// Make sure that looking up a missing field costs about as much as
+// looking up an existing field.
+
+static void bench_lookup() noexcept {
+  Json doc;
+  (void)doc.set_string("/annotations/engine_name", "libmeasurement_kit");
+  (void)doc.set_float("/test_keys/elapsed", 1.14);
+  (void)doc.push_integer("/test_keys/rtts", 17);
+  constexpr size_t count = 1000000;
+  bench("get_string hit", count, [&]() {
+    std::string s;
+    (void)doc.get_string("/annotations/engine_name", &s);
+  });
+  bench("get_string miss", count, [&]() {
+    std::string s;
+    (void)doc.get_string("/annotations/platform", &s);
+  });
+  bench("get_float hit", count, [&]() {
+    double d = 0.0;
+    (void)doc.get_float("/test_keys/elapsed", &d);
+  });
+  bench("get_float miss (wrong type)", count, [&]() {
+    double d = 0.0;
+    (void)doc.get_float("/annotations/engine_name", &d);
+  });
+  bench("get_integer hit (array element)", count, [&]() {
+    int64_t v = 0;
+    (void)doc.get_integer("/test_keys/rtts/0", &v);
+  });
+  bench("get_integer miss (out of range)", count, [&]() {
+    int64_t v = 0;
+    (void)doc.get_integer("/test_keys/rtts/1", &v);
+  });
+  bench("set_integer invalid path", count, [&]() {
+    (void)doc.set_integer("/test_keys/elapsed/x", 17);
+  });
+}
+
+// Pointer
+// =======
+//
+// Compare string paths with precompiled pointers.
+
+static void bench_pointer() noexcept {
+  Json doc;
+  (void)doc.set_float("/test_keys/requests/0/response/elapsed", 1.14);
+  Pointer elapsed{"/test_keys/requests/0/response/elapsed"};
+  constexpr size_t count = 1000000;
+  bench("get_float string path", count, [&]() {
+    double d = 0.0;
+    (void)doc.get_float("/test_keys/requests/0/response/elapsed", &d);
+  });
+  bench("get_float precompiled pointer", count, [&]() {
+    double d = 0.0;
+    (void)doc.get_float(elapsed, &d);
+  });
+  bench("set_float string path", count, [&]() {
+    (void)doc.set_float("/test_keys/requests/0/response/elapsed", 1.14);
+  });
+  bench("set_float precompiled pointer", count,
+        [&]() { (void)doc.set_float(elapsed, 1.14); });
+}
+
+// Pointer set
+// ===========
+//
+// Compare reading 40 fields of a report one pointer at a time with reading
+// them at once using a pointer set.
+
+static void bench_pointer_set() noexcept {
+  Json doc;
+  (void)doc.parse(make_report());
+  std::vector<std::pair<Pointer, ValueType>> pointers{
+      {Pointer{"/annotations/engine_name"}, ValueType::kString},
+      {Pointer{"/annotations/platform"}, ValueType::kString},
+      {Pointer{"/annotations/missing"}, ValueType::kString},
+      {Pointer{"/test_runtime"}, ValueType::kFloat},
+  };
+  for (int i = 0; i < 12; ++i) {
+    std::string prefix = "/test_keys/requests/" + std::to_string(i);
+    pointers.emplace_back(Pointer{prefix + "/request/url"},
+                          ValueType::kString);
+    pointers.emplace_back(Pointer{prefix + "/response/headers/Content-Type"},
+                          ValueType::kString);
+    pointers.emplace_back(Pointer{prefix + "/response/code"},
+                          ValueType::kInteger);
+  }
+  PointerSet set;
+  for (auto &pair : pointers) {
+    (void)set.add(pair.first, pair.second);
+  }
+  std::vector<PointerValue> values(pointers.size());
+  constexpr size_t count = 100000;
+  bench("get 40 precompiled pointers", count, [&]() {
+    for (size_t i = 0; i < pointers.size(); ++i) {
+      PointerValue &value = values[i];
+      switch (pointers[i].second) {
+        case ValueType::kFloat:
+          value.found = doc.get_float(pointers[i].first, &value.float_value);
+          break;
+        case ValueType::kInteger:
+          value.found =
+              doc.get_integer(pointers[i].first, &value.integer_value);
+          break;
+        default:
+          value.found =
+              doc.get_string(pointers[i].first, &value.string_value);
+          break;
+      }
+    }
+  });
+  bench("get_values 40 pointers in a set", count,
+        [&]() { (void)doc.get_values(set, &values); });
+}
+
+// Build
+// =====
+//
+// Compare building a report with a sequence of set calls with building it
+// at once from a pointer set.
+
+static void bench_build() noexcept {
+  std::vector<Pointer> pointers;
+  std::vector<ValueType> types;
+  std::vector<PointerValue> values;
+  auto add = [&](std::string path, ValueType type) -> PointerValue & {
+    pointers.emplace_back(std::move(path));
+    types.push_back(type);
+    values.emplace_back();
+    values.back().found = true;
+    return values.back();
+  };
+  add("/annotations/engine_name", ValueType::kString).string_value =
+      "libmeasurement_kit";
+  add("/annotations/platform", ValueType::kString).string_value = "linux";
+  add("/test_runtime", ValueType::kFloat).float_value = 12.345678;
+  for (int i = 0; i < 64; ++i) {
+    std::string prefix = "/test_keys/requests/" + std::to_string(i);
+    add(prefix + "/request/url", ValueType::kString).string_value =
+        "https://www.example.com/path/" + std::to_string(i);
+    add(prefix + "/request/method", ValueType::kString).string_value = "GET";
+    for (int j = 0; j < 8; ++j) {
+      add(prefix + "/response/headers/X-Header-" + std::to_string(j),
+          ValueType::kString)
+          .string_value = "text/html; charset=\"utf-8\"";
+    }
+    add(prefix + "/response/code", ValueType::kInteger).integer_value = 200;
+    add(prefix + "/response/elapsed", ValueType::kFloat).float_value = 0.25;
+    add(prefix + "/response/ok", ValueType::kBoolean).boolean_value = true;
+  }
+  PointerSet set;
+  for (size_t i = 0; i < pointers.size(); ++i) {
+    (void)set.add(pointers[i], types[i]);
+  }
+  std::string descr = "set " + std::to_string(values.size()) +
+                      " precompiled pointers";
+  Json doc{Allocation::kArena};
+  bench(descr.c_str(), 1000, [&]() {
+    doc.reset();
+    for (size_t i = 0; i < values.size(); ++i) {
+      switch (types[i]) {
+        case ValueType::kBoolean:
+          (void)doc.set_boolean(pointers[i], values[i].boolean_value);
+          break;
+        case ValueType::kFloat:
+          (void)doc.set_float(pointers[i], values[i].float_value);
+          break;
+        case ValueType::kInteger:
+          (void)doc.set_integer(pointers[i], values[i].integer_value);
+          break;
+        default:
+          (void)doc.set_string(pointers[i], values[i].string_value);
+          break;
+      }
+    }
+  });
+  descr = "build " + std::to_string(values.size()) + " values at once";
+  bench(descr.c_str(), 1000, [&]() {
+    doc.reset();
+    (void)doc.build(set, values);
+  });
+}
+
+// Parse
+// =====
+//
+// Compare the throughput of the parse backends.
+
+static void bench_parse() noexcept {
+  std::string report = make_report();
+  constexpr size_t count = 20;
+  bench_bytes("parse default backend", count, report.size(), [&]() {
+    Json doc;
+    (void)doc.parse(report.data(), report.size(), ParseBackend::kDefault);
+  });
+  bench_bytes("parse simd backend", count, report.size(), [&]() {
+    Json doc;
+    (void)doc.parse(report.data(), report.size(), ParseBackend::kSimd);
+  });
+  std::vector<Pointer> pointers = {
+      Pointer{"/annotations/engine_name"}, Pointer{"/test_runtime"},
+      Pointer{"/test_keys/requests/3/response/code"}};
+  bench_bytes("projection parse (3 pointers)", count, report.size(), [&]() {
+    Json doc;
+    (void)doc.parse(report.data(), report.size(), pointers);
+  });
+  bench_bytes("sax parse (no DOM)", count, report.size(), [&]() {
+    SaxHandler handler;
+    (void)sax_parse(report.data(), report.size(), &handler);
+  });
+  bench_bytes("stream parser (4 KiB chunks)", count, report.size(), [&]() {
+    StreamParser parser;
+    for (size_t pos = 0; pos < report.size(); pos += 4096) {
+      size_t size = report.size() - pos;
+      (void)parser.feed(report.data() + pos, size < 4096 ? size : 4096);
+    }
+    Json doc;
+    (void)parser.finish(&doc);
+  });
+}
+
+// Arena
+// =====
+//
+// Compare building and parsing documents using the heap and using an
+// arena that we reset for each document, like in a processing loop.
+
+static void build_small_report(Json *doc) noexcept {
+  (void)doc->set_string("/annotations/engine_name", "libmeasurement_kit");
+  (void)doc->set_string("/input", "https://www.example.com/");
+  for (int i = 0; i < 32; ++i) {
+    (void)doc->push_string("/test_keys/queries", "query " + std::to_string(i));
+    (void)doc->push_float("/test_keys/rtts", 0.0123456789 * (i + 1));
+  }
+}
+
+// Returns an array of many small objects, which is the kind of document
+// where the cost of allocating each node is most visible.
+static std::string make_objects() noexcept {
+  std::string s = "[";
+  for (int i = 0; i < 20000; ++i) {
+    s += (i > 0) ? "," : "";
+    s += "{\"name\":\"item" + std::to_string(i) +
+         "\",\"tags\":[\"a\",\"b\"],\"ok\":true}";
+  }
+  s += "]";
+  return s;
+}
+
+static void bench_arena() noexcept {
+  std::string input = make_objects();
+  constexpr size_t count = 20;
+  bench_bytes("parse small objects (heap)", count, input.size(), [&]() {
+    Json doc;
+    (void)doc.parse(input.data(), input.size(), ParseBackend::kSimd);
+  });
+  Json arena_doc{Allocation::kArena};
+  bench_bytes("parse small objects (arena)", count, input.size(), [&]() {
+    arena_doc.reset();
+    (void)arena_doc.parse(input.data(), input.size(), ParseBackend::kSimd);
+  });
+  bench("build small report (heap)", 2000, [&]() {
+    Json doc;
+    build_small_report(&doc);
+  });
+  bench("build small report (arena)", 2000, [&]() {
+    arena_doc.reset();
+    build_small_report(&arena_doc);
+  });
+}
+
+// UTF-8
+// =====
+//
+// Compare the vectorized UTF-8 validator with the DFA it replaces, on an
+// ASCII body and on a body containing some multibyte characters, and then
+// measure the cost of storing such bodies using set_string().
+
+static bool validate_dfa(const std::string &input) noexcept {
+  uint32_t state = UTF8_ACCEPT;
+  uint32_t codepoint = 0;
+  for (char ch : input) {
+    if (utf8_decode(&state, &codepoint, (uint8_t)ch) == UTF8_REJECT) {
+      return false;
+    }
+  }
+  return state == UTF8_ACCEPT;
+}
+
+static void bench_utf8() noexcept {
+  std::string ascii, mixed;
+  while (ascii.size() < 256 * 1024) {
+    ascii += "<p class=\"x\">Lorem ipsum dolor sit amet</p>\n";
+    mixed += "<p class=\"x\">Lorem ipsum dolor sit \xc3\xa8\xe2\x82\xac</p>\n";
+  }
+  constexpr size_t count = 200;
+  volatile bool result = false;
+  bench_bytes("utf8 dfa (ascii)", count, ascii.size(),
+              [&]() { result = validate_dfa(ascii); });
+  bench_bytes("utf8 validate (ascii)", count, ascii.size(), [&]() {
+    result = utf8_validate(ascii.data(), ascii.size());
+  });
+  bench_bytes("utf8 dfa (multibyte)", count, mixed.size(),
+              [&]() { result = validate_dfa(mixed); });
+  bench_bytes("utf8 validate (multibyte)", count, mixed.size(), [&]() {
+    result = utf8_validate(mixed.data(), mixed.size());
+  });
+  (void)result;
+  Json doc;
+  bench_bytes("set_string 256 KiB body", count, ascii.size(),
+              [&]() { (void)doc.set_string("/body", ascii); });
+}
+
+// Base64
+// ======
+//
+// Measure encoding and decoding binary data, alone and as part of
+// set_string() and get_bytes().
+
+static void bench_base64() noexcept {
+  std::string binary;
+  uint32_t state = 17;
+  while (binary.size() < 256 * 1024) {
+    state = state * 1103515245 + 12345;
+    binary += (char)(state >> 16);
+  }
+  constexpr size_t count = 200;
+  bench_bytes("base64_encode 256 KiB", count, binary.size(), [&]() {
+    (void)base64_encode((const uint8_t *)binary.data(), binary.size());
+  });
+  std::string encoded =
+      base64_encode((const uint8_t *)binary.data(), binary.size());
+  std::string decoded;
+  bench_bytes("base64_decode 256 KiB", count, binary.size(), [&]() {
+    (void)base64_decode(encoded.data(), encoded.size(), &decoded);
+  });
+  Json doc;
+  bench_bytes("set_string 256 KiB binary body", count, binary.size(),
+              [&]() { (void)doc.set_string("/body", binary); });
+  bench_bytes("get_bytes 256 KiB binary body", count, binary.size(),
+              [&]() { (void)doc.get_bytes("/body", &decoded); });
+  // Storing raw bytes defers the encoding to serialize(), where we write
+  // it directly into the output rather than copying it from the document.
+  std::string output;
+  bench_bytes("set_string+serialize 256 KiB binary body", count,
+              binary.size(), [&]() {
+                (void)doc.set_string("/body", binary);
+                (void)doc.serialize(&output);
+              });
+  bench_bytes("set_bytes+serialize 256 KiB binary body", count,
+              binary.size(), [&]() {
+                (void)doc.set_bytes("/body", binary);
+                (void)doc.serialize(&output);
+              });
+  bench_bytes("get_bytes 256 KiB raw body", count, binary.size(),
+              [&]() { (void)doc.get_bytes("/body", &decoded); });
+}
+
+// Serialize
+// =========
+//
+// Compare serializing into a new string, appending to a reused buffer,
+// and streaming the output, which only needs a buffer of constant size.
+
+static void bench_serialize() noexcept {
+  std::string report = make_report();
+  Json doc;
+  (void)doc.parse(report);
+  constexpr size_t count = 50;
+  std::string output;
+  bench_bytes("serialize report to string", count, report.size(),
+              [&]() { (void)doc.serialize(&output); });
+  bench_bytes("serialize report to reused buffer", count, report.size(),
+              [&]() {
+                output.clear();
+                (void)doc.serialize_append(&output);
+              });
+  bench_bytes("serialize report to writer", count, report.size(), [&]() {
+    (void)doc.serialize([](const char *, size_t) { return true; });
+  });
+  // Strings parsed by the SIMD backend know whether they need escaping.
+  Json parsed;
+  (void)parsed.parse(report, ParseBackend::kSimd);
+  bench_bytes("serialize SIMD-parsed report to reused buffer", count,
+              report.size(), [&]() {
+                output.clear();
+                (void)parsed.serialize_append(&output);
+              });
+  Json small;
+  (void)small.set_string("/annotations/engine_name", "libmeasurement_kit");
+  (void)small.set_string("/input", "https://www.example.com/");
+  (void)small.set_integer("/test_keys/status_code", 200);
+  bench("serialize small document to string", 1000000,
+        [&]() { (void)small.serialize(&output); });
+  bench("serialize small document to reused buffer", 1000000, [&]() {
+    output.clear();
+    (void)small.serialize_append(&output);
+  });
+  // Body-heavy report: long HTML bodies where we escape a few characters
+  // per line, as in pages fetched by web connectivity measurements.
+  std::string line = "<div class=\"content\">";
+  while (line.size() < 120) {
+    line += " lorem ipsum dolor sit amet";
+  }
+  line += "</div>\n";
+  std::string body;
+  while (body.size() < 64 * 1024) {
+    body += line;
+  }
+  Json bodies;
+  for (size_t i = 0; i < 16; ++i) {
+    (void)bodies.set_string(
+        "/requests/" + std::to_string(i) + "/response/body", body);
+  }
+  size_t bodies_size = 16 * body.size();
+  bench_bytes("serialize body-heavy report to reused buffer", count,
+              bodies_size, [&]() {
+                output.clear();
+                (void)bodies.serialize_append(&output);
+              });
+  FILE *filep = fopen("/dev/null", "wb");
+  if (filep) {
+    bench_bytes("serialize report to /dev/null fd", count, report.size(),
+                [&]() { (void)doc.serialize_fd(fileno(filep)); });
+    (void)fclose(filep);
+  }
+}
+
+// Numbers
+// =======
+//
+// Compare our number formatting with the one of nlohmann::json, on its own
+// and when serializing arrays of RTT samples, and measure how fast we parse
+// such arrays back.
+
+static void bench_numbers() noexcept {
+  constexpr size_t samples = 1000000;
+  std::vector<double> rtts;
+  std::vector<int64_t> integers;
+  uint32_t state = 17;
+  for (size_t i = 0; i < samples; ++i) {
+    state = state * 1103515245 + 12345;
+    rtts.push_back((double)(state >> 8) / 1e6);
+    integers.push_back((int64_t)(state >> 4) - (1 << 27));
+  }
+  char buffer[64];
+  bench("nlohmann to_chars RTT sample", samples, [&]() {
+    static size_t i = 0;
+    (void)nlohmann::detail::to_chars(buffer, buffer + sizeof(buffer),
+                                     rtts[i++ % samples]);
+  });
+  bench("format_double RTT sample", samples, [&]() {
+    static size_t i = 0;
+    (void)format_double(rtts[i++ % samples], buffer);
+  });
+  bench("format_integer", samples, [&]() {
+    static size_t i = 0;
+    (void)format_integer(integers[i++ % samples], buffer);
+  });
+  Json doc;
+  nlohmann::json control;
+  for (size_t i = 0; i < samples; ++i) {
+    (void)doc.push_float("/rtts", rtts[i]);
+    control["rtts"].push_back(rtts[i]);
+  }
+  std::string output;
+  (void)doc.serialize(&output);
+  bench_bytes("nlohmann dump 1M RTT samples", 5, output.size(),
+              [&]() { (void)control.dump(); });
+  bench_bytes("serialize 1M RTT samples", 5, output.size(), [&]() {
+    output.clear();
+    (void)doc.serialize_append(&output);
+  });
+  Json parsed;
+  bench_bytes("parse 1M RTT samples (default backend)", 5, output.size(),
+              [&]() { (void)parsed.parse(output, ParseBackend::kDefault); });
+  bench_bytes("parse 1M RTT samples (simd backend)", 5, output.size(),
+              [&]() { (void)parsed.parse(output, ParseBackend::kSimd); });
+}
+
+// Batch
+// =====
+//
+// Compare building and reading back an array of RTT samples one element at
+// a time with doing that in batch.
+
+static void bench_batch() noexcept {
+  constexpr size_t samples = 1000000;
+  std::vector<double> rtts;
+  uint32_t state = 17;
+  for (size_t i = 0; i < samples; ++i) {
+    state = state * 1103515245 + 12345;
+    rtts.push_back((double)(state >> 8) / 1e6);
+  }
+  Pointer path{"/test_keys/rtts"};
+  constexpr size_t bytes = samples * sizeof(double);
+  bench_bytes("push_float 1M RTT samples", 3, bytes, [&]() {
+    Json doc;
+    for (double rtt : rtts) {
+      (void)doc.push_float(path, rtt);
+    }
+  });
+  bench_bytes("push_floats 1M RTT samples", 3, bytes, [&]() {
+    Json doc;
+    (void)doc.push_floats(path, rtts.data(), rtts.size());
+  });
+  Json doc;
+  (void)doc.push_floats(path, rtts.data(), rtts.size());
+  std::vector<double> values;
+  bench_bytes("get_array_keys+get_float 1M RTT samples", 3, bytes, [&]() {
+    ArrayKeys keys;
+    (void)doc.get_array_keys(path, &keys);
+    values.clear();
+    for (auto key : keys) {
+      double value = 0.0;
+      (void)doc.get_float(key, &value);
+      values.push_back(value);
+    }
+  });
+  bench_bytes("get_float by index 1M RTT samples", 3, bytes, [&]() {
+    ArrayKeys keys;
+    (void)doc.get_array_keys(path, &keys);
+    values.clear();
+    for (size_t i = 0; i < keys.size(); ++i) {
+      double value = 0.0;
+      (void)doc.get_float(keys, i, &value);
+      values.push_back(value);
+    }
+  });
+  bench_bytes("get_floats 1M RTT samples", 3, bytes,
+              [&]() { (void)doc.get_floats(path, &values); });
+}
+
+// Cursor
+// ======
+//
+// Compare building the requests of a report with absolute paths, which we
+// resolve from the root every time, with doing that relative to a cursor.
+
+static void bench_cursor() noexcept {
+  constexpr size_t requests = 64;
+  constexpr size_t fields = 40;
+  std::vector<std::string> names;
+  for (size_t i = 0; i < fields; ++i) {
+    names.push_back("/header_" + std::to_string(i));
+  }
+  bench("set_string 64x40 fields with paths", 100, [&]() {
+    Json doc{Allocation::kArena};
+    for (size_t i = 0; i < requests; ++i) {
+      std::string prefix = "/test_keys/requests/" + std::to_string(i) +
+                           "/response/headers";
+      for (auto &name : names) {
+        (void)doc.set_string(prefix + name, "text/html");
+      }
+    }
+  });
+  bench("set_string 64x40 fields with a cursor", 100, [&]() {
+    Json doc{Allocation::kArena};
+    for (size_t i = 0; i < requests; ++i) {
+      Json::Cursor cursor;
+      (void)doc.get_cursor("/test_keys/requests/" + std::to_string(i) +
+                               "/response/headers",
+                           &cursor);
+      for (auto &name : names) {
+        (void)cursor.set_string(name, "text/html");
+      }
+    }
+  });
+}
+
+// NDJSON
+// ======
+//
+// Compare the throughput of the NDJSON reader with a growing number of
+// threads, to check that it scales with the number of cores.
+
+static void bench_ndjson() noexcept {
+  std::string report = make_report();
+  std::string input;
+  for (size_t i = 0; i < 16; ++i) {
+    input += report;
+    input += "\n";
+  }
+  size_t cores = std::max(std::thread::hardware_concurrency(), 1U);
+  for (size_t threads = 1; threads <= cores; threads *= 2) {
+    NdjsonReader reader;
+    reader.set_threads(threads);
+    std::string descr = "ndjson reader " + std::to_string(threads) +
+                        " thread(s)";
+    bench_bytes(descr.c_str(), 4, input.size(), [&]() {
+      (void)reader.read(input.data(), input.size(),
+                        [](size_t, bool, Json &) {});
+    });
+  }
+}
+
+int main() {
+  bench_lookup();
+  bench_pointer();
+  bench_pointer_set();
+  bench_build();
+  bench_parse();
+  bench_arena();
+  bench_utf8();
+  bench_base64();
+  bench_serialize();
+  bench_numbers();
+  bench_batch();
+  bench_cursor();
+  bench_ndjson();
+}
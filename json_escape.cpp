@@ -0,0 +1,105 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "json_escape.hpp"
+
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JSON_ESCAPE_X86 1
+#include <immintrin.h>
+#endif
+
+namespace mk {
+namespace libjson {
+
+// Scalar
+// ======
+
+static inline bool needs_escape(char ch) noexcept {
+  return (uint8_t)ch < 0x20 || ch == '"' || ch == '\\';
+}
+
+static size_t find_scalar(const char *data, size_t size, size_t pos) noexcept {
+  while (pos < size && !needs_escape(data[pos])) {
+    pos += 1;
+  }
+  return pos;
+}
+
+#ifdef JSON_ESCAPE_X86
+
+// Vector
+// ======
+//
+// We compare each byte with the quote and the backslash, and we find the
+// control characters with a saturating subtraction, which is zero for the
+// bytes not larger than 0x1f.
+
+__attribute__((target("sse2"))) static size_t find_sse2(
+    const char *data, size_t size, size_t pos) noexcept {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  const __m128i zero = _mm_setzero_si128();
+  for (; size - pos >= 16; pos += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(data + pos));
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+        _mm_cmpeq_epi8(_mm_subs_epu8(v, control), zero));
+    int mask = _mm_movemask_epi8(special);
+    if (mask != 0) {
+      return pos + (size_t)__builtin_ctz((unsigned)mask);
+    }
+  }
+  return find_scalar(data, size, pos);
+}
+
+__attribute__((target("avx2"))) static size_t find_avx2(
+    const char *data, size_t size, size_t pos) noexcept {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control = _mm256_set1_epi8(0x1f);
+  const __m256i zero = _mm256_setzero_si256();
+  for (; size - pos >= 32; pos += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(data + pos));
+    __m256i special = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                        _mm256_cmpeq_epi8(v, backslash)),
+        _mm256_cmpeq_epi8(_mm256_subs_epu8(v, control), zero));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(special);
+    if (mask != 0) {
+      return pos + (size_t)__builtin_ctz(mask);
+    }
+  }
+  return find_sse2(data, size, pos);
+}
+
+#endif  // JSON_ESCAPE_X86
+
+// Dispatch
+// ========
+
+using Finder = size_t (*)(const char *, size_t, size_t);
+
+static Finder select_finder() noexcept {
+#ifdef JSON_ESCAPE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return find_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return find_sse2;
+  }
+#endif
+  return find_scalar;
+}
+
+size_t find_escape(const char *data, size_t size, size_t pos) noexcept {
+  static const Finder find = select_finder();
+  return find(data, size, pos);
+}
+
+}  // namespace libjson
+}  // namespace mk
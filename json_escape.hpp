@@ -0,0 +1,20 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef JSON_ESCAPE_HPP
+#define JSON_ESCAPE_HPP
+
+#include <stddef.h>
+
+namespace mk {
+namespace libjson {
+
+// Returns the position of the first character at or after |pos| that we
+// must escape in a JSON string, i.e., a quote, a backslash or a control
+// character, or |size| if there is none. This checks 32 or 16 bytes at a
+// time using SIMD instructions when available.
+size_t find_escape(const char *data, size_t size, size_t pos) noexcept;
+
+}  // namespace libjson
+}  // namespace mk
+#endif
@@ -4,67 +4,246 @@
 
 #include "libjson.hpp"
 
-#include <sstream>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#include <limits.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "arena.hpp"
 #include "base64_encode.hpp"
+#include "json_escape.hpp"
 #include "nlohmann_json.hpp"
-#include "utf8_decode.hpp"
+#include "number_format.hpp"
+#include "simd_parse.hpp"
+#include "stream_parse.hpp"
+#include "utf8_validate.hpp"
 
 namespace mk {
 namespace libjson {
 
 using Exception = nlohmann::json::exception;
 
+// String allocating through ArenaAllocator. When |binary| is true, it
+// contains raw bytes stored by set_bytes() or push_bytes(), which we encode
+// as base64 only when serializing, rather than UTF-8 text. Otherwise,
+// |flags| caches the result of utf8_scan(), when we know it, so that the
+// serializer does not need to scan the string again.
+class String
+    : public std::basic_string<char, std::char_traits<char>,
+                               ArenaAllocator<char>> {
+ public:
+  using Base =
+      std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+
+  using Base::Base;
+
+  String() noexcept {}
+
+  String(const Base &other) : Base{other} {}
+
+  String(Base &&other) noexcept : Base{std::move(other)} {}
+
+  bool binary = false;
+
+  unsigned flags = 0;
+};
+
+// Like nlohmann::json but allocating through ArenaAllocator, so that the
+// nodes of a Json using an arena are allocated from such arena.
+
+using Document = nlohmann::basic_json<std::map, std::vector, String, bool,
+                                      int64_t, uint64_t, double,
+                                      ArenaAllocator>;
+
 // Misc
 // ====
 
-static std::string possibly_encode(std::string value) noexcept {
-  uint32_t codepoint = 0;
-  uint32_t state = UTF8_ACCEPT;
-  for (char ch : value) {
-    (void)utf8_decode(&state, &codepoint, (uint8_t)ch);
-    if (state == UTF8_REJECT) {
-      break;
-    }
+static String possibly_encode(const std::string &value) noexcept {
+  unsigned flags = utf8_scan(value.data(), value.size());
+  if ((flags & utf8_valid) == 0) {
+    // Encode directly into the string, to avoid copying the encoding.
+    String str(base64_encoded_size(value.size()), '\0');
+    base64_encode((const uint8_t *)value.data(), value.size(), &str[0]);
+    str.flags = utf8_scanned | utf8_valid | utf8_ascii;
+    return str;
+  }
+  String str{value.data(), value.size()};
+  str.flags = flags;
+  return str;
+}
+
+static String make_bytes(const std::string &value) {
+  String str{value.data(), value.size()};
+  str.binary = true;
+  return str;
+}
+
+// Calls |func| with the content of the file at |path|, which is mapped
+// in memory rather than copied when the system allows that.
+static bool with_file_contents(
+    const std::string &path,
+    std::function<bool(const char *, size_t)> func) noexcept {
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat sb {};
+  if (::fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+    (void)::close(fd);
+    return false;
+  }
+  size_t size = (size_t)sb.st_size;
+  if (size == 0) {
+    (void)::close(fd);
+    return func("", 0);  // mmap() fails with zero length
   }
-  if (state != UTF8_ACCEPT) {
-    std::string s = base64_encode((uint8_t *)value.c_str(), value.size());
-    std::swap(s, value);
+  void *base = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  (void)::close(fd);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  (void)::madvise(base, size, MADV_SEQUENTIAL);
+  bool rv = func((const char *)base, size);
+  (void)::munmap(base, size);
+  return rv;
+#else
+  FILE *filep = fopen(path.c_str(), "rb");
+  if (!filep) {
+    return false;
+  }
+  std::string str;
+  char buffer[65536];
+  size_t count = 0;
+  while ((count = fread(buffer, 1, sizeof(buffer), filep)) > 0) {
+    str.append(buffer, count);
+  }
+  bool failed = ferror(filep) != 0;
+  (void)fclose(filep);
+  return !failed && func(str.data(), str.size());
+#endif
+}
+
+// Writes [data, data + size) to |fd|, retrying after partial writes and
+// interrupted system calls.
+static bool write_fully(int fd, const char *data, size_t size) noexcept {
+  while (size > 0) {
+#ifndef _WIN32
+    ssize_t count = ::write(fd, data, size);
+#else
+    int count = ::_write(fd, data, (unsigned)std::min(size, (size_t)INT_MAX));
+#endif
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += count;
+    size -= (size_t)count;
   }
-  return value;
+  return true;
 }
 
-static std::string make_array_path(std::string path, size_t size) noexcept {
-  std::stringstream stream;
-  stream << path;
+static std::string make_array_path(const std::string &path,
+                                   size_t index) noexcept {
+  char buffer[number_format_size];
+  char *end = format_unsigned(index, buffer);
+  std::string result;
+  result.reserve(path.size() + 1 + (size_t)(end - buffer));
+  result += path;
   if (path.size() > 0 && path[path.size() - 1] != '/') {
-    stream << "/";
+    result += '/';
   }
-  stream << size;
-  return stream.str();
+  result.append(buffer, end);
+  return result;
 }
 
 // ArrayKeys
 // =========
 
-ArrayKeys::Iter::Iter(const ArrayKeys &ak, size_t pos) noexcept : ak_{ak} {
+ArrayKeys::Iter::Iter(const ArrayKeys &ak, size_t pos) noexcept : ak_{&ak} {
   pos_ = pos;
 }
 
 std::string ArrayKeys::Iter::operator*() const noexcept {
-  return make_array_path(ak_.path_, pos_);
+  return make_array_path(ak_->path_, pos_);
+}
+
+std::string ArrayKeys::Iter::operator[](difference_type count) const
+    noexcept {
+  return *(*this + count);
 }
 
+size_t ArrayKeys::Iter::index() const noexcept { return pos_; }
+
 ArrayKeys::Iter &ArrayKeys::Iter::operator++() noexcept {
   pos_ += 1;
   return *this;
 }
 
-ArrayKeys::Iter &ArrayKeys::Iter::operator++(int /*dummy*/) noexcept {
+ArrayKeys::Iter ArrayKeys::Iter::operator++(int /*dummy*/) noexcept {
+  Iter copy = *this;
   pos_ += 1;
+  return copy;
+}
+
+ArrayKeys::Iter &ArrayKeys::Iter::operator--() noexcept {
+  pos_ -= 1;
+  return *this;
+}
+
+ArrayKeys::Iter ArrayKeys::Iter::operator--(int /*dummy*/) noexcept {
+  Iter copy = *this;
+  pos_ -= 1;
+  return copy;
+}
+
+ArrayKeys::Iter &ArrayKeys::Iter::operator+=(difference_type count) noexcept {
+  pos_ += (size_t)count;
   return *this;
 }
 
+ArrayKeys::Iter &ArrayKeys::Iter::operator-=(difference_type count) noexcept {
+  pos_ -= (size_t)count;
+  return *this;
+}
+
+ArrayKeys::Iter ArrayKeys::Iter::operator+(difference_type count) const
+    noexcept {
+  Iter copy = *this;
+  return copy += count;
+}
+
+ArrayKeys::Iter ArrayKeys::Iter::operator-(difference_type count) const
+    noexcept {
+  Iter copy = *this;
+  return copy -= count;
+}
+
+ArrayKeys::Iter::difference_type ArrayKeys::Iter::operator-(
+    const Iter &other) const noexcept {
+  return (difference_type)(pos_ - other.pos_);
+}
+
 bool ArrayKeys::Iter::operator==(const Iter &other) const noexcept {
   // TODO(bassosimone): also check for equality of ak_?
   return pos_ == other.pos_;
@@ -74,6 +253,22 @@ bool ArrayKeys::Iter::operator!=(const Iter &other) const noexcept {
   return !(*this == other);
 }
 
+bool ArrayKeys::Iter::operator<(const Iter &other) const noexcept {
+  return pos_ < other.pos_;
+}
+
+bool ArrayKeys::Iter::operator>(const Iter &other) const noexcept {
+  return other < *this;
+}
+
+bool ArrayKeys::Iter::operator<=(const Iter &other) const noexcept {
+  return !(other < *this);
+}
+
+bool ArrayKeys::Iter::operator>=(const Iter &other) const noexcept {
+  return !(*this < other);
+}
+
 ArrayKeys::ArrayKeys() noexcept {}
 
 ArrayKeys::ArrayKeys(std::string path, size_t size) noexcept {
@@ -91,146 +286,2265 @@ ArrayKeys::Iter ArrayKeys::end() const noexcept {
 
 size_t ArrayKeys::size() const noexcept { return size_; }
 
-// Json
-// ====
+// Lookup
+// ======
+//
+// Exception-free walk of a JSON pointer (RFC 6901). We cannot use the
+// nlohmann::json::json_pointer API because it reports a miss by throwing,
+// and our users probe many optional fields, so most lookups are misses.
 
-class Json::Impl {
+enum class Status { kOk, kInvalidPath, kNotFound, kWrongType };
+
+// Parses |token| if it is written like an array index, i.e. "0" or a
+// sequence of digits not starting with zero. Returns false if it is not,
+// and sets |*overflow| if it is too large to be a valid array index.
+static bool parse_index(const String &token, size_t *index,
+                        bool *overflow) noexcept {
+  *overflow = false;
+  if (token.empty() || (token.size() > 1 && token[0] == '0')) {
+    return false;
+  }
+  size_t value = 0;
+  for (char ch : token) {
+    if (ch < '0' || ch > '9') {
+      return false;
+    }
+    size_t digit = (size_t)(ch - '0');
+    // We exclude SIZE_MAX, so that extending an array to contain the
+    // element at |value| cannot overflow its size.
+    if (value > (SIZE_MAX - 1 - digit) / 10) {
+      *overflow = true;
+    }
+    value = value * 10 + digit;
+  }
+  *index = value;
+  return !*overflow;
+}
+
+// Returns true if |token| is a valid array index, i.e. "0" or a sequence
+// of digits not starting with zero, smaller than SIZE_MAX.
+static bool array_index(const String &token, size_t *index) noexcept {
+  bool overflow = false;
+  return parse_index(token, index, &overflow);
+}
+
+// Iterates over the reference tokens of a JSON pointer string. The current
+// token is unescaped into a buffer that is reused across tokens, so we do
+// not allocate unless a token is longer than the small string buffer.
+class Tokenizer {
  public:
-  nlohmann::json json;
+  explicit Tokenizer(const std::string &path) noexcept : path_{path} {
+    valid_ = path_.empty() || path_[0] == '/';
+  }
+
+  // Moves to the next token. Returns false at the end of the path or if
+  // the path is invalid, in which case valid() also returns false.
+  bool next() noexcept {
+    if (!valid_ || pos_ >= path_.size()) {
+      return false;
+    }
+    pos_ += 1;  // Skip the slash
+    token_.clear();
+    for (; pos_ < path_.size() && path_[pos_] != '/'; ++pos_) {
+      char ch = path_[pos_];
+      if (ch == '~') {
+        if (pos_ + 1 >= path_.size() ||
+            (path_[pos_ + 1] != '0' && path_[pos_ + 1] != '1')) {
+          valid_ = false;
+          return false;
+        }
+        ch = (path_[++pos_] == '0') ? '~' : '/';
+      }
+      token_ += ch;
+    }
+    // An index too large to be used would be taken as a key by objects
+    // but would corrupt arrays, so we reject it like a malformed token.
+    size_t index = 0;
+    bool overflow = false;
+    if (!parse_index(token_, &index, &overflow) && overflow) {
+      valid_ = false;
+      return false;
+    }
+    return true;
+  }
+
+  bool valid() const noexcept { return valid_; }
+
+  const String &token() const noexcept { return token_; }
+
+  bool index(size_t *value) const noexcept {
+    return array_index(token_, value);
+  }
+
+ private:
+  const std::string &path_;
+  String token_;
+  size_t pos_ = 0;
+  bool valid_ = false;
 };
 
-// Scalar operations
-// -----------------
+// Iterates over the reference tokens of a precompiled Pointer. Tokens
+// are already unescaped and array indexes are already parsed, so we only
+// copy the current token into a reused buffer having the document type.
+class PointerTokens {
+ public:
+  explicit PointerTokens(const Pointer &pointer) noexcept
+      : pointer_{pointer} {}
 
-#define SCALAR_SET_IMPL_(path, value)                      \
-  try {                                                    \
-    nlohmann::json::json_pointer pointer{std::move(path)}; \
-    impl_->json[std::move(pointer)] = value;               \
-  } catch (const Exception &) {                            \
-    return false;                                          \
-  }                                                        \
-  return true
+  bool next() noexcept {
+    if (!pointer_.valid_ || pos_ >= pointer_.tokens_.size()) {
+      return false;
+    }
+    const std::string &token = pointer_.tokens_[pos_++];
+    token_.assign(token.data(), token.size());
+    return true;
+  }
 
-bool Json::set_boolean(std::string path, bool value) noexcept {
-  SCALAR_SET_IMPL_(path, value);
-}
+  bool valid() const noexcept { return pointer_.valid_; }
 
-bool Json::set_float(std::string path, double value) noexcept {
-  SCALAR_SET_IMPL_(path, value);
-}
+  const String &token() const noexcept { return token_; }
 
-bool Json::set_integer(std::string path, int64_t value) noexcept {
-  SCALAR_SET_IMPL_(path, value);
-}
+  bool index(size_t *value) const noexcept {
+    *value = pointer_.indexes_[pos_ - 1];
+    return *value != Pointer::npos;
+  }
 
-bool Json::set_string(std::string path, std::string value) noexcept {
-  SCALAR_SET_IMPL_(path, possibly_encode(std::move(value)));
-}
-
-#define SCALAR_GET_IMPL_(path, value)                      \
-  if (!value) {                                            \
-    return false;                                          \
-  }                                                        \
-  try {                                                    \
-    nlohmann::json::json_pointer pointer{std::move(path)}; \
-    *value = impl_->json.at(std::move(pointer));           \
-  } catch (const Exception &) {                            \
-    return false;                                          \
-  }                                                        \
-  return true
+ private:
+  const Pointer &pointer_;
+  String token_;
+  size_t pos_ = 0;
+};
 
-bool Json::get_boolean(std::string path, bool *value) const noexcept {
-  SCALAR_GET_IMPL_(path, value);
+static Tokenizer make_tokens(const std::string &path) noexcept {
+  return Tokenizer{path};
 }
 
-bool Json::get_float(std::string path, double *value) const noexcept {
-  SCALAR_GET_IMPL_(path, value);
+static PointerTokens make_tokens(const Pointer &pointer) noexcept {
+  return PointerTokens{pointer};
 }
 
-bool Json::get_integer(std::string path, int64_t *value) const noexcept {
-  SCALAR_GET_IMPL_(path, value);
+// Returns true if |path| only contains valid reference tokens.
+static bool valid_path(const std::string &path) noexcept {
+  Tokenizer tokens{path};
+  while (tokens.next()) {
+    /* Nothing */;
+  }
+  return tokens.valid();
 }
 
-bool Json::get_string(std::string path, std::string *value) const noexcept {
-  SCALAR_GET_IMPL_(path, value);
+static bool valid_path(const Pointer &pointer) noexcept {
+  return pointer.valid();
 }
 
-// Array operations
-// ----------------
+// Finds the node at |path| without modifying the document.
+template <typename Path>
+static Status lookup(const Document &root, const Path &path,
+                     const Document **node) noexcept {
+  auto tokens = make_tokens(path);
+  const Document *cur = &root;
+  while (tokens.next()) {
+    if (cur->is_object()) {
+      auto obj = cur->get_ptr<const Document::object_t *>();
+      auto it = obj->find(tokens.token());
+      if (it == obj->end()) {
+        return Status::kNotFound;
+      }
+      cur = &it->second;
+    } else if (cur->is_array()) {
+      auto arr = cur->get_ptr<const Document::array_t *>();
+      size_t index = 0;
+      if (!tokens.index(&index)) {
+        return Status::kInvalidPath;
+      }
+      if (index >= arr->size()) {
+        return Status::kNotFound;
+      }
+      cur = &(*arr)[index];
+    } else {
+      return Status::kNotFound;
+    }
+  }
+  if (!tokens.valid()) {
+    return Status::kInvalidPath;
+  }
+  *node = cur;
+  return Status::kOk;
+}
 
-bool Json::get_array_keys(std::string path, ArrayKeys *ak) const noexcept {
-  if (!ak) {
-    return false;
+// Appends |token| to the JSON pointer |path|, escaping it.
+static void append_token(const String &token, std::string *path) noexcept {
+  *path += '/';
+  for (char ch : token) {
+    if (ch == '~') {
+      *path += "~0";
+    } else if (ch == '/') {
+      *path += "~1";
+    } else {
+      *path += ch;
+    }
   }
-  try {
-    nlohmann::json::json_pointer pointer{std::move(path)};
-    auto &maybe_array = impl_->json.at(std::move(pointer));
-    if (!maybe_array.is_array()) {
-      return false;
+}
+
+// Finds the node at |path| creating the missing nodes like operator[] of
+// nlohmann::json_pointer does: null nodes become arrays when the token is
+// numeric or "-" and objects otherwise, "-" appends to an array, and an
+// out of range index extends the array with null values. If |resolved| is
+// not null, we append to it the path of the node, where each "-" is
+// replaced by the index of the element it appended.
+template <typename Path>
+static Status lookup_or_create(Document *root, const Path &path,
+                               Document **node,
+                               std::string *resolved = nullptr) noexcept {
+  if (!valid_path(path)) {
+    return Status::kInvalidPath;  // Do not modify the document
+  }
+  auto tokens = make_tokens(path);
+  Document *cur = root;
+  while (tokens.next()) {
+    const String &token = tokens.token();
+    if (cur->is_null()) {
+      bool numeric = std::all_of(token.begin(), token.end(), [](char ch) {
+        return ch >= '0' && ch <= '9';
+      });
+      *cur = (numeric || token == "-") ? Document::value_t::array
+                                       : Document::value_t::object;
+    }
+    if (cur->is_object()) {
+      auto obj = cur->get_ptr<Document::object_t *>();
+      auto it = obj->lower_bound(token);
+      if (it == obj->end() || obj->key_comp()(token, it->first)) {
+        // Scan new keys once, so that the serializer does not need to.
+        String key{token};
+        key.flags = utf8_scan(key.data(), key.size());
+        it = obj->emplace_hint(it, std::move(key), nullptr);
+      }
+      cur = &it->second;
+    } else if (cur->is_array()) {
+      auto arr = cur->get_ptr<Document::array_t *>();
+      size_t index = 0;
+      if (token == "-") {
+        index = arr->size();
+      } else if (!tokens.index(&index) || index >= arr->max_size()) {
+        return Status::kInvalidPath;
+      }
+      if (index >= arr->size()) {
+        arr->resize(index + 1);
+      }
+      cur = &(*arr)[index];
+      if (resolved) {
+        char buffer[number_format_size];
+        *resolved += '/';
+        resolved->append(buffer, format_unsigned(index, buffer));
+      }
+      continue;
+    } else {
+      return Status::kWrongType;
+    }
+    if (resolved) {
+      append_token(token, resolved);
     }
-    *ak = ArrayKeys{path, maybe_array.size()};
-  } catch (const Exception &) {
-    return false;
   }
-  return true;
+  *node = cur;
+  return Status::kOk;
 }
 
-// TODO(bassosimone): write more tests for this macro.
-#define ARRAY_PUSH_IMPL_(type, path, value)                \
-  try {                                                    \
-    nlohmann::json::json_pointer pointer{std::move(path)}; \
-    impl_->json[std::move(pointer)].push_back(value);      \
-  } catch (const Exception &) {                            \
-    return false;                                          \
-  }                                                        \
-  return true
+// Conversions
+// ===========
+//
+// Type-checked reads of a node, with the same conversions as the ones
+// performed by nlohmann::json, without throwing on type mismatch.
 
-bool Json::push_boolean(std::string path, bool value) noexcept {
-  ARRAY_PUSH_IMPL_(boolean, path, value);
+static Status get_value(const Document &node, bool *value) noexcept {
+  if (!node.is_boolean()) {
+    return Status::kWrongType;
+  }
+  *value = *node.get_ptr<const Document::boolean_t *>();
+  return Status::kOk;
 }
 
-bool Json::push_float(std::string path, double value) noexcept {
-  ARRAY_PUSH_IMPL_(float, path, value);
+template <typename Type>
+static Status get_number(const Document &node, Type *value) noexcept {
+  if (node.is_number_unsigned()) {
+    *value = (Type)*node.get_ptr<const Document::number_unsigned_t *>();
+  } else if (node.is_number_integer()) {
+    *value = (Type)*node.get_ptr<const Document::number_integer_t *>();
+  } else if (node.is_number_float()) {
+    *value = (Type)*node.get_ptr<const Document::number_float_t *>();
+  } else {
+    return Status::kWrongType;
+  }
+  return Status::kOk;
 }
 
-bool Json::push_integer(std::string path, int64_t value) noexcept {
-  ARRAY_PUSH_IMPL_(integer, path, value);
+static Status get_value(const Document &node, double *value) noexcept {
+  return get_number(node, value);
 }
 
-bool Json::push_string(std::string path, std::string value) noexcept {
-  ARRAY_PUSH_IMPL_(string, path, possibly_encode(std::move(value)));
+static Status get_value(const Document &node, int64_t *value) noexcept {
+  return get_number(node, value);
 }
 
-// Serialize/parse
-// ---------------
+static Status get_value(const Document &node,
+                        std::string *value) noexcept {
+  if (!node.is_string()) {
+    return Status::kWrongType;
+  }
+  auto str = node.get_ptr<const Document::string_t *>();
+  if (str->binary) {
+    // Same as what we would have stored using set_string().
+    value->resize(base64_encoded_size(str->size()));
+    if (!str->empty()) {
+      base64_encode((const uint8_t *)str->data(), str->size(), &(*value)[0]);
+    }
+    return Status::kOk;
+  }
+  value->assign(str->data(), str->size());
+  return Status::kOk;
+}
 
-bool Json::serialize(std::string *str) const noexcept {
-  if (!str) {
+// Returns the raw bytes stored by set_bytes(), or decodes the bytes of a
+// string stored as base64 by possibly_encode().
+static bool decode_bytes(const Document &node, std::string *value) noexcept {
+  if (!value || !node.is_string()) {
     return false;
   }
-  try {
-    *str = impl_->json.dump();
-  } catch (const Exception &) {
+  auto str = node.get_ptr<const Document::string_t *>();
+  if (str->binary) {
+    value->assign(str->data(), str->size());
+    return true;
+  }
+  return base64_decode(str->data(), str->size(), value);
+}
+
+template <typename Path>
+static bool decode_bytes(const Document &root, const Path &path,
+                         std::string *value) noexcept {
+  const Document *node = nullptr;
+  return lookup(root, path, &node) == Status::kOk &&
+         decode_bytes(*node, value);
+}
+
+// Appends |count| |values| to the array at |path|, creating it if needed,
+// after converting each of them using |make|.
+template <typename Path, typename Value, typename Make>
+static bool push_values(Document *root, const Path &path, const Value *values,
+                        size_t count, Make make) noexcept {
+  Document *node = nullptr;
+  if ((!values && count > 0) ||
+      lookup_or_create(root, path, &node) != Status::kOk ||
+      !(node->is_null() || node->is_array())) {
     return false;
   }
+  if (node->is_null()) {
+    *node = Document::value_t::array;
+  }
+  auto arr = node->get_ptr<Document::array_t *>();
+  arr->reserve(arr->size() + count);
+  for (size_t i = 0; i < count; ++i) {
+    arr->emplace_back(make(values[i]));
+  }
   return true;
 }
 
-bool Json::parse(std::string str) noexcept {
-  try {
-    impl_->json = nlohmann::json::parse(std::move(str));
-  } catch (const Exception &) {
+template <typename Path, typename Value>
+static bool get_elements(const Document &root, const Path &path,
+                         std::vector<Value> *values) noexcept {
+  const Document *node = nullptr;
+  if (!values || lookup(root, path, &node) != Status::kOk ||
+      !node->is_array()) {
     return false;
   }
+  auto arr = node->get_ptr<const Document::array_t *>();
+  values->resize(arr->size());
+  for (size_t i = 0; i < arr->size(); ++i) {
+    if (get_value((*arr)[i], &(*values)[i]) != Status::kOk) {
+      return false;
+    }
+  }
   return true;
 }
 
-// Ctor/dtor
-// ---------
+static double make_float(double value) noexcept { return value; }
 
-Json::Json() noexcept { impl_.reset(new Json::Impl); }
+static int64_t make_integer(int64_t value) noexcept { return value; }
 
-Json::~Json() noexcept {}
+// Pointer
+// =======
+
+constexpr size_t Pointer::npos;
+
+Pointer::Pointer() noexcept { valid_ = true; }
+
+Pointer::Pointer(std::string path) noexcept {
+  Tokenizer tokens{path};
+  while (tokens.next()) {
+    size_t index = npos;
+    if (!tokens.index(&index)) {
+      index = npos;
+    }
+    tokens_.emplace_back(tokens.token().data(), tokens.token().size());
+    indexes_.push_back(index);
+  }
+  valid_ = tokens.valid();
+  std::swap(path, path_);
+}
+
+bool Pointer::valid() const noexcept { return valid_; }
+
+const std::string &Pointer::path() const noexcept { return path_; }
+
+// PointerSet
+// ==========
+
+class PointerSet::Impl {
+ public:
+  struct Node {
+    String token;
+    size_t index = Pointer::npos;
+    std::vector<size_t> children;  // Sorted like the keys of an object
+    std::vector<size_t> results;   // Values of the pointers ending here
+  };
+
+  std::vector<Node> nodes{1};
+  std::vector<ValueType> types;
+  bool valid = true;
+
+  // Reads the values below the trie node |index|, which is at |node|.
+  void get(const Document &node, size_t index,
+           std::vector<PointerValue> *values) const noexcept {
+    const Node &trie = nodes[index];
+    for (size_t result : trie.results) {
+      read(node, types[result], &(*values)[result]);
+    }
+    if (node.is_object()) {
+      auto obj = node.get_ptr<const Document::object_t *>();
+      for (size_t child : trie.children) {
+        auto it = obj->find(nodes[child].token);
+        if (it != obj->end()) {
+          get(it->second, child, values);
+        }
+      }
+    } else if (node.is_array()) {
+      auto arr = node.get_ptr<const Document::array_t *>();
+      for (size_t child : trie.children) {
+        if (nodes[child].index < arr->size()) {
+          get((*arr)[nodes[child].index], child, values);
+        }
+      }
+    }
+  }
+
+  // Builds into |root| the containers and values needed by |values|.
+  bool build(const std::vector<PointerValue> &values, Document *root) const {
+    // Children come after their parents, so one backward pass is enough
+    // to know which nodes have something to set below them.
+    std::vector<bool> used(nodes.size());
+    for (size_t index = nodes.size(); index-- > 0;) {
+      const Node &trie = nodes[index];
+      used[index] =
+          std::any_of(trie.results.begin(), trie.results.end(),
+                      [&](size_t result) { return values[result].found; }) ||
+          std::any_of(trie.children.begin(), trie.children.end(),
+                      [&](size_t child) { return (bool)used[child]; });
+    }
+    return !used[0] || build(values, used, 0, root);
+  }
+
+  bool build(const std::vector<PointerValue> &values,
+             const std::vector<bool> &used, size_t index,
+             Document *node) const {
+    const Node &trie = nodes[index];
+    const PointerValue *value = nullptr;
+    ValueType type = ValueType::kBoolean;
+    for (size_t result : trie.results) {
+      if (values[result].found) {
+        value = &values[result];  // Later pointers win, like with set
+        type = types[result];
+      }
+    }
+    bool array = true;
+    size_t size = 0;
+    bool any = false;
+    for (size_t child : trie.children) {
+      if (used[child]) {
+        any = true;
+        array = array && nodes[child].index != Pointer::npos;
+        size = std::max(size, nodes[child].index + 1);
+      }
+    }
+    if (value) {
+      if (any) {
+        return false;  // A value cannot also be a container
+      }
+      write(*value, type, node);
+      return true;
+    }
+    if (array) {
+      *node = Document::value_t::array;
+      auto arr = node->get_ptr<Document::array_t *>();
+      arr->resize(size);
+      for (size_t child : trie.children) {
+        if (used[child] &&
+            !build(values, used, child, &(*arr)[nodes[child].index])) {
+          return false;
+        }
+      }
+      return true;
+    }
+    *node = Document::value_t::object;
+    auto obj = node->get_ptr<Document::object_t *>();
+    for (size_t child : trie.children) {
+      if (used[child]) {
+        // The children are sorted, so we always insert at the end.
+        auto it = obj->emplace_hint(obj->end(), nodes[child].token, nullptr);
+        if (!build(values, used, child, &it->second)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  static void write(const PointerValue &value, ValueType type,
+                    Document *node) {
+    switch (type) {
+      case ValueType::kBoolean:
+        *node = value.boolean_value;
+        break;
+      case ValueType::kFloat:
+        *node = value.float_value;
+        break;
+      case ValueType::kInteger:
+        *node = value.integer_value;
+        break;
+      case ValueType::kString:
+        *node = possibly_encode(value.string_value);
+        break;
+      case ValueType::kBytes:
+        *node = make_bytes(value.string_value);
+        break;
+    }
+  }
+
+  static void read(const Document &node, ValueType type,
+                   PointerValue *value) noexcept {
+    switch (type) {
+      case ValueType::kBoolean:
+        value->found = get_value(node, &value->boolean_value) == Status::kOk;
+        break;
+      case ValueType::kFloat:
+        value->found = get_value(node, &value->float_value) == Status::kOk;
+        break;
+      case ValueType::kInteger:
+        value->found = get_value(node, &value->integer_value) == Status::kOk;
+        break;
+      case ValueType::kString:
+        value->found = get_value(node, &value->string_value) == Status::kOk;
+        break;
+      case ValueType::kBytes:
+        value->found = decode_bytes(node, &value->string_value);
+        break;
+    }
+  }
+};
+
+PointerSet::PointerSet() noexcept { impl_.reset(new PointerSet::Impl); }
+
+size_t PointerSet::add(const Pointer &path, ValueType type) noexcept {
+  impl_->valid = impl_->valid && path.valid();
+  PointerTokens tokens{path};
+  size_t cur = 0;
+  while (tokens.next()) {
+    const String &token = tokens.token();
+    auto &children = impl_->nodes[cur].children;
+    auto it = std::lower_bound(children.begin(), children.end(), token,
+                               [&](size_t child, const String &token) {
+                                 return impl_->nodes[child].token < token;
+                               });
+    if (it != children.end() && impl_->nodes[*it].token == token) {
+      cur = *it;
+      continue;
+    }
+    size_t child = impl_->nodes.size();
+    children.insert(it, child);  // Before growing |nodes|
+    impl_->nodes.emplace_back();
+    impl_->nodes[child].token = token;
+    impl_->nodes[child].token.flags = utf8_scan(token.data(), token.size());
+    if (!tokens.index(&impl_->nodes[child].index)) {
+      impl_->nodes[child].index = Pointer::npos;
+    }
+    cur = child;
+  }
+  size_t result = impl_->types.size();
+  impl_->types.push_back(type);
+  impl_->nodes[cur].results.push_back(result);
+  return result;
+}
+
+size_t PointerSet::add(std::string path, ValueType type) noexcept {
+  return add(Pointer{std::move(path)}, type);
+}
+
+bool PointerSet::valid() const noexcept { return impl_->valid; }
+
+size_t PointerSet::size() const noexcept { return impl_->types.size(); }
+
+PointerSet::~PointerSet() noexcept {}
+
+// Parsing
+// =======
+//
+// Handler for simd_parse() that builds a Document. Since the
+// events arrive in document order, we only need a stack with the
+// containers we are in. Pointers into the stack remain valid because we
+// only modify the innermost container.
+
+class DomBuilder {
+ public:
+  Document root;
+
+  bool on_start_object() noexcept {
+    return open(Document::value_t::object);
+  }
+
+  bool on_end_object() noexcept { return close(); }
+
+  bool on_start_array() noexcept {
+    return open(Document::value_t::array);
+  }
+
+  bool on_end_array() noexcept { return close(); }
+
+  bool on_key(const char *base, size_t count, unsigned flags) noexcept {
+    key_.assign(base, count);
+    key_.flags = flags;
+    return true;
+  }
+
+  bool on_string(const char *base, size_t count, unsigned flags) noexcept {
+    Document::string_t str{base, count};
+    str.flags = flags;
+    (void)add(std::move(str));
+    return true;
+  }
+
+  bool on_unsigned(uint64_t value) noexcept {
+    (void)add(value);
+    return true;
+  }
+
+  bool on_integer(int64_t value) noexcept {
+    (void)add(value);
+    return true;
+  }
+
+  bool on_float(double value) noexcept {
+    (void)add(value);
+    return true;
+  }
+
+  bool on_boolean(bool value) noexcept {
+    (void)add(value);
+    return true;
+  }
+
+  bool on_null() noexcept {
+    (void)add(nullptr);
+    return true;
+  }
+
+ private:
+  // Adds |value| to the innermost container and returns the new node, or
+  // returns null when the value must be skipped because, like in the case
+  // of nlohmann::json, the first value of a duplicate key wins.
+  template <typename Value>
+  Document *add(Value &&value) noexcept {
+    if (skip_ > 0) {
+      return nullptr;
+    }
+    if (stack_.empty()) {
+      root = std::forward<Value>(value);
+      return &root;
+    }
+    Document *top = stack_.back();
+    if (top->is_array()) {
+      auto arr = top->get_ptr<Document::array_t *>();
+      arr->emplace_back(std::forward<Value>(value));
+      return &arr->back();
+    }
+    auto obj = top->get_ptr<Document::object_t *>();
+    auto res = obj->emplace(std::move(key_), std::forward<Value>(value));
+    return res.second ? &res.first->second : nullptr;
+  }
+
+  bool open(Document::value_t type) noexcept {
+    if (skip_ > 0) {
+      skip_ += 1;
+      return true;
+    }
+    Document *node = add(type);
+    if (!node) {
+      skip_ = 1;
+      return true;
+    }
+    stack_.push_back(node);
+    return true;
+  }
+
+  bool close() noexcept {
+    if (skip_ > 0) {
+      skip_ -= 1;
+      return true;
+    }
+    stack_.pop_back();
+    return true;
+  }
+
+  std::vector<Document *> stack_;
+  String key_;
+  size_t skip_ = 0;
+};
+
+// Parses only the subtrees at the requested pointers. We walk the
+// structural index following a trie of the requested pointers, and we skip
+// any other value by counting brackets in the index, without looking at
+// its content. Hence, the grammar of the skipped values is not checked
+// beyond stage 1 and bracket balancing. The requested subtrees are parsed
+// by stage 2 and added to the document only if they are present, along
+// with the containers enclosing them.
+class Projection {
+ public:
+  explicit Projection(const std::vector<Pointer> &pointers) noexcept {
+    nodes_.emplace_back();
+    for (auto &pointer : pointers) {
+      valid_ = valid_ && pointer.valid();
+      PointerTokens tokens{pointer};
+      size_t cur = 0;
+      while (tokens.next()) {
+        auto it = nodes_[cur].keys.find(tokens.token());
+        if (it == nodes_[cur].keys.end()) {
+          size_t child = nodes_.size();
+          nodes_.emplace_back();
+          nodes_[child].token = tokens.token();
+          nodes_[child].token.flags = utf8_scan(tokens.token().data(),
+                                                tokens.token().size());
+          if (tokens.index(&nodes_[child].index)) {
+            nodes_[cur].indexes[nodes_[child].index] = child;
+          }
+          it = nodes_[cur].keys.emplace(tokens.token(), child).first;
+        }
+        cur = it->second;
+      }
+      nodes_[cur].terminal = true;
+    }
+  }
+
+  bool valid() const noexcept { return valid_; }
+
+  // Parses the value in [data, data + size) indexed by |index| into |root|.
+  bool parse(const char *data, size_t size, const StructuralIndex &index,
+             Document *root) noexcept {
+    data_ = data;
+    size_ = size;
+    cur_ = index.begin();
+    limit_ = cur_ + index.size();
+    root_ = root;
+    visited_.assign(nodes_.size(), false);
+    Frame frame;
+    return walk(frame) && cur_ == limit_;
+  }
+
+  // Copies the requested subtrees of |doc| into |root|. We use this for
+  // inputs too large for the structural index.
+  void copy(const Document &doc, Document *root) noexcept {
+    root_ = root;
+    Frame frame;
+    copy(doc, frame);
+  }
+
+ private:
+  struct Node {
+    String token;
+    size_t index = Pointer::npos;
+    std::map<String, size_t> keys;
+    std::map<size_t, size_t> indexes;
+    bool terminal = false;
+  };
+
+  // Value being walked: its trie node and how to reach it from its parent,
+  // which we use to create the enclosing containers only when we find a
+  // requested subtree.
+  struct Frame {
+    const Frame *parent = nullptr;
+    size_t node = 0;
+    bool in_object = false;
+  };
+
+  Document *materialize(const Frame &frame) noexcept {
+    if (!frame.parent) {
+      return root_;
+    }
+    Document *parent = materialize(*frame.parent);
+    const Node &node = nodes_[frame.node];
+    if (frame.in_object) {
+      if (parent->is_null()) {
+        *parent = Document::value_t::object;
+      }
+      return &(*parent->get_ptr<Document::object_t *>())[node.token];
+    }
+    if (parent->is_null()) {
+      *parent = Document::value_t::array;
+    }
+    auto arr = parent->get_ptr<Document::array_t *>();
+    if (node.index >= arr->size()) {
+      arr->resize(node.index + 1);
+    }
+    return &(*arr)[node.index];
+  }
+
+  // Moves past the value at the current position.
+  bool skip_value() noexcept {
+    if (cur_ >= limit_) {
+      return false;
+    }
+    char ch = data_[*cur_++];
+    return (ch != '{' && ch != '[') || skip_rest();
+  }
+
+  // Moves past the end of the container we are in.
+  bool skip_rest() noexcept {
+    size_t depth = 1;
+    while (cur_ < limit_) {
+      char ch = data_[*cur_++];
+      if (ch == '{' || ch == '[') {
+        depth += 1;
+      } else if ((ch == '}' || ch == ']') && --depth == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void copy(const Document &value, const Frame &frame) noexcept {
+    const Node &node = nodes_[frame.node];
+    if (node.terminal) {
+      *materialize(frame) = value;
+      return;
+    }
+    Frame child;
+    child.parent = &frame;
+    if (value.is_object()) {
+      auto obj = value.get_ptr<const Document::object_t *>();
+      child.in_object = true;
+      for (auto &pair : node.keys) {
+        auto it = obj->find(pair.first);
+        if (it != obj->end()) {
+          child.node = pair.second;
+          copy(it->second, child);
+        }
+      }
+    } else if (value.is_array()) {
+      auto arr = value.get_ptr<const Document::array_t *>();
+      for (auto &pair : node.indexes) {
+        if (pair.first < arr->size()) {
+          child.node = pair.second;
+          copy((*arr)[pair.first], child);
+        }
+      }
+    }
+  }
+
+  bool walk(const Frame &frame) noexcept {
+    if (cur_ >= limit_) {
+      return false;
+    }
+    if (nodes_[frame.node].terminal) {
+      const uint32_t *begin = cur_;
+      DomBuilder builder;
+      if (!skip_value() || !simd_parse(data_, size_, begin, cur_, &builder)) {
+        return false;
+      }
+      std::swap(*materialize(frame), builder.root);
+      return true;
+    }
+    switch (data_[*cur_]) {
+      case '{':
+        return walk_object(frame);
+      case '[':
+        return walk_array(frame);
+      default:
+        return skip_value();
+    }
+  }
+
+  bool walk_object(const Frame &frame) noexcept {
+    const Node &node = nodes_[frame.node];
+    size_t remaining = node.keys.size();
+    if (++cur_ < limit_ && data_[*cur_] == '}') {
+      cur_ += 1;
+      return true;
+    }
+    for (;;) {
+      if (remaining == 0) {
+        return skip_rest();
+      }
+      if (cur_ + 1 >= limit_ || data_[*cur_] != '"') {
+        return false;
+      }
+      size_t pos = *cur_++;
+      size_t end = 0;
+      bool escaped = false;
+      unsigned flags = 0;
+      if (!parse_string(data_, size_, pos, &end, &escaped, &scratch_,
+                        &flags) ||
+          data_[*cur_++] != ':') {
+        return false;
+      }
+      if (escaped) {
+        key_.assign(scratch_.data(), scratch_.size());
+      } else {
+        key_.assign(data_ + pos + 1, end - pos - 1);
+      }
+      auto it = node.keys.find(key_);
+      // Like nlohmann::json, the first value of a duplicate key wins.
+      if (it != node.keys.end() && !visited_[it->second]) {
+        visited_[it->second] = true;
+        remaining -= 1;
+        Frame child;
+        child.parent = &frame;
+        child.node = it->second;
+        child.in_object = true;
+        if (!walk(child)) {
+          return false;
+        }
+      } else if (!skip_value()) {
+        return false;
+      }
+      if (cur_ >= limit_) {
+        return false;
+      }
+      char ch = data_[*cur_++];
+      if (ch == '}') {
+        return true;
+      }
+      if (ch != ',') {
+        return false;
+      }
+    }
+  }
+
+  bool walk_array(const Frame &frame) noexcept {
+    const Node &node = nodes_[frame.node];
+    size_t remaining = node.indexes.size();
+    if (++cur_ < limit_ && data_[*cur_] == ']') {
+      cur_ += 1;
+      return true;
+    }
+    for (size_t index = 0;; ++index) {
+      if (remaining == 0) {
+        return skip_rest();
+      }
+      auto it = node.indexes.find(index);
+      if (it != node.indexes.end()) {
+        remaining -= 1;
+        Frame child;
+        child.parent = &frame;
+        child.node = it->second;
+        if (!walk(child)) {
+          return false;
+        }
+      } else if (!skip_value()) {
+        return false;
+      }
+      if (cur_ >= limit_) {
+        return false;
+      }
+      char ch = data_[*cur_++];
+      if (ch == ']') {
+        return true;
+      }
+      if (ch != ',') {
+        return false;
+      }
+    }
+  }
+
+  std::vector<Node> nodes_;
+  std::vector<bool> visited_;
+  String key_;
+  std::string scratch_;
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  const uint32_t *cur_ = nullptr;
+  const uint32_t *limit_ = nullptr;
+  Document *root_ = nullptr;
+  bool valid_ = true;
+};
+
+// Serializing
+// ===========
+//
+// Writes the same compact output as nlohmann::json, except that we encode
+// binary strings as base64 directly into the output, so that we never hold
+// both the raw bytes and their encoding in memory, and that we format
+// doubles with the shortest digits that round trip, see number_format.hpp.
+//
+// When streaming, the output goes through a buffer that we pass to the
+// writer once it is full. We split long strings into chunks, so that the
+// buffer never grows much beyond its nominal size.
+
+// Nominal size of the streaming buffer.
+static constexpr size_t stream_buffer_size = 64 * 1024;
+
+// Bytes of a binary string that we encode at a time. This is a multiple of
+// three, so that we only pad the last chunk.
+static constexpr size_t binary_chunk = 3 * 4096;
+
+// Bytes of a text string that we escape at a time.
+static constexpr size_t text_chunk = 16 * 1024;
+
+// Appends |node|, which must be a number, a boolean or null, to |out|.
+static void write_scalar(const Document &node, std::string *out) noexcept {
+  char buffer[number_format_size];
+  char *end = buffer;
+  switch (node.type()) {
+    case nlohmann::detail::value_t::number_unsigned:
+      end = format_unsigned(
+          *node.get_ptr<const Document::number_unsigned_t *>(), buffer);
+      break;
+    case nlohmann::detail::value_t::number_integer:
+      end = format_integer(
+          *node.get_ptr<const Document::number_integer_t *>(), buffer);
+      break;
+    case nlohmann::detail::value_t::number_float:
+      end = format_double(*node.get_ptr<const Document::number_float_t *>(),
+                          buffer);
+      break;
+    case nlohmann::detail::value_t::boolean:
+      out->append(*node.get_ptr<const Document::boolean_t *>() ? "true"
+                                                               : "false");
+      return;
+    default:
+      out->append("null", 4);
+      return;
+  }
+  out->append(buffer, (size_t)(end - buffer));
+}
+
+class Serializer {
+ public:
+  // Appends the whole output to |out|.
+  explicit Serializer(std::string *out) noexcept : out_{out} {}
+
+  // Passes the output to |writer| in chunks.
+  explicit Serializer(Json::Writer writer) noexcept
+      : writer_{std::move(writer)}, out_{buffer_.get()} {
+    buffer_->reserve(stream_buffer_size);
+  }
+
+  // Returns false if a string is not valid UTF-8 or the writer fails, in
+  // which case the output is incomplete.
+  bool write(const Document &node) noexcept {
+    if (!maybe_flush()) {
+      return false;
+    }
+    switch (node.type()) {
+      case nlohmann::detail::value_t::object: {
+        auto object = node.get_ptr<const Document::object_t *>();
+        out_->push_back('{');
+        for (auto it = object->begin(); it != object->end(); ++it) {
+          if (it != object->begin()) {
+            out_->push_back(',');
+          }
+          if (!write_string(it->first)) {
+            return false;
+          }
+          out_->push_back(':');
+          if (!write(it->second)) {
+            return false;
+          }
+        }
+        out_->push_back('}');
+        return true;
+      }
+      case nlohmann::detail::value_t::array: {
+        auto array = node.get_ptr<const Document::array_t *>();
+        out_->push_back('[');
+        for (auto it = array->begin(); it != array->end(); ++it) {
+          if (it != array->begin()) {
+            out_->push_back(',');
+          }
+          if (!write(*it)) {
+            return false;
+          }
+        }
+        out_->push_back(']');
+        return true;
+      }
+      case nlohmann::detail::value_t::string:
+        return write_string(*node.get_ptr<const Document::string_t *>());
+      default:
+        write_scalar(node, out_);
+        return true;
+    }
+  }
+
+  // Passes the buffered output, if any, to the writer, if any.
+  bool flush() noexcept {
+    if (!writer_ || out_->empty()) {
+      return true;
+    }
+    bool ok = writer_(out_->data(), out_->size());
+    out_->clear();
+    return ok;
+  }
+
+ private:
+  bool maybe_flush() noexcept {
+    return out_->size() < stream_buffer_size || flush();
+  }
+
+  bool write_string(const String &str) noexcept {
+    if (str.binary) {
+      out_->push_back('"');
+      for (size_t pos = 0; pos < str.size(); pos += binary_chunk) {
+        size_t count = std::min(binary_chunk, str.size() - pos);
+        size_t end = out_->size();
+        out_->resize(end + base64_encoded_size(count));
+        base64_encode((const uint8_t *)str.data() + pos, count,
+                      &(*out_)[end]);
+        if (!maybe_flush()) {
+          return false;
+        }
+      }
+      out_->push_back('"');
+      return true;
+    }
+    unsigned flags = str.flags;
+    if ((flags & utf8_scanned) == 0) {
+      flags = utf8_scan(str.data(), str.size());
+    }
+    if ((flags & utf8_valid) == 0) {
+      return false;
+    }
+    out_->push_back('"');
+    for (size_t pos = 0; pos < str.size(); pos += text_chunk) {
+      size_t count = std::min(text_chunk, str.size() - pos);
+      if ((flags & utf8_escape) != 0) {
+        write_escaped(str.data() + pos, count);
+      } else {
+        out_->append(str.data() + pos, count);
+      }
+      if (!maybe_flush()) {
+        return false;
+      }
+    }
+    out_->push_back('"');
+    return true;
+  }
+
+  // Copies the runs that do not need escaping in one go.
+  void write_escaped(const char *data, size_t size) noexcept {
+    size_t start = 0;
+    for (;;) {
+      size_t pos = find_escape(data, size, start);
+      out_->append(data + start, pos - start);
+      if (pos >= size) {
+        break;
+      }
+      write_escape((uint8_t)data[pos]);
+      start = pos + 1;
+    }
+  }
+
+  // Like nlohmann::json, we use the short escapes when they exist and
+  // lowercase hexadecimal digits otherwise.
+  void write_escape(uint8_t ch) noexcept {
+    static const char hex[] = "0123456789abcdef";
+    switch (ch) {
+      case '"':
+        out_->append("\\\"", 2);
+        break;
+      case '\\':
+        out_->append("\\\\", 2);
+        break;
+      case '\b':
+        out_->append("\\b", 2);
+        break;
+      case '\f':
+        out_->append("\\f", 2);
+        break;
+      case '\n':
+        out_->append("\\n", 2);
+        break;
+      case '\r':
+        out_->append("\\r", 2);
+        break;
+      case '\t':
+        out_->append("\\t", 2);
+        break;
+      default: {
+        char escape[] = {'\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0x0f]};
+        out_->append(escape, sizeof(escape));
+        break;
+      }
+    }
+  }
+
+  Json::Writer writer_;
+  PooledBuffer buffer_;
+  std::string *out_;
+};
+
+// Json
+// ====
+
+// Source of the ids of documents. Zero is never used.
+static std::atomic<uint64_t> next_document_id{1};
+
+class Json::Impl {
+ public:
+  // Declared first, so that it is destroyed after the document.
+  std::unique_ptr<Arena> arena;
+  Document json;
+  // Unique across all the documents of the process, so that ArrayKeys
+  // of a destroyed document never match a document at the same address.
+  uint64_t id = next_document_id.fetch_add(1, std::memory_order_relaxed);
+  // Incremented whenever the document changes, so that we know when the
+  // nodes saved by ArrayKeys may no longer exist.
+  uint64_t generation = 0;
+
+  // The arena must be current when we release its nodes.
+  ~Impl() noexcept {
+    ArenaScope scope{arena.get()};
+    json = nullptr;
+  }
+};
+
+// Scalar operations
+// -----------------
+
+#define SCALAR_SET_IMPL_(path, value)                               \
+  ArenaScope scope{impl_->arena.get()};                             \
+  impl_->generation += 1;                                           \
+  Document *node = nullptr;                                         \
+  if (lookup_or_create(&impl_->json, path, &node) != Status::kOk) { \
+    return false;                                                   \
+  }                                                                 \
+  *node = value;                                                    \
+  return true
+
+bool Json::set_boolean(std::string path, bool value) noexcept {
+  SCALAR_SET_IMPL_(path, value);
+}
+
+bool Json::set_float(std::string path, double value) noexcept {
+  SCALAR_SET_IMPL_(path, value);
+}
+
+bool Json::set_integer(std::string path, int64_t value) noexcept {
+  SCALAR_SET_IMPL_(path, value);
+}
+
+bool Json::set_string(std::string path, std::string value) noexcept {
+  SCALAR_SET_IMPL_(path, possibly_encode(value));
+}
+
+bool Json::set_bytes(std::string path, std::string value) noexcept {
+  SCALAR_SET_IMPL_(path, make_bytes(value));
+}
+
+#define SCALAR_GET_IMPL_(path, value)                       \
+  if (!value) {                                             \
+    return false;                                           \
+  }                                                         \
+  const Document *node = nullptr;                           \
+  return lookup(impl_->json, path, &node) == Status::kOk && \
+         get_value(*node, value) == Status::kOk
+
+bool Json::get_boolean(std::string path, bool *value) const noexcept {
+  SCALAR_GET_IMPL_(path, value);
+}
+
+bool Json::get_float(std::string path, double *value) const noexcept {
+  SCALAR_GET_IMPL_(path, value);
+}
+
+bool Json::get_integer(std::string path, int64_t *value) const noexcept {
+  SCALAR_GET_IMPL_(path, value);
+}
+
+bool Json::get_string(std::string path, std::string *value) const noexcept {
+  SCALAR_GET_IMPL_(path, value);
+}
+
+bool Json::get_bytes(std::string path, std::string *value) const noexcept {
+  return decode_bytes(impl_->json, path, value);
+}
+
+// Array operations
+// ----------------
+
+bool Json::get_array_keys(std::string path, ArrayKeys *ak) const noexcept {
+  if (!ak) {
+    return false;
+  }
+  const Document *node = nullptr;
+  if (lookup(impl_->json, path, &node) != Status::kOk || !node->is_array()) {
+    return false;
+  }
+  *ak = ArrayKeys{std::move(path), node->size()};
+  save_array(node, ak);
+  return true;
+}
+
+#define INDEX_GET_IMPL_(ak, index, expr)                                 \
+  const Document *node = nullptr;                                        \
+  if (ak.owner_ == impl_->id && ak.generation_ == impl_->generation) {   \
+    node = static_cast<const Document *>(ak.array_);                     \
+  } else if (lookup(impl_->json, ak.path_, &node) != Status::kOk ||      \
+             !node->is_array()) {                                        \
+    return false;                                                        \
+  }                                                                      \
+  auto arr = node->get_ptr<const Document::array_t *>();                 \
+  return index < arr->size() && (expr)
+
+bool Json::get_boolean(const ArrayKeys &ak, size_t index,
+                       bool *value) const noexcept {
+  INDEX_GET_IMPL_(ak, index,
+                  value && get_value((*arr)[index], value) == Status::kOk);
+}
+
+bool Json::get_float(const ArrayKeys &ak, size_t index,
+                     double *value) const noexcept {
+  INDEX_GET_IMPL_(ak, index,
+                  value && get_value((*arr)[index], value) == Status::kOk);
+}
+
+bool Json::get_integer(const ArrayKeys &ak, size_t index,
+                       int64_t *value) const noexcept {
+  INDEX_GET_IMPL_(ak, index,
+                  value && get_value((*arr)[index], value) == Status::kOk);
+}
+
+bool Json::get_string(const ArrayKeys &ak, size_t index,
+                      std::string *value) const noexcept {
+  INDEX_GET_IMPL_(ak, index,
+                  value && get_value((*arr)[index], value) == Status::kOk);
+}
+
+bool Json::get_bytes(const ArrayKeys &ak, size_t index,
+                     std::string *value) const noexcept {
+  INDEX_GET_IMPL_(ak, index, decode_bytes((*arr)[index], value));
+}
+
+// TODO(bassosimone): write more tests for this macro.
+#define ARRAY_PUSH_IMPL_(type, path, value)                         \
+  ArenaScope scope{impl_->arena.get()};                             \
+  impl_->generation += 1;                                           \
+  Document *node = nullptr;                                         \
+  if (lookup_or_create(&impl_->json, path, &node) != Status::kOk || \
+      !(node->is_null() || node->is_array())) {                     \
+    return false;                                                   \
+  }                                                                 \
+  node->push_back(value);                                           \
+  return true
+
+bool Json::push_boolean(std::string path, bool value) noexcept {
+  ARRAY_PUSH_IMPL_(boolean, path, value);
+}
+
+bool Json::push_float(std::string path, double value) noexcept {
+  ARRAY_PUSH_IMPL_(float, path, value);
+}
+
+bool Json::push_integer(std::string path, int64_t value) noexcept {
+  ARRAY_PUSH_IMPL_(integer, path, value);
+}
+
+bool Json::push_string(std::string path, std::string value) noexcept {
+  ARRAY_PUSH_IMPL_(string, path, possibly_encode(value));
+}
+
+bool Json::push_bytes(std::string path, std::string value) noexcept {
+  ARRAY_PUSH_IMPL_(bytes, path, make_bytes(value));
+}
+
+bool Json::push_floats(std::string path, const double *values,
+                       size_t count) noexcept {
+  ArenaScope scope{impl_->arena.get()};
+  impl_->generation += 1;
+  return push_values(&impl_->json, path, values, count, make_float);
+}
+
+bool Json::push_integers(std::string path, const int64_t *values,
+                         size_t count) noexcept {
+  ArenaScope scope{impl_->arena.get()};
+  impl_->generation += 1;
+  return push_values(&impl_->json, path, values, count, make_integer);
+}
+
+bool Json::push_strings(std::string path,
+                        const std::vector<std::string> &values) noexcept {
+  ArenaScope scope{impl_->arena.get()};
+  impl_->generation += 1;
+  return push_values(&impl_->json, path, values.data(), values.size(),
+                     possibly_encode);
+}
+
+bool Json::get_floats(std::string path,
+                      std::vector<double> *values) const noexcept {
+  return get_elements(impl_->json, path, values);
+}
+
+bool Json::get_integers(std::string path,
+                        std::vector<int64_t> *values) const noexcept {
+  return get_elements(impl_->json, path, values);
+}
+
+bool Json::get_strings(std::string path,
+                       std::vector<std::string> *values) const noexcept {
+  return get_elements(impl_->json, path, values);
+}
+
+// Precompiled pointer operations
+// ------------------------------
+
+bool Json::set_boolean(const Pointer &path, bool value) noexcept {
+  SCALAR_SET_IMPL_(path, value);
+}
+
+bool Json::set_float(const Pointer &path, double value) noexcept {
+  SCALAR_SET_IMPL_(path, value);
+}
+
+bool Json::set_integer(const Pointer &path, int64_t value) noexcept {
+  SCALAR_SET_IMPL_(path, value);
+}
+
+bool Json::set_string(const Pointer &path, std::string value) noexcept {
+  SCALAR_SET_IMPL_(path, possibly_encode(value));
+}
+
+bool Json::set_bytes(const Pointer &path, std::string value) noexcept {
+  SCALAR_SET_IMPL_(path, make_bytes(value));
+}
+
+bool Json::get_boolean(const Pointer &path, bool *value) const noexcept {
+  SCALAR_GET_IMPL_(path, value);
+}
+
+bool Json::get_float(const Pointer &path, double *value) const noexcept {
+  SCALAR_GET_IMPL_(path, value);
+}
+
+bool Json::get_integer(const Pointer &path, int64_t *value) const noexcept {
+  SCALAR_GET_IMPL_(path, value);
+}
+
+bool Json::get_string(const Pointer &path,
+                      std::string *value) const noexcept {
+  SCALAR_GET_IMPL_(path, value);
+}
+
+bool Json::get_bytes(const Pointer &path, std::string *value) const noexcept {
+  return decode_bytes(impl_->json, path, value);
+}
+
+bool Json::get_array_keys(const Pointer &path,
+                          ArrayKeys *ak) const noexcept {
+  if (!ak) {
+    return false;
+  }
+  const Document *node = nullptr;
+  if (lookup(impl_->json, path, &node) != Status::kOk || !node->is_array()) {
+    return false;
+  }
+  *ak = ArrayKeys{path.path(), node->size()};
+  save_array(node, ak);
+  return true;
+}
+
+bool Json::push_boolean(const Pointer &path, bool value) noexcept {
+  ARRAY_PUSH_IMPL_(boolean, path, value);
+}
+
+bool Json::push_float(const Pointer &path, double value) noexcept {
+  ARRAY_PUSH_IMPL_(float, path, value);
+}
+
+bool Json::push_integer(const Pointer &path, int64_t value) noexcept {
+  ARRAY_PUSH_IMPL_(integer, path, value);
+}
+
+bool Json::push_string(const Pointer &path, std::string value) noexcept {
+  ARRAY_PUSH_IMPL_(string, path, possibly_encode(value));
+}
+
+bool Json::push_bytes(const Pointer &path, std::string value) noexcept {
+  ARRAY_PUSH_IMPL_(bytes, path, make_bytes(value));
+}
+
+bool Json::push_floats(const Pointer &path, const double *values,
+                       size_t count) noexcept {
+  ArenaScope scope{impl_->arena.get()};
+  impl_->generation += 1;
+  return push_values(&impl_->json, path, values, count, make_float);
+}
+
+bool Json::push_integers(const Pointer &path, const int64_t *values,
+                         size_t count) noexcept {
+  ArenaScope scope{impl_->arena.get()};
+  impl_->generation += 1;
+  return push_values(&impl_->json, path, values, count, make_integer);
+}
+
+bool Json::push_strings(const Pointer &path,
+                        const std::vector<std::string> &values) noexcept {
+  ArenaScope scope{impl_->arena.get()};
+  impl_->generation += 1;
+  return push_values(&impl_->json, path, values.data(), values.size(),
+                     possibly_encode);
+}
+
+bool Json::get_floats(const Pointer &path,
+                      std::vector<double> *values) const noexcept {
+  return get_elements(impl_->json, path, values);
+}
+
+bool Json::get_integers(const Pointer &path,
+                        std::vector<int64_t> *values) const noexcept {
+  return get_elements(impl_->json, path, values);
+}
+
+bool Json::get_strings(const Pointer &path,
+                       std::vector<std::string> *values) const noexcept {
+  return get_elements(impl_->json, path, values);
+}
+
+// Pointer set operations
+// ----------------------
+
+bool Json::get_values(const PointerSet &set,
+                      std::vector<PointerValue> *values) const noexcept {
+  if (!values || !set.valid()) {
+    return false;
+  }
+  values->resize(set.size());
+  for (auto &value : *values) {
+    value.found = false;
+  }
+  set.impl_->get(impl_->json, 0, values);
+  return true;
+}
+
+bool Json::build(const PointerSet &set,
+                 const std::vector<PointerValue> &values) noexcept {
+  if (!set.valid() || values.size() != set.size()) {
+    return false;
+  }
+  ArenaScope scope{impl_->arena.get()};
+  Document root;
+  if (!set.impl_->build(values, &root)) {
+    return false;
+  }
+  std::swap(impl_->json, root);
+  impl_->generation += 1;
+  return true;
+}
+
+// Cursors
+// -------
+
+// The cursor keeps the resolved path, so that, if it needs to find its
+// node again, a "-" does not append another element.
+#define GET_CURSOR_IMPL_(path, cursor)                                     \
+  if (!cursor) {                                                           \
+    return false;                                                          \
+  }                                                                        \
+  ArenaScope scope{impl_->arena.get()};                                    \
+  impl_->generation += 1;                                                  \
+  Document *node = nullptr;                                                \
+  std::string resolved;                                                    \
+  if (lookup_or_create(&impl_->json, path, &node, &resolved) !=            \
+      Status::kOk) {                                                       \
+    return false;                                                          \
+  }                                                                        \
+  cursor->doc_ = this;                                                     \
+  cursor->path_ = std::move(resolved);                                     \
+  cursor->node_ = node;                                                    \
+  cursor->generation_ = impl_->generation;                                 \
+  return true
+
+bool Json::get_cursor(std::string path, Cursor *cursor) noexcept {
+  GET_CURSOR_IMPL_(path, cursor);
+}
+
+bool Json::get_cursor(const Pointer &path, Cursor *cursor) noexcept {
+  GET_CURSOR_IMPL_(path, cursor);
+}
+
+void Json::save_array(const void *array, ArrayKeys *ak) const noexcept {
+  ak->array_ = array;
+  ak->owner_ = impl_->id;
+  ak->generation_ = impl_->generation;
+}
+
+// Serialize/parse
+// ---------------
+
+bool Json::serialize(std::string *str) const noexcept {
+  if (!str) {
+    return false;
+  }
+  std::string result;
+  if (!Serializer{&result}.write(impl_->json)) {
+    return false;
+  }
+  std::swap(result, *str);
+  return true;
+}
+
+bool Json::serialize_append(std::string *str) const noexcept {
+  if (!str) {
+    return false;
+  }
+  size_t size = str->size();
+  if (!Serializer{str}.write(impl_->json)) {
+    str->resize(size);
+    return false;
+  }
+  return true;
+}
+
+bool Json::serialize(Writer writer) const noexcept {
+  if (!writer) {
+    return false;
+  }
+  Serializer serializer{std::move(writer)};
+  return serializer.write(impl_->json) && serializer.flush();
+}
+
+bool Json::serialize_file(FILE *filep) const noexcept {
+  if (!filep) {
+    return false;
+  }
+  return serialize([filep](const char *data, size_t size) {
+    return fwrite(data, 1, size, filep) == size;
+  });
+}
+
+bool Json::serialize_fd(int fd) const noexcept {
+  return serialize([fd](const char *data, size_t size) {
+    return write_fully(fd, data, size);
+  });
+}
+
+bool Json::parse(std::string str) noexcept {
+  return parse(str.data(), str.size(), ParseBackend::kDefault);
+}
+
+bool Json::parse(const char *data, size_t size) noexcept {
+  return parse(data, size, ParseBackend::kDefault);
+}
+
+bool Json::parse_file(std::string path) noexcept {
+  return parse_file(std::move(path), ParseBackend::kDefault);
+}
+
+bool Json::parse(std::string str, ParseBackend backend) noexcept {
+  return parse(str.data(), str.size(), backend);
+}
+
+bool Json::parse(const char *data, size_t size,
+                 ParseBackend backend) noexcept {
+  if (!data) {
+    return false;
+  }
+  ArenaScope scope{impl_->arena.get()};
+  if (backend == ParseBackend::kSimd && size <= StructuralIndex::max_size) {
+    DomBuilder builder;
+    if (!simd_parse(data, size, &builder)) {
+      return false;
+    }
+    std::swap(impl_->json, builder.root);
+    impl_->generation += 1;
+    return true;
+  }
+  try {
+    // Note: the buffer input adapter reads directly from |data|, and we
+    // disable exceptions so that a syntax error does not throw.
+    auto json = Document::parse(
+        nlohmann::detail::input_adapter{data, size}, nullptr, false);
+    if (json.is_discarded()) {
+      return false;
+    }
+    std::swap(impl_->json, json);
+    impl_->generation += 1;
+  } catch (const Exception &) {
+    return false;
+  }
+  return true;
+}
+
+bool Json::parse_file(std::string path, ParseBackend backend) noexcept {
+  return with_file_contents(path, [&](const char *data, size_t size) {
+    return parse(data, size, backend);
+  });
+}
+
+bool Json::parse(std::string str,
+                 const std::vector<Pointer> &pointers) noexcept {
+  return parse(str.data(), str.size(), pointers);
+}
+
+bool Json::parse(const char *data, size_t size,
+                 const std::vector<Pointer> &pointers) noexcept {
+  Projection projection{pointers};
+  if (!data || !projection.valid()) {
+    return false;
+  }
+  ArenaScope scope{impl_->arena.get()};
+  Document root;
+  if (size > StructuralIndex::max_size) {
+    Json doc;
+    if (!doc.parse(data, size, ParseBackend::kDefault)) {
+      return false;
+    }
+    projection.copy(doc.impl_->json, &root);
+    std::swap(impl_->json, root);
+    impl_->generation += 1;
+    return true;
+  }
+  if (size >= 3 && memcmp(data, "\xef\xbb\xbf", 3) == 0) {
+    data += 3;
+    size -= 3;
+  }
+  StructuralIndex index;
+  if (!index.build(data, size) ||
+      !projection.parse(data, size, index, &root)) {
+    return false;
+  }
+  std::swap(impl_->json, root);
+  impl_->generation += 1;
+  return true;
+}
+
+bool Json::parse_file(std::string path,
+                      const std::vector<Pointer> &pointers) noexcept {
+  return with_file_contents(path, [&](const char *data, size_t size) {
+    return parse(data, size, pointers);
+  });
+}
+
+// Ctor/dtor
+// ---------
+
+void Json::reset() noexcept {
+  {
+    ArenaScope scope{impl_->arena.get()};
+    impl_->json = nullptr;
+  }
+  impl_->generation += 1;
+  if (impl_->arena) {
+    impl_->arena->release();
+  }
+}
+
+Json::Json() noexcept { impl_.reset(new Json::Impl); }
+
+Json::Json(Allocation allocation) noexcept : Json() {
+  if (allocation == Allocation::kArena) {
+    impl_->arena.reset(new Arena);
+  }
+}
+
+Json::~Json() noexcept {}
+
+// Json::Cursor
+// ============
+
+Json::Cursor::Cursor() noexcept {}
+
+const std::string &Json::Cursor::path() const noexcept { return path_; }
+
+void *Json::Cursor::node(bool create) const noexcept {
+  if (!doc_) {
+    return nullptr;
+  }
+  Json::Impl *impl = doc_->impl_.get();
+  if (generation_ == impl->generation) {
+    return node_;
+  }
+  Document *node = nullptr;
+  if (create) {
+    ArenaScope scope{impl->arena.get()};
+    impl->generation += 1;
+    if (lookup_or_create(&impl->json, path_, &node) != Status::kOk) {
+      return nullptr;
+    }
+  } else {
+    const Document *found = nullptr;
+    if (lookup(impl->json, path_, &found) != Status::kOk) {
+      return nullptr;
+    }
+    node = const_cast<Document *>(found);
+  }
+  node_ = node;
+  generation_ = impl->generation;
+  return node_;
+}
+
+// Changes below the node of this cursor cannot move or destroy it, so the
+// cursor remains valid, while other cursors may not.
+void Json::Cursor::changed() noexcept {
+  doc_->impl_->generation += 1;
+  generation_ = doc_->impl_->generation;
+}
+
+bool Json::Cursor::get_cursor(std::string path, Cursor *cursor) noexcept {
+  auto base = static_cast<Document *>(node(true));
+  if (!cursor || !base) {
+    return false;
+  }
+  ArenaScope scope{doc_->impl_->arena.get()};
+  Document *target = nullptr;
+  std::string resolved = path_;
+  Status status = lookup_or_create(base, path, &target, &resolved);
+  changed();
+  if (status != Status::kOk) {
+    return false;
+  }
+  cursor->doc_ = doc_;
+  cursor->path_ = std::move(resolved);
+  cursor->node_ = target;
+  cursor->generation_ = generation_;
+  return true;
+}
+
+#define CURSOR_SET_IMPL_(path, value)                        \
+  auto base = static_cast<Document *>(node(true));           \
+  if (!base) {                                               \
+    return false;                                            \
+  }                                                          \
+  ArenaScope scope{doc_->impl_->arena.get()};                \
+  Document *target = nullptr;                                \
+  Status status = lookup_or_create(base, path, &target);     \
+  changed();                                                 \
+  if (status != Status::kOk) {                               \
+    return false;                                            \
+  }                                                          \
+  *target = value;                                           \
+  return true
+
+bool Json::Cursor::set_boolean(std::string path, bool value) noexcept {
+  CURSOR_SET_IMPL_(path, value);
+}
+
+bool Json::Cursor::set_float(std::string path, double value) noexcept {
+  CURSOR_SET_IMPL_(path, value);
+}
+
+bool Json::Cursor::set_integer(std::string path, int64_t value) noexcept {
+  CURSOR_SET_IMPL_(path, value);
+}
+
+bool Json::Cursor::set_string(std::string path, std::string value) noexcept {
+  CURSOR_SET_IMPL_(path, possibly_encode(value));
+}
+
+bool Json::Cursor::set_bytes(std::string path, std::string value) noexcept {
+  CURSOR_SET_IMPL_(path, make_bytes(value));
+}
+
+#define CURSOR_GET_IMPL_(path, value)                                   \
+  auto base = static_cast<const Document *>(node(false));               \
+  const Document *target = nullptr;                                     \
+  return value && base && lookup(*base, path, &target) == Status::kOk && \
+         get_value(*target, value) == Status::kOk
+
+bool Json::Cursor::get_boolean(std::string path, bool *value) const
+    noexcept {
+  CURSOR_GET_IMPL_(path, value);
+}
+
+bool Json::Cursor::get_float(std::string path, double *value) const
+    noexcept {
+  CURSOR_GET_IMPL_(path, value);
+}
+
+bool Json::Cursor::get_integer(std::string path, int64_t *value) const
+    noexcept {
+  CURSOR_GET_IMPL_(path, value);
+}
+
+bool Json::Cursor::get_string(std::string path, std::string *value) const
+    noexcept {
+  CURSOR_GET_IMPL_(path, value);
+}
+
+bool Json::Cursor::get_bytes(std::string path, std::string *value) const
+    noexcept {
+  auto base = static_cast<const Document *>(node(false));
+  return base && decode_bytes(*base, path, value);
+}
+
+bool Json::Cursor::get_array_keys(std::string path, ArrayKeys *ak) const
+    noexcept {
+  auto base = static_cast<const Document *>(node(false));
+  const Document *target = nullptr;
+  if (!ak || !base || lookup(*base, path, &target) != Status::kOk ||
+      !target->is_array()) {
+    return false;
+  }
+  *ak = ArrayKeys{path_ + path, target->size()};
+  doc_->save_array(target, ak);
+  return true;
+}
+
+#define CURSOR_PUSH_IMPL_(path, value)                          \
+  auto base = static_cast<Document *>(node(true));              \
+  if (!base) {                                                  \
+    return false;                                               \
+  }                                                             \
+  ArenaScope scope{doc_->impl_->arena.get()};                   \
+  Document *target = nullptr;                                   \
+  Status status = lookup_or_create(base, path, &target);        \
+  changed();                                                    \
+  if (status != Status::kOk ||                                  \
+      !(target->is_null() || target->is_array())) {             \
+    return false;                                               \
+  }                                                             \
+  target->push_back(value);                                     \
+  return true
+
+bool Json::Cursor::push_boolean(std::string path, bool value) noexcept {
+  CURSOR_PUSH_IMPL_(path, value);
+}
+
+bool Json::Cursor::push_float(std::string path, double value) noexcept {
+  CURSOR_PUSH_IMPL_(path, value);
+}
+
+bool Json::Cursor::push_integer(std::string path, int64_t value) noexcept {
+  CURSOR_PUSH_IMPL_(path, value);
+}
+
+bool Json::Cursor::push_string(std::string path, std::string value) noexcept {
+  CURSOR_PUSH_IMPL_(path, possibly_encode(value));
+}
+
+bool Json::Cursor::push_bytes(std::string path, std::string value) noexcept {
+  CURSOR_PUSH_IMPL_(path, make_bytes(value));
+}
+
+// PooledBuffer
+// ============
+
+// We keep a few buffers, which is enough for the usual pattern of borrowing
+// a buffer, filling it, and returning it.
+static constexpr size_t buffer_pool_size = 8;
+
+static thread_local std::vector<std::string> buffer_pool;
+
+PooledBuffer::PooledBuffer() noexcept {
+  if (!buffer_pool.empty()) {
+    std::swap(buffer_, buffer_pool.back());
+    buffer_pool.pop_back();
+  }
+}
+
+PooledBuffer::~PooledBuffer() noexcept {
+  if (buffer_pool.size() >= buffer_pool_size) {
+    return;
+  }
+  buffer_.clear();
+  try {
+    buffer_pool.reserve(buffer_pool_size);
+  } catch (const std::bad_alloc &) {
+    return;
+  }
+  buffer_pool.push_back(std::move(buffer_));
+}
+
+// StreamParser
+// ============
+
+class StreamParser::Impl {
+ public:
+  DomBuilder builder;
+  ChunkParser<DomBuilder> parser{&builder};
+};
+
+bool StreamParser::feed(const char *data, size_t size) noexcept {
+  return data && impl_->parser.feed(data, size);
+}
+
+bool StreamParser::feed(const std::string &chunk) noexcept {
+  return impl_->parser.feed(chunk.data(), chunk.size());
+}
+
+bool StreamParser::finish(Json *doc) noexcept {
+  bool ok = impl_->parser.finish();
+  if (ok && doc) {
+    std::swap(doc->impl_->json, impl_->builder.root);
+    doc->impl_->generation += 1;
+    // Release the previous document while its arena is current.
+    ArenaScope scope{doc->impl_->arena.get()};
+    impl_->builder.root = nullptr;
+  }
+  impl_->parser.reset();
+  impl_->builder = DomBuilder{};
+  return ok && doc;
+}
+
+StreamParser::StreamParser() noexcept { impl_.reset(new StreamParser::Impl); }
+
+StreamParser::~StreamParser() noexcept {}
+
+// SaxHandler
+// ==========
+
+bool SaxHandler::on_start_object() noexcept { return true; }
+
+bool SaxHandler::on_end_object() noexcept { return true; }
+
+bool SaxHandler::on_start_array() noexcept { return true; }
+
+bool SaxHandler::on_end_array() noexcept { return true; }
+
+bool SaxHandler::on_key(const char *, size_t) noexcept { return true; }
+
+bool SaxHandler::on_string(const char *, size_t) noexcept { return true; }
+
+bool SaxHandler::on_integer(int64_t) noexcept { return true; }
+
+bool SaxHandler::on_unsigned(uint64_t value) noexcept {
+  return (value <= (uint64_t)INT64_MAX) ? on_integer((int64_t)value)
+                                         : on_float((double)value);
+}
+
+bool SaxHandler::on_float(double) noexcept { return true; }
+
+bool SaxHandler::on_boolean(bool) noexcept { return true; }
+
+bool SaxHandler::on_null() noexcept { return true; }
+
+SaxHandler::~SaxHandler() noexcept {}
+
+// Adapts a SaxHandler to the interface required by simd_parse(), which
+// also passes the flags of strings and keys, which we do not need here.
+class SaxAdapter {
+ public:
+  explicit SaxAdapter(SaxHandler *handler) noexcept : handler_{handler} {}
+
+  bool on_start_object() noexcept { return handler_->on_start_object(); }
+
+  bool on_end_object() noexcept { return handler_->on_end_object(); }
+
+  bool on_start_array() noexcept { return handler_->on_start_array(); }
+
+  bool on_end_array() noexcept { return handler_->on_end_array(); }
+
+  bool on_key(const char *base, size_t count, unsigned) noexcept {
+    return handler_->on_key(base, count);
+  }
+
+  bool on_string(const char *base, size_t count, unsigned) noexcept {
+    return handler_->on_string(base, count);
+  }
+
+  bool on_unsigned(uint64_t value) noexcept {
+    return handler_->on_unsigned(value);
+  }
+
+  bool on_integer(int64_t value) noexcept {
+    return handler_->on_integer(value);
+  }
+
+  bool on_float(double value) noexcept { return handler_->on_float(value); }
+
+  bool on_boolean(bool value) noexcept { return handler_->on_boolean(value); }
+
+  bool on_null() noexcept { return handler_->on_null(); }
+
+ private:
+  SaxHandler *handler_;
+};
+
+bool sax_parse(const char *data, size_t size, SaxHandler *handler) noexcept {
+  if (!data || !handler) {
+    return false;
+  }
+  SaxAdapter adapter{handler};
+  if (size > StructuralIndex::max_size) {
+    ChunkParser<SaxAdapter> parser{&adapter};
+    return parser.feed(data, size) && parser.finish();
+  }
+  return simd_parse(data, size, &adapter);
+}
+
+// SaxParser
+// =========
+
+class SaxParser::Impl {
+ public:
+  explicit Impl(SaxHandler *h) noexcept
+      : handler{h}, adapter{h}, parser{&adapter} {}
+
+  SaxHandler *handler;
+  SaxAdapter adapter;
+  ChunkParser<SaxAdapter> parser;
+};
+
+SaxParser::SaxParser(SaxHandler *handler) noexcept {
+  impl_.reset(new SaxParser::Impl{handler});
+}
+
+bool SaxParser::feed(const char *data, size_t size) noexcept {
+  return data && impl_->handler && impl_->parser.feed(data, size);
+}
+
+bool SaxParser::feed(const std::string &chunk) noexcept {
+  return feed(chunk.data(), chunk.size());
+}
+
+bool SaxParser::finish() noexcept {
+  bool ok = impl_->handler && impl_->parser.finish();
+  impl_->parser.reset();
+  return ok;
+}
+
+SaxParser::~SaxParser() noexcept {}
+
+// NdjsonReader
+// ============
+
+void NdjsonReader::set_threads(size_t count) noexcept { threads_ = count; }
+
+void NdjsonReader::set_ordered(bool ordered) noexcept { ordered_ = ordered; }
+
+void NdjsonReader::set_backend(ParseBackend backend) noexcept {
+  backend_ = backend;
+}
+
+struct NdjsonRecord {
+  size_t offset = 0;
+  bool ok = false;
+  std::unique_ptr<Json> doc;
+};
+
+// Parses the records starting in the block [begin, end) of [data, size).
+// The record that contains |begin| belongs to the previous block, unless
+// |begin| is just after a newline.
+static std::vector<NdjsonRecord> parse_ndjson_block(
+    const char *data, size_t size, size_t begin, size_t end,
+    ParseBackend backend) noexcept {
+  std::vector<NdjsonRecord> records;
+  size_t start = begin;
+  if (begin > 0) {
+    auto nl = (const char *)memchr(data + begin - 1, '\n', size - begin + 1);
+    start = nl ? (size_t)(nl - data) + 1 : size;
+  }
+  while (start < end) {
+    auto nl = (const char *)memchr(data + start, '\n', size - start);
+    size_t stop = nl ? (size_t)(nl - data) : size;
+    bool blank = std::all_of(data + start, data + stop, [](char ch) {
+      return ch == ' ' || ch == '\t' || ch == '\r';
+    });
+    if (!blank) {
+      NdjsonRecord record;
+      record.offset = start;
+      record.doc.reset(new Json);
+      record.ok = record.doc->parse(data + start, stop - start, backend);
+      records.push_back(std::move(record));
+    }
+    start = stop + 1;
+  }
+  return records;
+}
+
+bool NdjsonReader::read(const char *data, size_t size,
+                        Callback callback) noexcept {
+  if (!data || !callback) {
+    return false;
+  }
+  size_t threads = threads_;
+  if (threads == 0) {
+    threads = std::max(std::thread::hardware_concurrency(), 1U);
+  }
+  // Use blocks small enough to balance the load and large enough for the
+  // parsing cost to dominate the cost of synchronization.
+  constexpr size_t min_block = 64 * 1024;
+  constexpr size_t max_block = 1024 * 1024;
+  size_t block = std::max(min_block, std::min(max_block, size / threads / 8));
+  size_t blocks = (size + block - 1) / block;
+  // In order mode, threads cannot get more than |window| blocks ahead
+  // of the first undelivered block, which bounds memory usage.
+  size_t window = 4 * threads;
+  std::atomic<size_t> next_block{0};
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::map<size_t, std::vector<NdjsonRecord>> parsed;
+  size_t next_delivery = 0;
+  bool all_ok = true;
+  auto deliver = [&](std::vector<NdjsonRecord> &records) {
+    for (auto &record : records) {
+      all_ok = all_ok && record.ok;
+      callback(record.offset, record.ok, *record.doc);
+    }
+  };
+  auto worker = [&]() {
+    for (;;) {
+      size_t index = next_block.fetch_add(1);
+      if (index >= blocks) {
+        break;
+      }
+      if (ordered_) {
+        std::unique_lock<std::mutex> lock{mutex};
+        cond.wait(lock, [&]() { return index < next_delivery + window; });
+      }
+      size_t begin = index * block;
+      size_t end = std::min(size, begin + block);
+      auto records = parse_ndjson_block(data, size, begin, end, backend_);
+      std::unique_lock<std::mutex> lock{mutex};
+      if (!ordered_) {
+        deliver(records);
+        continue;
+      }
+      parsed[index] = std::move(records);
+      for (auto it = parsed.find(next_delivery); it != parsed.end();
+           it = parsed.find(next_delivery)) {
+        deliver(it->second);
+        parsed.erase(it);
+        next_delivery += 1;
+      }
+      cond.notify_all();
+    }
+  };
+  std::vector<std::thread> pool;
+  for (size_t i = 1; i < threads && i < blocks; ++i) {
+    try {
+      pool.emplace_back(worker);
+    } catch (const std::exception &) {
+      // We could not start a thread (std::system_error) or store it
+      // (std::bad_alloc). Go on with the threads we have: since this
+      // thread also runs worker(), all blocks are parsed anyway.
+      break;
+    }
+  }
+  worker();
+  for (auto &thread : pool) {
+    thread.join();
+  }
+  return all_ok;
+}
+
+bool NdjsonReader::read_file(std::string path, Callback callback) noexcept {
+  return with_file_contents(path, [&](const char *data, size_t size) {
+    return read(data, size, std::move(callback));
+  });
+}
 
 }  // namespace libjson
 }  // namespace mk
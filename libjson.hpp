@@ -4,10 +4,15 @@
 #ifndef MEASUREMENT_KIT_LIBJSON_LIBJSON_HPP
 #define MEASUREMENT_KIT_LIBJSON_LIBJSON_HPP
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
+#include <functional>
+#include <iterator>
 #include <memory>
 #include <string>
+#include <vector>
 
 #define MK_LIBJSON_MAJOR 0
 #define MK_LIBJSON_MINOR 3
@@ -19,28 +24,66 @@ namespace libjson {
 // ArrayKeys
 // =========
 //
-// Helper to iterate over arrays.
+// Helper to iterate over arrays. Dereferencing an iterator yields the path
+// of the element. To access many elements, it is cheaper to pass their
+// index() to the index based getters of Json, which do not need to build
+// the path of each element and to walk the document from the root.
+//
+// Iter is a proxy iterator, like std::vector<bool>::iterator: it supports
+// all the random access operations, but it yields paths by value, while
+// C++11 requires a forward iterator to yield references. Algorithms that
+// only move and compare iterators work, but do not take the address of,
+// or bind a reference to, what an iterator yields.
 class ArrayKeys {
  public:
   class Iter {
    public:
-    // TODO(bassosimone): implement iterator traits
-    // xref: http://anderberg.me/2016/07/04/c-custom-iterators/
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = std::string;
+    using difference_type = ptrdiff_t;
+    using pointer = const std::string *;
+    using reference = std::string;
 
     Iter(const ArrayKeys &ak, size_t pos) noexcept;
 
     std::string operator*() const noexcept;
 
+    std::string operator[](difference_type count) const noexcept;
+
+    size_t index() const noexcept;
+
     Iter &operator++() noexcept;
 
-    Iter &operator++(int /*dummy*/) noexcept;
+    Iter operator++(int /*dummy*/) noexcept;
+
+    Iter &operator--() noexcept;
+
+    Iter operator--(int /*dummy*/) noexcept;
+
+    Iter &operator+=(difference_type count) noexcept;
+
+    Iter &operator-=(difference_type count) noexcept;
+
+    Iter operator+(difference_type count) const noexcept;
+
+    Iter operator-(difference_type count) const noexcept;
+
+    difference_type operator-(const Iter &other) const noexcept;
 
     bool operator==(const Iter &other) const noexcept;
 
     bool operator!=(const Iter &other) const noexcept;
 
+    bool operator<(const Iter &other) const noexcept;
+
+    bool operator>(const Iter &other) const noexcept;
+
+    bool operator<=(const Iter &other) const noexcept;
+
+    bool operator>=(const Iter &other) const noexcept;
+
    private:
-    const ArrayKeys &ak_;
+    const ArrayKeys *ak_;
     size_t pos_{};
   };
 
@@ -56,8 +99,120 @@ class ArrayKeys {
 
  private:
   friend class Iter;
+  friend class Json;
   std::string path_{};
   size_t size_{};
+  // Array found by Json::get_array_keys(), which we only use as long as
+  // its document does not change. We identify the document by a unique
+  // id rather than by address, because a destroyed document may be
+  // followed by a new one at the same address.
+  const void *array_{};
+  uint64_t owner_{};
+  uint64_t generation_{};
+};
+
+inline ArrayKeys::Iter operator+(ArrayKeys::Iter::difference_type count,
+                                 const ArrayKeys::Iter &iter) noexcept {
+  return iter + count;
+}
+
+// ParseBackend
+// ============
+//
+// Implementation used by Json::parse. Both produce the same document.
+enum class ParseBackend {
+  kDefault,  // nlohmann::json's character-at-a-time lexer
+  kSimd,     // Vectorized structural indexing followed by a grammar pass
+};
+
+// Allocation
+// ==========
+//
+// How a Json allocates its nodes.
+//
+// With kArena, the arena only grows until reset(). Overwriting values with
+// the set_* methods or a Cursor, replacing the document with parse(), and
+// a failed parse() all leave dead nodes behind, so a loop that keeps
+// rewriting a field grows without bound unless it calls reset().
+enum class Allocation {
+  kHeap,   // Each node is a separate heap allocation
+  kArena,  // Nodes come from a per-document arena released all at once
+};
+
+// Pointer
+// =======
+//
+// JSON pointer (RFC 6901) parsed once and usable many times. Pass it to
+// the Json methods instead of a string path to skip tokenizing the path
+// and unescaping its tokens on every call.
+class Pointer {
+ public:
+  static constexpr size_t npos = SIZE_MAX;
+
+  Pointer() noexcept;
+
+  explicit Pointer(std::string path) noexcept;
+
+  bool valid() const noexcept;
+
+  const std::string &path() const noexcept;
+
+ private:
+  friend class PointerTokens;
+  std::string path_{};
+  std::vector<std::string> tokens_{};
+  std::vector<size_t> indexes_{};  // npos if not an array index
+  bool valid_{};
+};
+
+// PointerSet
+// ==========
+//
+// Pointers whose values Json::get_values() reads in a single walk of the
+// document, and from which Json::build() builds a document. We organize
+// them as a trie, so that pointers sharing a prefix only walk it once, and
+// we keep the tokens in the same form as the keys of the document, so that
+// looking them up does not need to copy them.
+
+// How Json::get_values() reads a value, with the same conversions as the
+// getter of the corresponding type.
+enum class ValueType { kBoolean, kFloat, kInteger, kString, kBytes };
+
+class PointerSet {
+ public:
+  PointerSet() noexcept;
+
+  PointerSet(const PointerSet &) = delete;
+  PointerSet &operator=(const PointerSet &) = delete;
+
+  // Adds |path| and returns the index of its value in the results of
+  // Json::get_values(), which is the number of pointers added before it.
+  // An invalid pointer makes Json::get_values() fail.
+  size_t add(const Pointer &path, ValueType type) noexcept;
+
+  size_t add(std::string path, ValueType type) noexcept;
+
+  bool valid() const noexcept;
+
+  size_t size() const noexcept;
+
+  ~PointerSet() noexcept;
+
+ private:
+  friend class Json;
+  class Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+// Value read by Json::get_values(). Only the member of the requested type
+// is set, and only when |found| is true, i.e., when the pointer exists and
+// has a compatible type. Strings and bytes are both in |string_value|.
+struct PointerValue {
+  bool found = false;
+  bool boolean_value = false;
+  double float_value = 0.0;
+  int64_t integer_value = 0;
+  std::string string_value;
 };
 
 // Json
@@ -77,6 +232,13 @@ class Json {
 
   bool set_string(std::string path, std::string value) noexcept;
 
+  // Stores |value| as raw bytes, which are serialized as a base64 string,
+  // even if they are valid UTF-8. We only encode them when serializing, so
+  // the document does not hold their encoding. Like for a string stored by
+  // set_string(), get_string() returns the base64 encoding and get_bytes()
+  // returns the raw bytes.
+  bool set_bytes(std::string path, std::string value) noexcept;
+
   bool get_boolean(std::string path, bool *value) const noexcept;
 
   bool get_float(std::string path, double *value) const noexcept;
@@ -85,11 +247,37 @@ class Json {
 
   bool get_string(std::string path, std::string *value) const noexcept;
 
+  // Gets the bytes stored by set_bytes(), or the bytes of a string that
+  // set_string() stored as base64 because it was not valid UTF-8, decoding
+  // them into |value|. Fails if the string is not base64, in which case
+  // the content of |value| is unspecified.
+  bool get_bytes(std::string path, std::string *value) const noexcept;
+
   // Array operations
   // ----------------
 
   bool get_array_keys(std::string path, ArrayKeys *ak) const noexcept;
 
+  // Index based getters for the elements of the array whose keys are in
+  // |ak|. Until the document changes, we access the array directly, since
+  // get_array_keys() saved where it is. Afterwards, we find it again
+  // using the path in |ak|. Fail if |index| is out of range.
+
+  bool get_boolean(const ArrayKeys &ak, size_t index,
+                   bool *value) const noexcept;
+
+  bool get_float(const ArrayKeys &ak, size_t index,
+                 double *value) const noexcept;
+
+  bool get_integer(const ArrayKeys &ak, size_t index,
+                   int64_t *value) const noexcept;
+
+  bool get_string(const ArrayKeys &ak, size_t index,
+                  std::string *value) const noexcept;
+
+  bool get_bytes(const ArrayKeys &ak, size_t index,
+                 std::string *value) const noexcept;
+
   bool push_boolean(std::string path, bool value) noexcept;
 
   bool push_float(std::string path, double value) noexcept;
@@ -98,25 +286,425 @@ class Json {
 
   bool push_string(std::string path, std::string value) noexcept;
 
+  bool push_bytes(std::string path, std::string value) noexcept;
+
+  // Batch operations: they resolve |path| once for the whole array. The
+  // push functions append |count| values, creating the array if needed.
+  // The get functions replace the content of |values| with the elements
+  // of the array, converted like the corresponding scalar getter does,
+  // and fail if any element has the wrong type, in which case the content
+  // of |values| is unspecified.
+
+  bool push_floats(std::string path, const double *values,
+                   size_t count) noexcept;
+
+  bool push_integers(std::string path, const int64_t *values,
+                     size_t count) noexcept;
+
+  bool push_strings(std::string path,
+                    const std::vector<std::string> &values) noexcept;
+
+  bool get_floats(std::string path,
+                  std::vector<double> *values) const noexcept;
+
+  bool get_integers(std::string path,
+                    std::vector<int64_t> *values) const noexcept;
+
+  bool get_strings(std::string path,
+                   std::vector<std::string> *values) const noexcept;
+
+  // Precompiled pointer operations
+  // ------------------------------
+
+  bool set_boolean(const Pointer &path, bool value) noexcept;
+
+  bool set_float(const Pointer &path, double value) noexcept;
+
+  bool set_integer(const Pointer &path, int64_t value) noexcept;
+
+  bool set_string(const Pointer &path, std::string value) noexcept;
+
+  bool set_bytes(const Pointer &path, std::string value) noexcept;
+
+  bool get_boolean(const Pointer &path, bool *value) const noexcept;
+
+  bool get_float(const Pointer &path, double *value) const noexcept;
+
+  bool get_integer(const Pointer &path, int64_t *value) const noexcept;
+
+  bool get_string(const Pointer &path, std::string *value) const noexcept;
+
+  bool get_bytes(const Pointer &path, std::string *value) const noexcept;
+
+  bool get_array_keys(const Pointer &path, ArrayKeys *ak) const noexcept;
+
+  bool push_boolean(const Pointer &path, bool value) noexcept;
+
+  bool push_float(const Pointer &path, double value) noexcept;
+
+  bool push_integer(const Pointer &path, int64_t value) noexcept;
+
+  bool push_string(const Pointer &path, std::string value) noexcept;
+
+  bool push_bytes(const Pointer &path, std::string value) noexcept;
+
+  bool push_floats(const Pointer &path, const double *values,
+                   size_t count) noexcept;
+
+  bool push_integers(const Pointer &path, const int64_t *values,
+                     size_t count) noexcept;
+
+  bool push_strings(const Pointer &path,
+                    const std::vector<std::string> &values) noexcept;
+
+  bool get_floats(const Pointer &path,
+                  std::vector<double> *values) const noexcept;
+
+  bool get_integers(const Pointer &path,
+                    std::vector<int64_t> *values) const noexcept;
+
+  bool get_strings(const Pointer &path,
+                   std::vector<std::string> *values) const noexcept;
+
+  // Pointer set operations
+  // ----------------------
+
+  // Reads the values of the pointers in |set| into the corresponding
+  // elements of |values|, which we resize to the size of |set|. Missing
+  // pointers and pointers with the wrong type are not an error, they just
+  // are not found. Reusing |values| across calls reuses its memory, so
+  // that we do not allocate once it is large enough. Fails if |set| is
+  // not valid.
+  bool get_values(const PointerSet &set,
+                  std::vector<PointerValue> *values) const noexcept;
+
+  // Replaces the document with one holding the elements of |values| that
+  // are found, each at the corresponding pointer of |set|. Since the set
+  // groups the pointers by prefix, we create each container once, sizing
+  // arrays up front and adding object keys in order. A container becomes
+  // an array if all its keys are array indexes, with null for missing
+  // elements, and an object otherwise, e.g., if it mixes indexes and
+  // names. Unlike with the set functions, "-" is just a name and does not
+  // append. If many values are at the same pointer, the last found wins.
+  // Fails, without modifying the document, if |set| is not valid, if
+  // |values| has a different size, or if a value would also be the
+  // container of another value.
+  bool build(const PointerSet &set,
+             const std::vector<PointerValue> &values) noexcept;
+
+  // Cursors
+  // -------
+
+  class Cursor;
+
+  // Initializes |cursor| to point to the node at |path|, creating it, like
+  // the set functions do, if it does not exist.
+  bool get_cursor(std::string path, Cursor *cursor) noexcept;
+
+  bool get_cursor(const Pointer &path, Cursor *cursor) noexcept;
+
   // Serialize/parse
   // ---------------
 
   bool serialize(std::string *str) const noexcept;
 
+  // Appends the output to |str|, reusing its capacity, so that we can
+  // batch many documents into the same buffer. On failure, |str| is
+  // truncated back to its original size.
+  bool serialize_append(std::string *str) const noexcept;
+
+  // Streaming serialize: the output goes through a buffer of constant size
+  // that we pass to |writer| whenever it is full and at the end, so we can
+  // start writing before the whole document is serialized. If |writer|
+  // returns false, we stop and fail. On failure, part of the output may
+  // have already been written.
+  using Writer = std::function<bool(const char *data, size_t size)>;
+
+  bool serialize(Writer writer) const noexcept;
+
+  // Writes the output to |filep|, which we do not flush.
+  bool serialize_file(FILE *filep) const noexcept;
+
+  // Writes the output to the file descriptor |fd|.
+  bool serialize_fd(int fd) const noexcept;
+
   bool parse(std::string str) noexcept;
 
+  // Parses |size| bytes at |data| without copying them.
+  bool parse(const char *data, size_t size) noexcept;
+
+  // Maps the file at |path| in memory and parses the mapping.
+  bool parse_file(std::string path) noexcept;
+
+  bool parse(std::string str, ParseBackend backend) noexcept;
+
+  bool parse(const char *data, size_t size, ParseBackend backend) noexcept;
+
+  bool parse_file(std::string path, ParseBackend backend) noexcept;
+
+  // Projection parse: only builds the subtrees at |pointers|, along with
+  // the containers enclosing them, and skips the rest of the input without
+  // parsing it, hence the skipped values are only checked for balanced
+  // brackets and terminated strings. Pointers missing in the input are
+  // ignored. Fails if any pointer is invalid.
+  bool parse(std::string str, const std::vector<Pointer> &pointers) noexcept;
+
+  bool parse(const char *data, size_t size,
+             const std::vector<Pointer> &pointers) noexcept;
+
+  bool parse_file(std::string path,
+                  const std::vector<Pointer> &pointers) noexcept;
+
+  // Clears the document. With Allocation::kArena, this is the only way to
+  // reclaim dead nodes: the memory used by the arena is kept for building
+  // the next document.
+  void reset() noexcept;
+
   // Ctor/dtor
   // ---------
 
   Json() noexcept;
 
+  explicit Json(Allocation allocation) noexcept;
+
   ~Json() noexcept;
 
  private:
+  friend class StreamParser;
   class Impl;
+
+  // Lets |ak| access |array| directly until the document changes.
+  void save_array(const void *array, ArrayKeys *ak) const noexcept;
+
   std::unique_ptr<Impl> impl_;
 };
 
+// Json::Cursor
+// ============
+//
+// Node of a Json that we can get, set and push relative to, without walking
+// the document from the root every time. Relative paths are JSON pointers
+// whose root is the node of the cursor, e.g., "/status_code", or "" for
+// the node itself.
+//
+// A cursor remembers where its node is. Changes made through the cursor
+// keep it valid. After any other change to the document, including one
+// made through another cursor, the cursor finds its node again using its
+// path, creating it if needed when setting or pushing. This is correct
+// but slower. Since each "-" in the path is replaced, when creating the
+// cursor, by the index of the element it appended, finding the node again
+// does not append another element. A cursor must not outlive its Json.
+class Json::Cursor {
+ public:
+  Cursor() noexcept;
+
+  // Absolute path of the node, where each "-" is replaced by an index.
+  const std::string &path() const noexcept;
+
+  // Initializes |cursor| to point to the node at |path|, relative to this
+  // one, creating it if needed.
+  bool get_cursor(std::string path, Cursor *cursor) noexcept;
+
+  bool set_boolean(std::string path, bool value) noexcept;
+
+  bool set_float(std::string path, double value) noexcept;
+
+  bool set_integer(std::string path, int64_t value) noexcept;
+
+  bool set_string(std::string path, std::string value) noexcept;
+
+  bool set_bytes(std::string path, std::string value) noexcept;
+
+  bool get_boolean(std::string path, bool *value) const noexcept;
+
+  bool get_float(std::string path, double *value) const noexcept;
+
+  bool get_integer(std::string path, int64_t *value) const noexcept;
+
+  bool get_string(std::string path, std::string *value) const noexcept;
+
+  bool get_bytes(std::string path, std::string *value) const noexcept;
+
+  // The keys have absolute paths, so they also work with Json methods.
+  bool get_array_keys(std::string path, ArrayKeys *ak) const noexcept;
+
+  bool push_boolean(std::string path, bool value) noexcept;
+
+  bool push_float(std::string path, double value) noexcept;
+
+  bool push_integer(std::string path, int64_t value) noexcept;
+
+  bool push_string(std::string path, std::string value) noexcept;
+
+  bool push_bytes(std::string path, std::string value) noexcept;
+
+ private:
+  friend class Json;
+
+  // Returns the node, finding it again if the document changed.
+  void *node(bool create) const noexcept;
+
+  // Called after changing the document through this cursor.
+  void changed() noexcept;
+
+  Json *doc_{};
+  std::string path_{};
+  mutable void *node_{};
+  mutable uint64_t generation_{};
+};
+
+// PooledBuffer
+// ============
+//
+// Buffer borrowed from a pool owned by the current thread. It goes back to
+// the pool on destruction, cleared but keeping its capacity, so that code
+// serializing many documents into pooled buffers does not allocate once
+// the pool is warm.
+class PooledBuffer {
+ public:
+  PooledBuffer() noexcept;
+
+  PooledBuffer(const PooledBuffer &) = delete;
+  PooledBuffer &operator=(const PooledBuffer &) = delete;
+
+  std::string *get() noexcept { return &buffer_; }
+
+  std::string *operator->() noexcept { return &buffer_; }
+
+  ~PooledBuffer() noexcept;
+
+ private:
+  std::string buffer_;
+};
+
+// StreamParser
+// ============
+//
+// Parses a JSON delivered in chunks, e.g. while it is received from the
+// network. The document is built as soon as each token is complete and
+// only the token split across two chunks is buffered.
+class StreamParser {
+ public:
+  // Parses the next chunk. Returns false if the input is not valid, in
+  // which case all subsequent calls fail until finish() is called.
+  bool feed(const char *data, size_t size) noexcept;
+
+  bool feed(const std::string &chunk) noexcept;
+
+  // Moves the parsed document into |doc| and gets ready to parse a new
+  // document. Returns false if the input is invalid or incomplete, and in
+  // such case |doc| is not modified.
+  bool finish(Json *doc) noexcept;
+
+  StreamParser() noexcept;
+
+  ~StreamParser() noexcept;
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+// SaxHandler
+// ==========
+//
+// Receives the events emitted by sax_parse() and SaxParser. Each method
+// returns false to stop parsing, and by default it does nothing. Strings
+// may point into the input or into a buffer of the parser, e.g., when they
+// contain escape sequences or when SaxParser receives them split across
+// chunks. Whatever their source, they are not zero terminated and are only
+// valid until the method returns.
+class SaxHandler {
+ public:
+  virtual bool on_start_object() noexcept;
+
+  virtual bool on_end_object() noexcept;
+
+  virtual bool on_start_array() noexcept;
+
+  virtual bool on_end_array() noexcept;
+
+  virtual bool on_key(const char *base, size_t count) noexcept;
+
+  virtual bool on_string(const char *base, size_t count) noexcept;
+
+  virtual bool on_integer(int64_t value) noexcept;
+
+  // Called for non-negative integers. By default, forwards to on_integer()
+  // if the value fits into an int64_t and to on_float() otherwise.
+  virtual bool on_unsigned(uint64_t value) noexcept;
+
+  virtual bool on_float(double value) noexcept;
+
+  virtual bool on_boolean(bool value) noexcept;
+
+  virtual bool on_null() noexcept;
+
+  virtual ~SaxHandler() noexcept;
+};
+
+// Parses |size| bytes at |data| without building a document.
+bool sax_parse(const char *data, size_t size, SaxHandler *handler) noexcept;
+
+// SaxParser
+// =========
+//
+// Like StreamParser but delivers the events to a SaxHandler, hence it
+// processes documents of any size using constant memory.
+class SaxParser {
+ public:
+  explicit SaxParser(SaxHandler *handler) noexcept;
+
+  bool feed(const char *data, size_t size) noexcept;
+
+  bool feed(const std::string &chunk) noexcept;
+
+  // Returns true if the input was a complete document and gets ready to
+  // parse a new document.
+  bool finish() noexcept;
+
+  ~SaxParser() noexcept;
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+// NdjsonReader
+// ============
+//
+// Parses newline delimited JSON (aka JSON Lines) using a pool of threads.
+// Threads pick blocks of records from a shared counter, so that faster
+// threads naturally take more work. Blank lines are skipped.
+class NdjsonReader {
+ public:
+  // Called with the byte offset of a record in the input, whether we
+  // could parse it, and the parsed document. Calls are serialized, so the
+  // callback does not need locking, but they happen on the pool threads.
+  using Callback = std::function<void(size_t offset, bool ok, Json &doc)>;
+
+  // Number of threads to use, zero meaning one per hardware thread.
+  void set_threads(size_t count) noexcept;
+
+  // Whether records are delivered in input order (the default) or as
+  // soon as they are parsed.
+  void set_ordered(bool ordered) noexcept;
+
+  // Backend used to parse records. Unlike Json::parse(), the default is
+  // ParseBackend::kSimd, since NDJSON is mostly used for bulk input.
+  void set_backend(ParseBackend backend) noexcept;
+
+  // Returns true if all records were successfully parsed.
+  bool read(const char *data, size_t size, Callback callback) noexcept;
+
+  bool read_file(std::string path, Callback callback) noexcept;
+
+ private:
+  size_t threads_{};
+  bool ordered_{true};
+  ParseBackend backend_{ParseBackend::kSimd};
+};
+
 }  // namespace libjson
 }  // namespace mk
 #endif
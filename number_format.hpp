@@ -0,0 +1,30 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef NUMBER_FORMAT_HPP
+#define NUMBER_FORMAT_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace mk {
+namespace libjson {
+
+// Size of a buffer large enough for the output of any function below.
+constexpr size_t number_format_size = 32;
+
+// Writes |value| in decimal into |out| and returns one past the last
+// character written. The output is not zero terminated.
+char *format_unsigned(uint64_t value, char *out) noexcept;
+
+char *format_integer(int64_t value, char *out) noexcept;
+
+// Writes |value| into |out| like nlohmann::json does, but with the shortest
+// sequence of digits that parses back to |value|, and returns one past the
+// last character written. Like nlohmann::json, we write "null" if |value|
+// is not finite. The output is not zero terminated.
+char *format_double(double value, char *out) noexcept;
+
+}  // namespace libjson
+}  // namespace mk
+#endif
@@ -0,0 +1,21 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef NUMBER_PARSE_HPP
+#define NUMBER_PARSE_HPP
+
+#include <stdint.h>
+
+namespace mk {
+namespace libjson {
+
+// Sets |*value| to w * 10^q, correctly rounded to nearest even, negated if
+// |negative| is true. Values too small become zero and values too large
+// become infinity. Returns false in the rare cases where we cannot quickly
+// decide how to round, in which case the caller should use strtod().
+bool decimal_to_double(uint64_t w, int64_t q, bool negative,
+                       double *value) noexcept;
+
+}  // namespace libjson
+}  // namespace mk
+#endif
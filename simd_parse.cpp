@@ -0,0 +1,641 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "simd_parse.hpp"
+
+#include <errno.h>
+#include <locale.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "number_parse.hpp"
+#include "utf8_decode.hpp"
+#include "utf8_validate.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_PARSE_X86 1
+#include <immintrin.h>
+#endif
+
+namespace mk {
+namespace libjson {
+
+// Classification
+// ==============
+//
+// Computes, for a block of 64 bytes, the bitmasks of the characters that
+// stage 1 cares about. Bit N of each mask corresponds to byte N.
+
+struct Masks {
+  uint64_t quote = 0;
+  uint64_t backslash = 0;
+  uint64_t op = 0;  // {}[]:,
+  uint64_t ws = 0;  // space, \t, \n, \r
+};
+
+static void classify_scalar(const char *block, Masks *masks) noexcept {
+  for (size_t i = 0; i < 64; ++i) {
+    uint64_t bit = (uint64_t)1 << i;
+    switch (block[i]) {
+      case '"':
+        masks->quote |= bit;
+        break;
+      case '\\':
+        masks->backslash |= bit;
+        break;
+      case '{':
+      case '}':
+      case '[':
+      case ']':
+      case ':':
+      case ',':
+        masks->op |= bit;
+        break;
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\r':
+        masks->ws |= bit;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+#ifdef SIMD_PARSE_X86
+
+// Note: ORing with 0x20 maps '[' to '{' and ']' to '}', so that we need
+// four comparisons rather than six to find the structural characters.
+
+__attribute__((target("sse2"))) static void classify_sse2(
+    const char *block, Masks *masks) noexcept {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i lower = _mm_set1_epi8(0x20);
+  const __m128i open = _mm_set1_epi8('{');
+  const __m128i close = _mm_set1_epi8('}');
+  const __m128i colon = _mm_set1_epi8(':');
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i cr = _mm_set1_epi8('\r');
+  for (size_t i = 0; i < 64; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(block + i));
+    __m128i lv = _mm_or_si128(v, lower);
+    __m128i op = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(lv, open), _mm_cmpeq_epi8(lv, close)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma)));
+    __m128i ws = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, lower), _mm_cmpeq_epi8(v, tab)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+    masks->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(v, quote))
+                    << i;
+    masks->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                            _mm_cmpeq_epi8(v, backslash))
+                        << i;
+    masks->op |= (uint64_t)(uint16_t)_mm_movemask_epi8(op) << i;
+    masks->ws |= (uint64_t)(uint16_t)_mm_movemask_epi8(ws) << i;
+  }
+}
+
+__attribute__((target("avx2"))) static void classify_avx2(
+    const char *block, Masks *masks) noexcept {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i lower = _mm256_set1_epi8(0x20);
+  const __m256i open = _mm256_set1_epi8('{');
+  const __m256i close = _mm256_set1_epi8('}');
+  const __m256i colon = _mm256_set1_epi8(':');
+  const __m256i comma = _mm256_set1_epi8(',');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  const __m256i cr = _mm256_set1_epi8('\r');
+  for (size_t i = 0; i < 64; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(block + i));
+    __m256i lv = _mm256_or_si256(v, lower);
+    __m256i op = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(lv, open),
+                        _mm256_cmpeq_epi8(lv, close)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, colon),
+                        _mm256_cmpeq_epi8(v, comma)));
+    __m256i ws = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, lower),
+                        _mm256_cmpeq_epi8(v, tab)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+    masks->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                        _mm256_cmpeq_epi8(v, quote))
+                    << i;
+    masks->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                            _mm256_cmpeq_epi8(v, backslash))
+                        << i;
+    masks->op |= (uint64_t)(uint32_t)_mm256_movemask_epi8(op) << i;
+    masks->ws |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ws) << i;
+  }
+}
+
+#endif  // SIMD_PARSE_X86
+
+using Classifier = void (*)(const char *, Masks *);
+
+static Classifier select_classifier() noexcept {
+#ifdef SIMD_PARSE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return classify_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return classify_sse2;
+  }
+#endif
+  return classify_scalar;
+}
+
+// Stage 1
+// =======
+
+constexpr size_t StructuralIndex::max_size;
+
+static inline int count_trailing_zeros(uint64_t value) noexcept {
+#ifdef __GNUC__
+  return __builtin_ctzll(value);
+#else
+  int count = 0;
+  while ((value & 1) == 0) {
+    value >>= 1;
+    count += 1;
+  }
+  return count;
+#endif
+}
+
+// Returns the mask of the characters escaped by a backslash. |*carry| is
+// one when the previous block ended with an unescaped backslash. We walk
+// the backslashes one by one, which is cheap since they are rare compared
+// to the other characters.
+static inline uint64_t find_escaped(uint64_t backslash,
+                                    uint64_t *carry) noexcept {
+  uint64_t escaped = *carry;
+  *carry = 0;
+  backslash &= ~escaped;
+  while (backslash != 0) {
+    int pos = count_trailing_zeros(backslash);
+    if (pos == 63) {
+      *carry = 1;
+      break;
+    }
+    uint64_t next = (uint64_t)1 << (pos + 1);
+    escaped |= next;
+    backslash &= ~((next << 1) - 1);  // Clears pos and the escaped char
+  }
+  return escaped;
+}
+
+// Returns a mask where each bit is the XOR of all the previous bits of
+// |value|, inclusive. Applied to the quotes, this yields a mask where the
+// opening quote and the content of strings are set.
+static inline uint64_t prefix_xor(uint64_t value) noexcept {
+  value ^= value << 1;
+  value ^= value << 2;
+  value ^= value << 4;
+  value ^= value << 8;
+  value ^= value << 16;
+  value ^= value << 32;
+  return value;
+}
+
+bool StructuralIndex::build(const char *data, size_t size) noexcept {
+  static const Classifier classify = select_classifier();
+  count_ = 0;
+  if (size > max_size) {
+    return false;
+  }
+  // Note: operator new[] without initializer does not touch the memory,
+  // hence the kernel only commits the pages we actually write to.
+  if (capacity_ < size + 1) {
+    indexes_.reset(new uint32_t[size + 1]);
+    capacity_ = size + 1;
+  }
+  uint32_t *out = indexes_.get();
+  uint64_t escape_carry = 0;
+  uint64_t string_carry = 0;
+  uint64_t scalar_carry = 0;
+  for (size_t base = 0; base < size; base += 64) {
+    const char *block = data + base;
+    char tail[64];
+    if (size - base < 64) {
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, block, size - base);
+      block = tail;
+    }
+    Masks masks;
+    classify(block, &masks);
+    uint64_t escaped = find_escaped(masks.backslash, &escape_carry);
+    uint64_t quote = masks.quote & ~escaped;
+    uint64_t in_string = prefix_xor(quote) ^ string_carry;
+    string_carry = (uint64_t)((int64_t)in_string >> 63);
+    uint64_t scalar = ~(masks.op | masks.ws | quote) & ~in_string;
+    uint64_t structurals = (masks.op & ~in_string) | (quote & in_string) |
+                           (scalar & ~((scalar << 1) | scalar_carry));
+    scalar_carry = scalar >> 63;
+    while (structurals != 0) {
+      *out++ = (uint32_t)(base + (size_t)count_trailing_zeros(structurals));
+      structurals &= structurals - 1;
+    }
+  }
+  count_ = (size_t)(out - indexes_.get());
+  return string_carry == 0;
+}
+
+// Strings
+// =======
+
+// Returns the value of the hex digit |ch| or -1.
+static inline int hex_value(char ch) noexcept {
+  if (ch >= '0' && ch <= '9') {
+    return ch - '0';
+  }
+  if (ch >= 'a' && ch <= 'f') {
+    return ch - 'a' + 10;
+  }
+  if (ch >= 'A' && ch <= 'F') {
+    return ch - 'A' + 10;
+  }
+  return -1;
+}
+
+// Parses the four hex digits at |pos|.
+static inline bool parse_hex4(const char *data, size_t size, size_t pos,
+                              uint32_t *value) noexcept {
+  if (size - pos < 4) {
+    return false;
+  }
+  *value = 0;
+  for (size_t i = 0; i < 4; ++i) {
+    int digit = hex_value(data[pos + i]);
+    if (digit < 0) {
+      return false;
+    }
+    *value = (*value << 4) | (uint32_t)digit;
+  }
+  return true;
+}
+
+static void append_utf8(uint32_t codepoint, std::string *out) noexcept {
+  if (codepoint < 0x80) {
+    *out += (char)codepoint;
+  } else if (codepoint <= 0x7ff) {
+    *out += (char)(0xc0 | (codepoint >> 6));
+    *out += (char)(0x80 | (codepoint & 0x3f));
+  } else if (codepoint <= 0xffff) {
+    *out += (char)(0xe0 | (codepoint >> 12));
+    *out += (char)(0x80 | ((codepoint >> 6) & 0x3f));
+    *out += (char)(0x80 | (codepoint & 0x3f));
+  } else {
+    *out += (char)(0xf0 | (codepoint >> 18));
+    *out += (char)(0x80 | ((codepoint >> 12) & 0x3f));
+    *out += (char)(0x80 | ((codepoint >> 6) & 0x3f));
+    *out += (char)(0x80 | (codepoint & 0x3f));
+  }
+}
+
+// Decodes the escape sequence whose backslash is at |*pos| and moves
+// |*pos| past it. Surrogates must be paired, like in nlohmann::json.
+static bool parse_escape(const char *data, size_t size, size_t *pos,
+                         std::string *out) noexcept {
+  size_t cur = *pos + 1;
+  if (cur >= size) {
+    return false;
+  }
+  switch (data[cur]) {
+    case '"':
+    case '\\':
+    case '/':
+      *out += data[cur];
+      break;
+    case 'b':
+      *out += '\b';
+      break;
+    case 'f':
+      *out += '\f';
+      break;
+    case 'n':
+      *out += '\n';
+      break;
+    case 'r':
+      *out += '\r';
+      break;
+    case 't':
+      *out += '\t';
+      break;
+    case 'u': {
+      uint32_t codepoint = 0;
+      if (!parse_hex4(data, size, cur + 1, &codepoint)) {
+        return false;
+      }
+      cur += 4;
+      if (codepoint >= 0xd800 && codepoint <= 0xdbff) {
+        uint32_t low = 0;
+        if (size - cur < 3 || data[cur + 1] != '\\' || data[cur + 2] != 'u' ||
+            !parse_hex4(data, size, cur + 3, &low) || low < 0xdc00 ||
+            low > 0xdfff) {
+          return false;
+        }
+        cur += 6;
+        codepoint = 0x10000 + ((codepoint - 0xd800) << 10) + (low - 0xdc00);
+      } else if (codepoint >= 0xdc00 && codepoint <= 0xdfff) {
+        return false;
+      }
+      append_utf8(codepoint, out);
+      break;
+    }
+    default:
+      return false;
+  }
+  *pos = cur + 1;
+  return true;
+}
+
+// Returns the position of the first quote, backslash, control character
+// or non-ASCII byte at or after |pos|, or |size| if there is none.
+static inline size_t find_special(const char *data, size_t size,
+                                  size_t pos) noexcept {
+#if defined(SIMD_PARSE_X86) && defined(__SSE2__)
+  // Note: a signed comparison with 0x20 catches both the control
+  // characters and the bytes larger than 0x7f.
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x20);
+  while (size - pos >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(data + pos));
+    __m128i special =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                  _mm_cmpeq_epi8(v, backslash)),
+                     _mm_cmplt_epi8(v, control));
+    int mask = _mm_movemask_epi8(special);
+    if (mask != 0) {
+      return pos + (size_t)count_trailing_zeros((uint64_t)mask);
+    }
+    pos += 16;
+  }
+#endif
+  for (; pos < size; ++pos) {
+    uint8_t ch = (uint8_t)data[pos];
+    if (ch == '"' || ch == '\\' || ch < 0x20 || ch >= 0x80) {
+      break;
+    }
+  }
+  return pos;
+}
+
+// Validates the UTF-8 sequence starting at |*pos| and moves past it.
+static inline bool skip_utf8(const char *data, size_t size,
+                             size_t *pos) noexcept {
+  uint32_t state = UTF8_ACCEPT;
+  uint32_t codepoint = 0;
+  size_t cur = *pos;
+  do {
+    if (cur >= size ||
+        utf8_decode(&state, &codepoint, (uint8_t)data[cur++]) ==
+            UTF8_REJECT) {
+      return false;
+    }
+  } while (state != UTF8_ACCEPT);
+  *pos = cur;
+  return true;
+}
+
+bool parse_string(const char *data, size_t size, size_t pos, size_t *end,
+                  bool *escaped, std::string *scratch,
+                  unsigned *flags) noexcept {
+  size_t cur = pos + 1;
+  size_t run = cur;  // Start of the run not yet copied into |*scratch|
+  unsigned result = utf8_scanned | utf8_valid | utf8_ascii;
+  *escaped = false;
+  for (;;) {
+    cur = find_special(data, size, cur);
+    if (cur >= size) {
+      return false;
+    }
+    uint8_t ch = (uint8_t)data[cur];
+    if (ch == '"') {
+      break;
+    }
+    if (ch >= 0x80) {
+      if (!skip_utf8(data, size, &cur)) {
+        return false;
+      }
+      result &= ~utf8_ascii;
+      continue;
+    }
+    if (ch != '\\') {
+      return false;  // Control characters must be escaped
+    }
+    if (!*escaped) {
+      *escaped = true;
+      scratch->clear();
+    }
+    scratch->append(data + run, cur - run);
+    size_t decoded = scratch->size();
+    if (!parse_escape(data, size, &cur, scratch)) {
+      return false;
+    }
+    // The decoded character may need escaping when serializing.
+    uint8_t first = (uint8_t)(*scratch)[decoded];
+    if (first >= 0x80) {
+      result &= ~utf8_ascii;
+    } else if (first < 0x20 || first == '"' || first == '\\') {
+      result |= utf8_escape;
+    }
+    run = cur;
+  }
+  if (*escaped) {
+    scratch->append(data + run, cur - run);
+  }
+  *end = cur;
+  *flags = result;
+  return true;
+}
+
+// Numbers
+// =======
+
+static inline bool is_digit(char ch) noexcept {
+  return ch >= '0' && ch <= '9';
+}
+
+// Returns true if the eight bytes in |chunk| are all digits. Adding six
+// to a digit does not change its high nibble, unlike for ':' and above.
+static inline bool is_eight_digits(uint64_t chunk) noexcept {
+  return ((chunk & 0xf0f0f0f0f0f0f0f0ULL) |
+          (((chunk + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4)) ==
+         0x3333333333333333ULL;
+}
+
+// Returns the value of the eight digits in |chunk|, where the first digit
+// is the least significant byte, by combining pairs, then quads, then the
+// two halves, with one multiplication each.
+static inline uint32_t parse_eight_digits(uint64_t chunk) noexcept {
+  chunk = ((chunk & 0x0f0f0f0f0f0f0f0fULL) * 2561) >> 8;
+  chunk = ((chunk & 0x00ff00ff00ff00ffULL) * 6553601) >> 16;
+  return (uint32_t)(((chunk & 0x0000ffff0000ffffULL) * 42949672960001ULL) >>
+                    32);
+}
+
+// Accumulates the run of digits starting at |pos| into |*value|, which
+// wraps around if there are too many digits, and returns the position
+// following the run. We convert eight digits at a time while we can.
+static inline size_t parse_digits(const char *data, size_t size, size_t pos,
+                                  uint64_t *value) noexcept {
+  uint64_t result = *value;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (size - pos >= 8) {
+    uint64_t chunk = 0;
+    memcpy(&chunk, data + pos, sizeof(chunk));
+    if (!is_eight_digits(chunk)) {
+      break;
+    }
+    result = result * 100000000 + parse_eight_digits(chunk);
+    pos += 8;
+  }
+#endif
+  while (pos < size && is_digit(data[pos])) {
+    result = result * 10 + (uint64_t)(data[pos] - '0');
+    pos += 1;
+  }
+  *value = result;
+  return pos;
+}
+
+// Converts [begin, end) using strtod(), which requires a zero terminated
+// string using the decimal point of the current locale.
+static bool parse_double(const char *begin, const char *end,
+                         double *value) noexcept {
+  char buffer[64];
+  std::string storage;
+  char *str = buffer;
+  size_t len = (size_t)(end - begin);
+  if (len >= sizeof(buffer)) {
+    storage.resize(len + 1);
+    str = &storage[0];
+  }
+  memcpy(str, begin, len);
+  str[len] = '\0';
+  const char *point = localeconv()->decimal_point;
+  if (point && point[0] != '\0' && point[0] != '.' && point[1] == '\0') {
+    char *dot = strchr(str, '.');
+    if (dot) {
+      *dot = point[0];
+    }
+  }
+  errno = 0;
+  char *endp = nullptr;
+  *value = strtod(str, &endp);
+  return endp == str + len && isfinite(*value);
+}
+
+bool parse_number(const char *data, size_t size, size_t pos, size_t *end,
+                  Number *number) noexcept {
+  size_t cur = pos;
+  bool negative = cur < size && data[cur] == '-';
+  if (negative) {
+    cur += 1;
+  }
+  if (cur >= size || !is_digit(data[cur])) {
+    return false;
+  }
+  size_t digits_begin = cur;
+  uint64_t mantissa = 0;
+  if (data[cur] == '0') {
+    cur += 1;
+  } else {
+    cur = parse_digits(data, size, cur, &mantissa);
+  }
+  size_t digits = cur - digits_begin;
+  // We accumulate the fractional digits into |mantissa| as well, so that
+  // the number is mantissa * 10^(exponent - fraction_digits).
+  size_t fraction_digits = 0;
+  bool is_float = false;
+  if (cur < size && data[cur] == '.') {
+    cur += 1;
+    if (cur >= size || !is_digit(data[cur])) {
+      return false;
+    }
+    size_t fraction_begin = cur;
+    cur = parse_digits(data, size, cur, &mantissa);
+    fraction_digits = cur - fraction_begin;
+    is_float = true;
+  }
+  int64_t exponent = 0;
+  bool saturated = false;
+  if (cur < size && (data[cur] == 'e' || data[cur] == 'E')) {
+    cur += 1;
+    bool negative_exponent = cur < size && data[cur] == '-';
+    if (cur < size && (data[cur] == '+' || data[cur] == '-')) {
+      cur += 1;
+    }
+    if (cur >= size || !is_digit(data[cur])) {
+      return false;
+    }
+    while (cur < size && is_digit(data[cur])) {
+      // Saturate, since a larger exponent overflows or underflows, unless
+      // a long run of digits compensates it, which strtod() handles.
+      if (exponent < 100000) {
+        exponent = exponent * 10 + (data[cur] - '0');
+      } else {
+        saturated = true;
+      }
+      cur += 1;
+    }
+    exponent = negative_exponent ? -exponent : exponent;
+    is_float = true;
+  }
+  *end = cur;
+  // Note: 19 digits always fit into uint64_t, so that |mantissa| has not
+  // overflowed. Longer integers may still fit, so we check them below.
+  if (!is_float && digits <= 19) {
+    if (!negative) {
+      number->type = NumberType::kUnsigned;
+      number->unsigned_value = mantissa;
+      return true;
+    }
+    if (mantissa <= (uint64_t)INT64_MAX + 1) {
+      number->type = NumberType::kInteger;
+      number->integer_value = (int64_t)(0 - mantissa);
+      return true;
+    }
+  } else if (!is_float && digits == 20 && !negative) {
+    char buffer[21];
+    memcpy(buffer, data + digits_begin, 20);
+    buffer[20] = '\0';
+    errno = 0;
+    unsigned long long value = strtoull(buffer, nullptr, 10);
+    if (errno == 0) {
+      number->type = NumberType::kUnsigned;
+      number->unsigned_value = (uint64_t)value;
+      return true;
+    }
+  }
+  number->type = NumberType::kFloat;
+  // Leading zeros do not count towards the 19 digits that always fit into
+  // |mantissa|. They can only precede the first nonzero fractional digit.
+  size_t significant = digits + fraction_digits;
+  for (size_t i = digits_begin; i < cur && significant > 0; ++i) {
+    if (data[i] != '0' && data[i] != '.') {
+      break;
+    }
+    significant -= data[i] == '0';
+  }
+  if (significant <= 19 && !saturated &&
+      decimal_to_double(mantissa, exponent - (int64_t)fraction_digits,
+                        negative, &number->float_value)) {
+    return isfinite(number->float_value);
+  }
+  return parse_double(data + pos, data + cur, &number->float_value);
+}
+
+}  // namespace libjson
+}  // namespace mk
@@ -0,0 +1,306 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef SIMD_PARSE_HPP
+#define SIMD_PARSE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mk {
+namespace libjson {
+
+// Stage 1
+// =======
+//
+// Vectorized pass over the input that records the position of the
+// structural characters outside of strings, of the opening quote of each
+// string, and of the first character of each scalar (numbers, true, false,
+// null). Fails if a string is not terminated. Buffers are reused across
+// calls to build() to avoid allocating in processing loops.
+class StructuralIndex {
+ public:
+  // Inputs larger than this cannot be indexed with 32 bit positions.
+  static constexpr size_t max_size = UINT32_MAX - 1;
+
+  bool build(const char *data, size_t size) noexcept;
+
+  const uint32_t *begin() const noexcept { return indexes_.get(); }
+
+  size_t size() const noexcept { return count_; }
+
+ private:
+  std::unique_ptr<uint32_t[]> indexes_{};
+  size_t capacity_{};
+  size_t count_{};
+};
+
+// Scalars
+// =======
+//
+// Helpers used by stage 2 to parse the content of strings and scalars.
+
+// Parses the string whose opening quote is at |pos|. On success, |*end| is
+// the position of the closing quote. If the string does not contain escape
+// sequences |*escaped| is false and the string content is [pos + 1, *end).
+// Otherwise, |*escaped| is true and the unescaped content is in |*scratch|.
+// Since we validate the content while parsing, we also return the flags
+// that utf8_scan() would return for it in |*flags|.
+bool parse_string(const char *data, size_t size, size_t pos, size_t *end,
+                  bool *escaped, std::string *scratch,
+                  unsigned *flags) noexcept;
+
+enum class NumberType { kUnsigned, kInteger, kFloat };
+
+struct Number {
+  NumberType type = NumberType::kUnsigned;
+  uint64_t unsigned_value = 0;
+  int64_t integer_value = 0;
+  double float_value = 0.0;
+};
+
+// Parses the number starting at |pos|. On success, |*end| is one past the
+// last character of the number. Like nlohmann::json, non-negative integers
+// are unsigned, negative integers are signed, integers that do not fit
+// into 64 bits become floats, and non-finite floats are an error.
+bool parse_number(const char *data, size_t size, size_t pos, size_t *end,
+                  Number *number) noexcept;
+
+// Returns true if |ch| is JSON whitespace, a structural character, or a
+// quote, i.e., any character that may follow a scalar.
+inline bool is_scalar_boundary(char ch) noexcept {
+  switch (ch) {
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+    case '{':
+    case '}':
+    case '[':
+    case ']':
+    case ':':
+    case ',':
+    case '"':
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Returns true if the literal |lit| of length |len| is at |pos|.
+inline bool match_literal(const char *data, size_t size, size_t pos,
+                          const char *lit, size_t len) noexcept {
+  if (size - pos < len) {
+    return false;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    if (data[pos + i] != lit[i]) {
+      return false;
+    }
+  }
+  return pos + len == size || is_scalar_boundary(data[pos + len]);
+}
+
+// Stage 2
+// =======
+//
+// Walks the structural index, checks the grammar, and delivers events to
+// |handler|, which must have the following methods returning bool (false
+// means stop parsing): on_start_object(), on_end_object(),
+// on_start_array(), on_end_array(), on_key(const char *, size_t, unsigned),
+// on_string(const char *, size_t, unsigned), on_unsigned(uint64_t),
+// on_integer(int64_t), on_float(double), on_boolean(bool), on_null(). The
+// unsigned argument of on_key() and on_string() contains the flags
+// returned by parse_string().
+//
+// This is iterative rather than recursive, so deeply nested input cannot
+// exhaust the stack. The range [cur, limit) of the structural index must
+// contain exactly one value.
+
+template <typename Handler>
+bool simd_parse(const char *data, size_t size, const uint32_t *cur,
+                const uint32_t *const limit, Handler *handler) noexcept {
+  enum class State { kValue, kAfterValue, kKey };
+  // Containers we are in: true for objects and false for arrays.
+  std::vector<bool> stack;
+  std::string scratch;
+  State state = State::kValue;
+  for (;;) {
+    switch (state) {
+      case State::kValue: {
+        if (cur >= limit) {
+          return false;
+        }
+        size_t pos = *cur++;
+        switch (data[pos]) {
+          case '{':
+            if (!handler->on_start_object()) {
+              return false;
+            }
+            if (cur < limit && data[*cur] == '}') {
+              cur += 1;
+              if (!handler->on_end_object()) {
+                return false;
+              }
+              state = State::kAfterValue;
+              break;
+            }
+            stack.push_back(true);
+            state = State::kKey;
+            break;
+          case '[':
+            if (!handler->on_start_array()) {
+              return false;
+            }
+            if (cur < limit && data[*cur] == ']') {
+              cur += 1;
+              if (!handler->on_end_array()) {
+                return false;
+              }
+              state = State::kAfterValue;
+              break;
+            }
+            stack.push_back(false);
+            break;
+          case '"': {
+            size_t end = 0;
+            bool escaped = false;
+            unsigned flags = 0;
+            if (!parse_string(data, size, pos, &end, &escaped, &scratch,
+                              &flags)) {
+              return false;
+            }
+            bool ok = escaped ? handler->on_string(scratch.data(),
+                                                   scratch.size(), flags)
+                              : handler->on_string(data + pos + 1,
+                                                   end - pos - 1, flags);
+            if (!ok) {
+              return false;
+            }
+            state = State::kAfterValue;
+            break;
+          }
+          case 't':
+            if (!match_literal(data, size, pos, "true", 4) ||
+                !handler->on_boolean(true)) {
+              return false;
+            }
+            state = State::kAfterValue;
+            break;
+          case 'f':
+            if (!match_literal(data, size, pos, "false", 5) ||
+                !handler->on_boolean(false)) {
+              return false;
+            }
+            state = State::kAfterValue;
+            break;
+          case 'n':
+            if (!match_literal(data, size, pos, "null", 4) ||
+                !handler->on_null()) {
+              return false;
+            }
+            state = State::kAfterValue;
+            break;
+          default: {
+            size_t end = 0;
+            Number number;
+            if (!parse_number(data, size, pos, &end, &number) ||
+                (end < size && !is_scalar_boundary(data[end]))) {
+              return false;
+            }
+            bool ok = false;
+            switch (number.type) {
+              case NumberType::kUnsigned:
+                ok = handler->on_unsigned(number.unsigned_value);
+                break;
+              case NumberType::kInteger:
+                ok = handler->on_integer(number.integer_value);
+                break;
+              case NumberType::kFloat:
+                ok = handler->on_float(number.float_value);
+                break;
+            }
+            if (!ok) {
+              return false;
+            }
+            state = State::kAfterValue;
+            break;
+          }
+        }
+        break;
+      }
+      case State::kKey: {
+        if (cur + 1 >= limit || data[*cur] != '"') {
+          return false;
+        }
+        size_t pos = *cur++;
+        size_t end = 0;
+        bool escaped = false;
+        unsigned flags = 0;
+        if (!parse_string(data, size, pos, &end, &escaped, &scratch,
+                          &flags)) {
+          return false;
+        }
+        if (!(escaped
+                  ? handler->on_key(scratch.data(), scratch.size(), flags)
+                  : handler->on_key(data + pos + 1, end - pos - 1, flags))) {
+          return false;
+        }
+        if (data[*cur++] != ':') {
+          return false;
+        }
+        state = State::kValue;
+        break;
+      }
+      case State::kAfterValue: {
+        if (stack.empty()) {
+          return cur == limit;
+        }
+        if (cur >= limit) {
+          return false;
+        }
+        char ch = data[*cur++];
+        if (ch == ',') {
+          state = stack.back() ? State::kKey : State::kValue;
+        } else if (ch == (stack.back() ? '}' : ']')) {
+          stack.pop_back();
+          if (!(ch == '}' ? handler->on_end_object()
+                          : handler->on_end_array())) {
+            return false;
+          }
+        } else {
+          return false;
+        }
+        break;
+      }
+    }
+  }
+}
+
+template <typename Handler>
+bool simd_parse(const char *data, size_t size, const StructuralIndex &index,
+                Handler *handler) noexcept {
+  return simd_parse(data, size, index.begin(), index.begin() + index.size(),
+                    handler);
+}
+
+// Runs both stages on [data, data + size). Like nlohmann::json, we skip
+// the UTF-8 byte order mark.
+template <typename Handler>
+bool simd_parse(const char *data, size_t size, Handler *handler) noexcept {
+  if (size >= 3 && memcmp(data, "\xef\xbb\xbf", 3) == 0) {
+    data += 3;
+    size -= 3;
+  }
+  StructuralIndex index;
+  return index.build(data, size) && simd_parse(data, size, index, handler);
+}
+
+}  // namespace libjson
+}  // namespace mk
+#endif
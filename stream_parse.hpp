@@ -0,0 +1,336 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef STREAM_PARSE_HPP
+#define STREAM_PARSE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "simd_parse.hpp"
+
+namespace mk {
+namespace libjson {
+
+// ChunkParser
+// ===========
+//
+// Resumable parser for input delivered in chunks. It delivers events to
+// a handler having the same interface required by simd_parse() as soon as
+// each token is complete. The only input we buffer is the token that is
+// split across two chunks, so that memory usage does not depend on the
+// size of the input. Tokens entirely contained in a chunk are parsed in
+// place, without copying them.
+template <typename Handler>
+class ChunkParser {
+ public:
+  explicit ChunkParser(Handler *handler) noexcept : handler_{handler} {}
+
+  // Parses the next chunk. Returns false on error, after which the parser
+  // keeps failing until reset() is called.
+  bool feed(const char *data, size_t size) noexcept {
+    if (failed_) {
+      return false;
+    }
+    // Like nlohmann::json, skip the UTF-8 byte order mark. Since it may
+    // be split across chunks, we collect the first three bytes first.
+    if (!started_) {
+      size_t count = (size < 3 - head_.size()) ? size : 3 - head_.size();
+      head_.append(data, count);
+      data += count;
+      size -= count;
+      if (head_.size() < 3) {
+        return true;
+      }
+      if (!start()) {
+        return fail();
+      }
+    }
+    return consume(data, size) || fail();
+  }
+
+  // Completes parsing. Returns true if the input was a complete document.
+  bool finish() noexcept {
+    if (failed_ || (!started_ && !start())) {
+      return fail();
+    }
+    if (token_ == Token::kScalar) {
+      token_ = Token::kNone;
+      if (!on_scalar(pending_.data(), pending_.size())) {
+        return fail();
+      }
+    }
+    return (token_ == Token::kNone && state_ == State::kDone) || fail();
+  }
+
+  // Prepares the parser for a new document.
+  void reset() noexcept {
+    stack_.clear();
+    pending_.clear();
+    head_.clear();
+    state_ = State::kValue;
+    token_ = Token::kNone;
+    escape_ = false;
+    started_ = false;
+    failed_ = false;
+  }
+
+ private:
+  enum class State { kValue, kValueOrEnd, kKey, kKeyOrEnd, kColon,
+                     kAfterValue, kDone };
+
+  // Kind of token that is split across chunks.
+  enum class Token { kNone, kString, kScalar };
+
+  bool fail() noexcept {
+    failed_ = true;
+    return false;
+  }
+
+  bool start() noexcept {
+    started_ = true;
+    if (head_ == "\xef\xbb\xbf") {
+      return true;
+    }
+    std::string head;
+    std::swap(head, head_);
+    return consume(head.data(), head.size());
+  }
+
+  // Returns the position of the quote closing a string, starting from
+  // |pos| and with |*escape| telling whether the previous character was
+  // an unescaped backslash, or |size| if the string is not terminated.
+  static size_t find_quote(const char *data, size_t size, size_t pos,
+                           bool *escape) noexcept {
+    for (; pos < size; ++pos) {
+      if (*escape) {
+        *escape = false;
+      } else if (data[pos] == '\\') {
+        *escape = true;
+      } else if (data[pos] == '"') {
+        break;
+      }
+    }
+    return pos;
+  }
+
+  // Returns the position of the first character after the scalar.
+  static size_t find_scalar_end(const char *data, size_t size,
+                                size_t pos) noexcept {
+    while (pos < size && !is_scalar_boundary(data[pos])) {
+      pos += 1;
+    }
+    return pos;
+  }
+
+  bool consume(const char *data, size_t size) noexcept {
+    size_t pos = 0;
+    // Complete the token split across the previous and this chunk
+    if (token_ == Token::kString) {
+      size_t end = find_quote(data, size, 0, &escape_);
+      if (end >= size) {
+        pending_.append(data, size);
+        return true;
+      }
+      pending_.append(data, end + 1);
+      token_ = Token::kNone;
+      if (!on_string(pending_.data(), pending_.size(), 0)) {
+        return false;
+      }
+      pos = end + 1;
+    } else if (token_ == Token::kScalar) {
+      size_t end = find_scalar_end(data, size, 0);
+      pending_.append(data, end);
+      if (end >= size) {
+        return true;
+      }
+      token_ = Token::kNone;
+      if (!on_scalar(pending_.data(), pending_.size())) {
+        return false;
+      }
+      pos = end;
+    }
+    while (pos < size) {
+      char ch = data[pos];
+      switch (ch) {
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\r':
+          pos += 1;
+          break;
+        case '{':
+        case '}':
+        case '[':
+        case ']':
+        case ':':
+        case ',':
+          if (!on_structural(ch)) {
+            return false;
+          }
+          pos += 1;
+          break;
+        case '"': {
+          escape_ = false;
+          size_t end = find_quote(data, size, pos + 1, &escape_);
+          if (end >= size) {
+            pending_.assign(data + pos, size - pos);
+            token_ = Token::kString;
+            return true;
+          }
+          if (!on_string(data, end + 1, pos)) {
+            return false;
+          }
+          pos = end + 1;
+          break;
+        }
+        default: {
+          size_t end = find_scalar_end(data, size, pos);
+          if (end >= size) {
+            pending_.assign(data + pos, size - pos);
+            token_ = Token::kScalar;
+            return true;
+          }
+          if (!on_scalar(data + pos, end - pos)) {
+            return false;
+          }
+          pos = end;
+          break;
+        }
+      }
+    }
+    return true;
+  }
+
+  void after_value() noexcept {
+    state_ = stack_.empty() ? State::kDone : State::kAfterValue;
+  }
+
+  bool on_structural(char ch) noexcept {
+    switch (state_) {
+      case State::kValue:
+      case State::kValueOrEnd:
+        if (ch == '{') {
+          stack_.push_back(true);
+          state_ = State::kKeyOrEnd;
+          return handler_->on_start_object();
+        }
+        if (ch == '[') {
+          stack_.push_back(false);
+          state_ = State::kValueOrEnd;
+          return handler_->on_start_array();
+        }
+        if (ch == ']' && state_ == State::kValueOrEnd) {
+          stack_.pop_back();
+          after_value();
+          return handler_->on_end_array();
+        }
+        return false;
+      case State::kKeyOrEnd:
+        if (ch == '}') {
+          stack_.pop_back();
+          after_value();
+          return handler_->on_end_object();
+        }
+        return false;
+      case State::kColon:
+        if (ch == ':') {
+          state_ = State::kValue;
+          return true;
+        }
+        return false;
+      case State::kAfterValue:
+        if (ch == ',') {
+          state_ = stack_.back() ? State::kKey : State::kValue;
+          return true;
+        }
+        if (ch == (stack_.back() ? '}' : ']')) {
+          stack_.pop_back();
+          after_value();
+          return ch == '}' ? handler_->on_end_object()
+                           : handler_->on_end_array();
+        }
+        return false;
+      default:
+        return false;
+    }
+  }
+
+  // Parses the string token whose opening quote is at |pos| and whose
+  // closing quote is the last character of |data|.
+  bool on_string(const char *data, size_t size, size_t pos) noexcept {
+    size_t end = 0;
+    bool escaped = false;
+    unsigned flags = 0;
+    if (!parse_string(data, size, pos, &end, &escaped, &scratch_, &flags)) {
+      return false;
+    }
+    const char *base = escaped ? scratch_.data() : data + pos + 1;
+    size_t count = escaped ? scratch_.size() : end - pos - 1;
+    switch (state_) {
+      case State::kValue:
+      case State::kValueOrEnd:
+        after_value();
+        return handler_->on_string(base, count, flags);
+      case State::kKey:
+      case State::kKeyOrEnd:
+        state_ = State::kColon;
+        return handler_->on_key(base, count, flags);
+      default:
+        return false;
+    }
+  }
+
+  bool on_scalar(const char *data, size_t size) noexcept {
+    if (state_ != State::kValue && state_ != State::kValueOrEnd) {
+      return false;
+    }
+    after_value();
+    switch (data[0]) {
+      case 't':
+        return match_literal(data, size, 0, "true", 4) &&
+               handler_->on_boolean(true);
+      case 'f':
+        return match_literal(data, size, 0, "false", 5) &&
+               handler_->on_boolean(false);
+      case 'n':
+        return match_literal(data, size, 0, "null", 4) &&
+               handler_->on_null();
+      default:
+        break;
+    }
+    size_t end = 0;
+    Number number;
+    if (!parse_number(data, size, 0, &end, &number) || end != size) {
+      return false;
+    }
+    switch (number.type) {
+      case NumberType::kUnsigned:
+        return handler_->on_unsigned(number.unsigned_value);
+      case NumberType::kInteger:
+        return handler_->on_integer(number.integer_value);
+      case NumberType::kFloat:
+        return handler_->on_float(number.float_value);
+    }
+    return false;
+  }
+
+  Handler *handler_;
+  // Containers we are in: true for objects and false for arrays.
+  std::vector<bool> stack_;
+  std::string pending_;
+  std::string scratch_;
+  std::string head_;
+  State state_ = State::kValue;
+  Token token_ = Token::kNone;
+  bool escape_ = false;
+  bool started_ = false;
+  bool failed_ = false;
+};
+
+}  // namespace libjson
+}  // namespace mk
+#endif
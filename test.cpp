@@ -7,12 +7,51 @@
 #include "libjson.hpp"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <type_traits>
+
+#include "arena.hpp"
+#include "base64_encode.hpp"
 #include "catchorg_catch.hpp"
+#include "json_escape.hpp"
 #include "nlohmann_json.hpp"
+#include "number_format.hpp"
+#include "simd_parse.hpp"
+#include "utf8_decode.hpp"
+#include "utf8_validate.hpp"
 
 using namespace mk::libjson;
 
+// Counts the allocations of the current thread, so that we can check that
+// some operations do not allocate. Not inlined, otherwise the compiler warns
+// that we free() memory that was allocated with operator new.
+static thread_local size_t new_allocations = 0;
+
+__attribute__((noinline)) void *operator new(size_t size) {
+  new_allocations += 1;
+  void *ptr = malloc(size > 0 ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc{};
+  }
+  return ptr;
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+// Documents and their strings do not use operator new, so we also count
+// the blocks they allocate.
+static size_t allocations() noexcept {
+  return new_allocations + arena_allocations();
+}
+
 // Scalar setter
 // -------------
 //
@@ -101,12 +140,766 @@ SETTER_GETTER_CHECK("We can set and then get a toplevel string", string,
 SETTER_GETTER_CHECK("We can set and then get a nested string", string,
                     "/x/value", std::string, "antani")
 
+// Lookup
+// ------
+//
+// Make sure that the exception-free lookup follows RFC 6901 and that it
+// fails without modifying the document when the path cannot be resolved.
+
+TEST_CASE("We correctly deal with escaped reference tokens") {
+  Json doc;
+  REQUIRE(doc.set_integer("/a~1b/c~0d", 17));
+  {
+    std::string s;
+    REQUIRE(doc.serialize(&s));
+    REQUIRE(s == R"({"a/b":{"c~d":17}})");
+  }
+  int64_t value = 0;
+  REQUIRE(doc.get_integer("/a~1b/c~0d", &value));
+  REQUIRE(value == 17);
+  REQUIRE(!doc.get_integer("/a~2b/c~0d", &value));
+  REQUIRE(!doc.set_integer("/a~1b/c~", 11));
+  REQUIRE(!doc.set_integer("a~1b", 11));
+}
+
+TEST_CASE("We cannot get values using invalid array indexes") {
+  Json doc;
+  REQUIRE(doc.push_integer("/x", 17));
+  REQUIRE(doc.push_integer("/x", 11));
+  int64_t value = 0;
+  REQUIRE(doc.get_integer("/x/1", &value));
+  REQUIRE(value == 11);
+  REQUIRE(!doc.get_integer("/x/01", &value));
+  REQUIRE(!doc.get_integer("/x/-", &value));
+  REQUIRE(!doc.get_integer("/x/2", &value));
+  REQUIRE(!doc.get_integer("/x/+1", &value));
+  REQUIRE(!doc.get_integer("/x/99999999999999999999999", &value));
+  REQUIRE(!doc.set_integer("/x/01", 11));
+  REQUIRE(doc.set_integer("/x/-", 12));
+  REQUIRE(doc.get_integer("/x/2", &value));
+  REQUIRE(value == 12);
+}
+
+TEST_CASE("We cannot use array indexes too large to extend an array") {
+  Json doc;
+  REQUIRE(doc.push_integer("/x", 17));
+  std::vector<std::string> paths{
+      "/x/18446744073709551615", "/x/18446744073709551616",
+      "/x/99999999999999999999999", "/y/18446744073709551615",
+      "/y/18446744073709551615/z"};
+  for (auto &path : paths) {
+    REQUIRE(!doc.set_integer(path, 7));
+    REQUIRE(!doc.push_integer(path, 7));
+    REQUIRE(!doc.set_integer(Pointer{path}, 7));
+    REQUIRE(!Pointer{path}.valid());
+  }
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"x":[17]})");
+}
+
+TEST_CASE("We cannot get values having the wrong type") {
+  Json doc;
+  REQUIRE(doc.set_string("/x", "foo"));
+  REQUIRE(doc.set_integer("/y", 17));
+  bool b = false;
+  REQUIRE(!doc.get_boolean("/x", &b));
+  double d = 0.0;
+  REQUIRE(!doc.get_float("/x", &d));
+  REQUIRE(doc.get_float("/y", &d));
+  REQUIRE(d == 17.0);
+  std::string s;
+  REQUIRE(!doc.get_string("/y", &s));
+  REQUIRE(!doc.get_string("/x/0", &s));
+  ArrayKeys ak;
+  REQUIRE(!doc.get_array_keys("/x", &ak));
+}
+
+TEST_CASE("We cannot set or push below a scalar") {
+  Json doc;
+  REQUIRE(doc.set_string("/x", "foo"));
+  REQUIRE(!doc.set_integer("/x/y", 17));
+  REQUIRE(!doc.push_integer("/x", 17));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"x":"foo"})");
+}
+
+// Array keys
+// ----------
+
+static_assert(std::is_same<std::iterator_traits<ArrayKeys::Iter>::
+                               iterator_category,
+                           std::random_access_iterator_tag>::value,
+              "ArrayKeys::Iter must be a random access iterator");
+
+TEST_CASE("ArrayKeys iterators support random access") {
+  ArrayKeys ak{"/x", 4};
+  auto begin = ak.begin();
+  auto end = ak.end();
+  REQUIRE(end - begin == 4);
+  REQUIRE(std::distance(begin, end) == 4);
+  REQUIRE(*begin == "/x/0");
+  REQUIRE(begin[3] == "/x/3");
+  REQUIRE(*(begin + 2) == "/x/2");
+  REQUIRE(*(2 + begin) == "/x/2");
+  REQUIRE(*(end - 1) == "/x/3");
+  REQUIRE((end - 1).index() == 3);
+  REQUIRE(begin < end);
+  REQUIRE(end > begin);
+  REQUIRE(begin <= begin);
+  REQUIRE(end >= begin);
+  auto it = begin;
+  REQUIRE(it++ == begin);
+  REQUIRE(it-- == begin + 1);
+  REQUIRE(it == begin);
+  it += 3;
+  REQUIRE(it.index() == 3);
+  it -= 1;
+  REQUIRE(--it == begin + 1);
+  std::vector<std::string> paths(ak.begin(), ak.end());
+  REQUIRE(paths.back() == "/x/3");
+  ArrayKeys root{"/", 1};
+  REQUIRE(*root.begin() == "/0");
+  ArrayKeys empty{"", 1};
+  REQUIRE(*empty.begin() == "0");
+}
+
+TEST_CASE("We can get array elements by index") {
+  Json doc;
+  std::vector<double> values{1.0, 2.5, -3.0};
+  REQUIRE(doc.push_floats("/test_keys/rtts", values.data(), values.size()));
+  REQUIRE(doc.push_string("/strings", "foo"));
+  REQUIRE(doc.push_bytes("/strings", "\xff"));
+  REQUIRE(doc.push_boolean("/strings", true));
+  ArrayKeys ak;
+  REQUIRE(doc.get_array_keys(Pointer{"/test_keys/rtts"}, &ak));
+  {
+    size_t before = allocations();
+    double sum = 0.0;
+    for (auto it = ak.begin(); it != ak.end(); ++it) {
+      double value = 0.0;
+      REQUIRE(doc.get_float(ak, it.index(), &value));
+      sum += value;
+    }
+    size_t after = allocations();
+    REQUIRE(after == before);
+    REQUIRE(sum == 0.5);
+  }
+  int64_t integer = 0;
+  REQUIRE(doc.get_integer(ak, 1, &integer));
+  REQUIRE(integer == 2);
+  double value = 0.0;
+  REQUIRE(!doc.get_float(ak, 3, &value));
+  REQUIRE(!doc.get_float(ak, 0, nullptr));
+  ArrayKeys strings;
+  REQUIRE(doc.get_array_keys("/strings", &strings));
+  std::string s;
+  REQUIRE(doc.get_string(strings, 0, &s));
+  REQUIRE(s == "foo");
+  REQUIRE(doc.get_bytes(strings, 1, &s));
+  REQUIRE(s == "\xff");
+  bool b = false;
+  REQUIRE(doc.get_boolean(strings, 2, &b));
+  REQUIRE(b);
+  REQUIRE(!doc.get_boolean(strings, 0, &b));
+  // After a change, we find the array again using its path.
+  REQUIRE(doc.push_float("/test_keys/rtts", 4.0));
+  REQUIRE(doc.get_float(ak, 3, &value));
+  REQUIRE(value == 4.0);
+  REQUIRE(doc.set_integer("/test_keys/rtts", 17));
+  REQUIRE(!doc.get_float(ak, 0, &value));
+  REQUIRE(doc.parse(R"({"test_keys":{"rtts":[5.0]}})"));
+  REQUIRE(doc.get_float(ak, 0, &value));
+  REQUIRE(value == 5.0);
+  // Keys of another document work using their path.
+  Json other;
+  REQUIRE(other.push_float("/test_keys/rtts", 6.0));
+  REQUIRE(other.get_float(ak, 0, &value));
+  REQUIRE(value == 6.0);
+}
+
+TEST_CASE("Array keys do not trust a new document at the same address") {
+  // A new Json usually reuses the memory of the one we just destroyed.
+  for (int i = 0; i < 16; ++i) {
+    ArrayKeys ak;
+    {
+      Json doc;
+      REQUIRE(doc.push_float("/rtts", 1.0));
+      REQUIRE(doc.set_string("/x", "foo"));
+      REQUIRE(doc.get_array_keys("/rtts", &ak));
+    }
+    // Same number of changes, but the array is somewhere else.
+    Json doc;
+    REQUIRE(doc.set_string("/x", "bar"));
+    double value = 0.0;
+    REQUIRE(!doc.get_float(ak, 0, &value));
+    REQUIRE(doc.push_float("/rtts", 2.0));
+    REQUIRE(doc.get_float(ak, 0, &value));
+    REQUIRE(value == 2.0);
+  }
+}
+
+// Batch
+// -----
+//
+// Make sure that batch operations behave like a sequence of push and get.
+
+TEST_CASE("We can push and get arrays in batch") {
+  std::vector<double> floats{1.5, -0.25, 1e300, 17.0};
+  std::vector<int64_t> integers{0, -1, INT64_MIN, INT64_MAX};
+  std::vector<std::string> strings{"foo", "", "\xc3\x28"};
+  Json doc;
+  REQUIRE(doc.push_float("/floats", 0.5));
+  REQUIRE(doc.push_floats("/floats", floats.data(), floats.size()));
+  REQUIRE(doc.push_integers(Pointer{"/integers"}, integers.data(),
+                            integers.size()));
+  REQUIRE(doc.push_strings("/strings", strings));
+  REQUIRE(doc.push_floats("/empty", nullptr, 0));
+  Json control;
+  REQUIRE(control.push_float("/floats", 0.5));
+  for (double value : floats) {
+    REQUIRE(control.push_float("/floats", value));
+  }
+  for (int64_t value : integers) {
+    REQUIRE(control.push_integer("/integers", value));
+  }
+  for (auto &value : strings) {
+    REQUIRE(control.push_string("/strings", value));
+  }
+  REQUIRE(control.set_string("/empty", "x"));
+  std::string s, t;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(control.serialize(&t));
+  REQUIRE(s == t.replace(t.find("\"x\""), 3, "[]"));
+  std::vector<double> f;
+  REQUIRE(doc.get_floats("/floats", &f));
+  floats.insert(floats.begin(), 0.5);
+  REQUIRE(f == floats);
+  REQUIRE(doc.get_floats("/integers", &f));
+  REQUIRE(f.size() == integers.size());
+  REQUIRE(f[1] == -1.0);
+  std::vector<int64_t> i;
+  REQUIRE(doc.get_integers(Pointer{"/integers"}, &i));
+  REQUIRE(i == integers);
+  std::vector<std::string> v;
+  REQUIRE(doc.get_strings("/strings", &v));
+  REQUIRE(v.size() == 3);
+  REQUIRE(v[0] == "foo");
+  REQUIRE(v[1] == "");
+  REQUIRE(v[2] == "wyg=");  // Invalid UTF-8 is stored as base64
+  REQUIRE(doc.get_floats("/empty", &f));
+  REQUIRE(f.empty());
+}
+
+TEST_CASE("We cannot push or get arrays in batch with the wrong type") {
+  Json doc;
+  REQUIRE(doc.set_string("/x", "foo"));
+  REQUIRE(doc.push_string("/y", "foo"));
+  double value = 1.0;
+  REQUIRE(!doc.push_floats("/x", &value, 1));
+  REQUIRE(!doc.push_floats("/z", nullptr, 1));
+  std::vector<double> f;
+  REQUIRE(!doc.get_floats("/x", &f));
+  REQUIRE(!doc.get_floats("/y", &f));
+  REQUIRE(!doc.get_floats("/z", &f));
+  REQUIRE(!doc.get_floats("/y", nullptr));
+  std::vector<std::string> v;
+  REQUIRE(doc.get_strings("/y", &v));
+  REQUIRE(v == std::vector<std::string>{"foo"});
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"x":"foo","y":["foo"]})");
+}
+
+// Cursor
+// ------
+//
+// Make sure that cursors behave like absolute paths, and that they find
+// their node again after the document changes.
+
+TEST_CASE("We can get, set and push relative to a cursor") {
+  Json doc;
+  Json::Cursor response;
+  REQUIRE(doc.get_cursor("/test_keys/requests/0/response", &response));
+  REQUIRE(response.path() == "/test_keys/requests/0/response");
+  REQUIRE(response.set_integer("/code", 200));
+  REQUIRE(response.set_string("/body", "foo"));
+  REQUIRE(response.set_bytes("/raw", "\xff"));
+  REQUIRE(response.set_boolean("/ok", true));
+  REQUIRE(response.push_float("/rtts", 0.5));
+  REQUIRE(response.push_integer("/rtts", 1));
+  Json::Cursor headers;
+  REQUIRE(response.get_cursor("/headers", &headers));
+  REQUIRE(headers.path() == "/test_keys/requests/0/response/headers");
+  REQUIRE(headers.set_string("/Server", "nginx"));
+  REQUIRE(headers.push_string("/Via", "a"));
+  REQUIRE(headers.push_bytes("/Via", "\xfe"));
+  REQUIRE(headers.push_boolean("/Via", false));
+  REQUIRE(response.set_float("/time", 1.5));
+  Json control;
+  std::string prefix = "/test_keys/requests/0/response";
+  REQUIRE(control.set_integer(prefix + "/code", 200));
+  REQUIRE(control.set_string(prefix + "/body", "foo"));
+  REQUIRE(control.set_bytes(prefix + "/raw", "\xff"));
+  REQUIRE(control.set_boolean(prefix + "/ok", true));
+  REQUIRE(control.push_float(prefix + "/rtts", 0.5));
+  REQUIRE(control.push_integer(prefix + "/rtts", 1));
+  REQUIRE(control.set_string(prefix + "/headers/Server", "nginx"));
+  REQUIRE(control.push_string(prefix + "/headers/Via", "a"));
+  REQUIRE(control.push_bytes(prefix + "/headers/Via", "\xfe"));
+  REQUIRE(control.push_boolean(prefix + "/headers/Via", false));
+  REQUIRE(control.set_float(prefix + "/time", 1.5));
+  std::string s, t;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(control.serialize(&t));
+  REQUIRE(s == t);
+  int64_t code = 0;
+  REQUIRE(response.get_integer("/code", &code));
+  REQUIRE(code == 200);
+  std::string value;
+  REQUIRE(response.get_string("/body", &value));
+  REQUIRE(value == "foo");
+  REQUIRE(response.get_bytes("/raw", &value));
+  REQUIRE(value == "\xff");
+  REQUIRE(headers.get_string("/Server", &value));
+  REQUIRE(value == "nginx");
+  bool ok = false;
+  REQUIRE(response.get_boolean("/ok", &ok));
+  REQUIRE(ok);
+  double time = 0.0;
+  REQUIRE(response.get_float("/time", &time));
+  REQUIRE(time == 1.5);
+  REQUIRE(response.set_integer("", 17));
+  REQUIRE(doc.get_integer(prefix, &code));
+  REQUIRE(code == 17);
+}
+
+TEST_CASE("A cursor finds its node again after the document changes") {
+  Json doc;
+  Json::Cursor first, second;
+  REQUIRE(doc.get_cursor("/requests/0", &first));
+  REQUIRE(doc.get_cursor(Pointer{"/requests/1"}, &second));
+  REQUIRE(first.set_integer("/x", 1));
+  // Pushing into the parent array may move the node of the first cursor.
+  for (int64_t i = 2; i < 64; ++i) {
+    REQUIRE(doc.push_integer("/requests", i));
+  }
+  REQUIRE(first.set_integer("/y", 2));
+  REQUIRE(second.set_integer("/x", 3));
+  REQUIRE(first.set_integer("/z", 4));
+  int64_t value = 0;
+  REQUIRE(doc.get_integer("/requests/0/y", &value));
+  REQUIRE(value == 2);
+  REQUIRE(doc.get_integer("/requests/0/z", &value));
+  REQUIRE(value == 4);
+  REQUIRE(doc.get_integer("/requests/1/x", &value));
+  REQUIRE(value == 3);
+  // A parse replaces the document.
+  REQUIRE(doc.parse(R"({"requests":[{"x":5}]})"));
+  REQUIRE(first.get_integer("/x", &value));
+  REQUIRE(value == 5);
+  REQUIRE(!second.get_integer("/x", &value));
+  // A reset clears it, hence we create the node again when setting.
+  doc.reset();
+  REQUIRE(!first.get_integer("/x", &value));
+  REQUIRE(first.set_integer("/x", 6));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"requests":[{"x":6}]})");
+  // A cursor fails when its node cannot be an object anymore.
+  REQUIRE(doc.set_integer("/requests/0", 7));
+  REQUIRE(!first.set_integer("/x", 8));
+  REQUIRE(!first.push_integer("/y", 8));
+  REQUIRE(first.set_integer("", 8));
+  REQUIRE(doc.get_integer("/requests/0", &value));
+  REQUIRE(value == 8);
+}
+
+TEST_CASE("A cursor appending to an array keeps its element") {
+  Json doc;
+  Json::Cursor request, response;
+  REQUIRE(doc.get_cursor("/requests/-", &request));
+  REQUIRE(request.path() == "/requests/0");
+  REQUIRE(request.set_string("/url", "http://a"));
+  // Change the document, so that the cursor finds its node again.
+  REQUIRE(doc.set_integer("/elapsed", 1));
+  REQUIRE(request.set_integer("/status", 200));
+  REQUIRE(request.get_cursor("/headers/-", &response));
+  REQUIRE(response.path() == "/requests/0/headers/0");
+  REQUIRE(doc.push_string("/requests/0/headers", "foo"));
+  REQUIRE(response.set_string("/name", "Server"));
+  REQUIRE(doc.get_cursor(Pointer{"/requests/-/a~1b"}, &response));
+  REQUIRE(response.path() == "/requests/1/a~1b");
+  REQUIRE(doc.set_integer("/elapsed", 2));
+  REQUIRE(response.set_integer("", 3));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"elapsed":2,"requests":[{"headers":[{"name":"Server"},)"
+               R"("foo"],"status":200,"url":"http://a"},{"a/b":3}]})");
+}
+
+TEST_CASE("We cannot use an invalid cursor or path") {
+  Json::Cursor cursor;
+  int64_t value = 0;
+  REQUIRE(!cursor.set_integer("/x", 1));
+  REQUIRE(!cursor.get_integer("/x", &value));
+  Json doc;
+  REQUIRE(!doc.get_cursor("/x", nullptr));
+  REQUIRE(!doc.get_cursor("x", &cursor));
+  REQUIRE(doc.get_cursor("/x", &cursor));
+  REQUIRE(!cursor.set_integer("y", 1));
+  REQUIRE(!cursor.get_cursor("y", &cursor));
+  REQUIRE(!cursor.get_integer("/y", nullptr));
+  REQUIRE(cursor.set_string("/y", "foo"));
+  REQUIRE(!cursor.push_integer("/y", 1));
+  REQUIRE(!cursor.get_integer("/y", &value));
+}
+
+TEST_CASE("We can get array keys from a cursor") {
+  Json doc;
+  Json::Cursor cursor;
+  REQUIRE(doc.get_cursor("/test_keys", &cursor));
+  std::vector<double> values{1.0, 2.0, 3.0};
+  for (double value : values) {
+    REQUIRE(cursor.push_float("/rtts", value));
+  }
+  ArrayKeys ak;
+  REQUIRE(cursor.get_array_keys("/rtts", &ak));
+  REQUIRE(ak.size() == 3);
+  auto first = ak.begin();
+  REQUIRE(first[1] == "/test_keys/rtts/1");
+  double value = 0.0;
+  REQUIRE(doc.get_float(ak, 2, &value));
+  REQUIRE(value == 3.0);
+  REQUIRE(doc.get_float(*first, &value));
+  REQUIRE(value == 1.0);
+  REQUIRE(!cursor.get_array_keys("/missing", &ak));
+}
+
+// Pointer
+// -------
+//
+// Make sure that precompiled pointers behave like string paths.
+
+TEST_CASE("We can use precompiled pointers") {
+  Pointer engine_name{"/annotations/engine_name"};
+  Pointer rtts{"/test_keys/rtts"};
+  Pointer escaped{"/a~1b/c~0d"};
+  REQUIRE(engine_name.valid());
+  REQUIRE(engine_name.path() == "/annotations/engine_name");
+  Json doc;
+  REQUIRE(doc.set_string(engine_name, "libmeasurement_kit"));
+  REQUIRE(doc.push_float(rtts, 1.0));
+  REQUIRE(doc.push_float(rtts, 2.0));
+  REQUIRE(doc.set_boolean(escaped, true));
+  {
+    std::string s;
+    REQUIRE(doc.get_string("/annotations/engine_name", &s));
+    REQUIRE(s == "libmeasurement_kit");
+    s.clear();
+    REQUIRE(doc.get_string(engine_name, &s));
+    REQUIRE(s == "libmeasurement_kit");
+  }
+  {
+    ArrayKeys ak;
+    REQUIRE(doc.get_array_keys(rtts, &ak));
+    REQUIRE(ak.size() == 2);
+    double value = 0.0;
+    REQUIRE(doc.get_float(Pointer{"/test_keys/rtts/1"}, &value));
+    REQUIRE(value == 2.0);
+    REQUIRE(!doc.get_float(Pointer{"/test_keys/rtts/01"}, &value));
+  }
+  {
+    bool value = false;
+    REQUIRE(doc.get_boolean("/a~1b/c~0d", &value));
+    REQUIRE(value == true);
+  }
+}
+
+TEST_CASE("We cannot use invalid precompiled pointers") {
+  Pointer invalid{"/x/~2"};
+  REQUIRE(!invalid.valid());
+  Json doc;
+  REQUIRE(!doc.set_integer(invalid, 17));
+  REQUIRE(!doc.push_integer(invalid, 17));
+  int64_t value = 0;
+  REQUIRE(!doc.get_integer(invalid, &value));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == "null");
+}
+
+// Pointer set
+// -----------
+//
+// Make sure that reading a set of pointers at once agrees with reading
+// each of them using the corresponding getter.
+
+TEST_CASE("We can get the values of a pointer set") {
+  Json doc;
+  REQUIRE(doc.parse(R"({
+    "annotations": {"engine_name": "libmeasurement_kit", "platform": "linux"},
+    "test_keys": {
+      "requests": [{"response": {"code": 200, "body": "/w=="}},
+                   {"response": {"code": 301, "ok": true}}],
+      "0": 1.5
+    }
+  })"));
+  PointerSet set;
+  std::vector<std::pair<std::string, ValueType>> pointers{
+      {"/annotations/engine_name", ValueType::kString},
+      {"/annotations/platform", ValueType::kString},
+      {"/annotations/missing", ValueType::kString},
+      {"/test_keys/requests/0/response/code", ValueType::kInteger},
+      {"/test_keys/requests/0/response/code", ValueType::kFloat},
+      {"/test_keys/requests/0/response/body", ValueType::kBytes},
+      {"/test_keys/requests/0/response/body", ValueType::kString},
+      {"/test_keys/requests/1/response/code", ValueType::kString},
+      {"/test_keys/requests/1/response/ok", ValueType::kBoolean},
+      {"/test_keys/requests/2/response/code", ValueType::kInteger},
+      {"/test_keys/requests/x", ValueType::kInteger},
+      {"/test_keys/0", ValueType::kFloat},
+      {"/test_keys/0/1", ValueType::kFloat},
+      {"", ValueType::kBoolean},
+  };
+  for (size_t i = 0; i < pointers.size(); ++i) {
+    REQUIRE(set.add(pointers[i].first, pointers[i].second) == i);
+  }
+  REQUIRE(set.valid());
+  REQUIRE(set.size() == pointers.size());
+  std::vector<PointerValue> values;
+  REQUIRE(doc.get_values(set, &values));
+  REQUIRE(values.size() == pointers.size());
+  for (size_t i = 0; i < pointers.size(); ++i) {
+    const std::string &path = pointers[i].first;
+    const PointerValue &value = values[i];
+    switch (pointers[i].second) {
+      case ValueType::kBoolean: {
+        bool expect = false;
+        REQUIRE(value.found == doc.get_boolean(path, &expect));
+        REQUIRE((!value.found || value.boolean_value == expect));
+        break;
+      }
+      case ValueType::kFloat: {
+        double expect = 0.0;
+        REQUIRE(value.found == doc.get_float(path, &expect));
+        REQUIRE((!value.found || value.float_value == expect));
+        break;
+      }
+      case ValueType::kInteger: {
+        int64_t expect = 0;
+        REQUIRE(value.found == doc.get_integer(path, &expect));
+        REQUIRE((!value.found || value.integer_value == expect));
+        break;
+      }
+      case ValueType::kString: {
+        std::string expect;
+        REQUIRE(value.found == doc.get_string(path, &expect));
+        REQUIRE((!value.found || value.string_value == expect));
+        break;
+      }
+      case ValueType::kBytes: {
+        std::string expect;
+        REQUIRE(value.found == doc.get_bytes(path, &expect));
+        REQUIRE((!value.found || value.string_value == expect));
+        break;
+      }
+    }
+  }
+  REQUIRE(values[0].string_value == "libmeasurement_kit");
+  REQUIRE(!values[2].found);
+  REQUIRE(values[3].integer_value == 200);
+  REQUIRE(values[5].string_value == "\xff");
+  REQUIRE(!values[7].found);
+  REQUIRE(values[8].boolean_value);
+  REQUIRE(values[11].float_value == 1.5);
+  // Values found by a previous call are not found in another document.
+  Json other;
+  REQUIRE(other.get_values(set, &values));
+  REQUIRE(std::none_of(values.begin(), values.end(),
+                       [](const PointerValue &value) { return value.found; }));
+}
+
+TEST_CASE("Getting the values of a pointer set does not allocate") {
+  Json doc;
+  REQUIRE(doc.set_string("/annotations/engine_name", "libmeasurement_kit"));
+  REQUIRE(doc.set_integer("/test_keys/requests/0/response/code", 200));
+  PointerSet set;
+  set.add(Pointer{"/annotations/engine_name"}, ValueType::kString);
+  set.add(Pointer{"/test_keys/requests/0/response/code"}, ValueType::kInteger);
+  set.add(Pointer{"/test_keys/requests/1/response/code"}, ValueType::kInteger);
+  std::vector<PointerValue> values;
+  REQUIRE(doc.get_values(set, &values));
+  size_t before = allocations();
+  for (size_t i = 0; i < 16; ++i) {
+    REQUIRE(doc.get_values(set, &values));
+  }
+  size_t after = allocations();
+  REQUIRE(after == before);
+  REQUIRE(values[0].string_value == "libmeasurement_kit");
+  REQUIRE(values[1].integer_value == 200);
+  REQUIRE(!values[2].found);
+}
+
+TEST_CASE("We cannot get the values of an invalid pointer set") {
+  Json doc;
+  PointerSet set;
+  REQUIRE(set.add("/x", ValueType::kInteger) == 0);
+  REQUIRE(!doc.get_values(set, nullptr));
+  REQUIRE(set.add("/x/~2", ValueType::kInteger) == 1);
+  REQUIRE(!set.valid());
+  std::vector<PointerValue> values;
+  REQUIRE(!doc.get_values(set, &values));
+}
+
+// Make sure that building a document from a pointer set gives the same
+// document as setting the values one at a time.
+
+TEST_CASE("We can build a document from a pointer set") {
+  PointerSet set;
+  std::vector<PointerValue> values;
+  auto add = [&](std::string path, ValueType type) -> PointerValue & {
+    REQUIRE(set.add(path, type) == values.size());
+    values.emplace_back();
+    values.back().found = true;
+    return values.back();
+  };
+  add("/annotations/platform", ValueType::kString).string_value = "linux";
+  add("/annotations/engine_name", ValueType::kString).string_value = "mk";
+  add("/annotations/a\"b", ValueType::kString).string_value = "\xc3\x28";
+  add("/test_keys/requests/1/response/code", ValueType::kInteger)
+      .integer_value = 301;
+  add("/test_keys/requests/0/response/code", ValueType::kInteger)
+      .integer_value = 200;
+  add("/test_keys/requests/0/response/body", ValueType::kBytes)
+      .string_value = std::string("\xff\x00", 2);
+  add("/test_keys/requests/0/response/ok", ValueType::kBoolean)
+      .boolean_value = true;
+  add("/test_keys/rtts/2", ValueType::kFloat).float_value = 0.5;
+  add("/test_keys/rtts/0", ValueType::kFloat).float_value = 1.5;
+  add("/test_keys/rtts/3", ValueType::kFloat).found = false;
+  add("/test_keys/missing", ValueType::kFloat).found = false;
+  add("/test_keys/0", ValueType::kInteger).integer_value = 0;
+  add("/test_runtime", ValueType::kFloat).float_value = 1.25;
+  add("/test_runtime", ValueType::kInteger).integer_value = 2;
+  Json doc;
+  REQUIRE(doc.build(set, values));
+  Json control;
+  REQUIRE(control.set_string("/annotations/platform", "linux"));
+  REQUIRE(control.set_string("/annotations/engine_name", "mk"));
+  REQUIRE(control.set_string("/annotations/a\"b", "\xc3\x28"));
+  REQUIRE(control.set_integer("/test_keys/requests/1/response/code", 301));
+  REQUIRE(control.set_integer("/test_keys/requests/0/response/code", 200));
+  REQUIRE(control.set_bytes("/test_keys/requests/0/response/body",
+                            std::string("\xff\x00", 2)));
+  REQUIRE(control.set_boolean("/test_keys/requests/0/response/ok", true));
+  REQUIRE(control.set_float("/test_keys/rtts/2", 0.5));
+  REQUIRE(control.set_float("/test_keys/rtts/0", 1.5));
+  REQUIRE(control.set_integer("/test_keys/0", 0));
+  REQUIRE(control.set_float("/test_runtime", 1.25));
+  REQUIRE(control.set_integer("/test_runtime", 2));
+  std::string s, t;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(control.serialize(&t));
+  REQUIRE(s == t);
+  // Reading the values back gives what we have set.
+  std::vector<PointerValue> read;
+  REQUIRE(doc.get_values(set, &read));
+  REQUIRE(read[2].string_value == "wyg=");
+  REQUIRE(read[4].integer_value == 200);
+  REQUIRE(read[5].string_value == std::string("\xff\x00", 2));
+  REQUIRE(read[8].float_value == 1.5);
+  REQUIRE(!read[9].found);
+  REQUIRE(read[13].integer_value == 2);
+  // The same works with an arena, also when we reuse it.
+  Json arena_doc{Allocation::kArena};
+  for (size_t i = 0; i < 3; ++i) {
+    arena_doc.reset();
+    REQUIRE(arena_doc.build(set, values));
+    REQUIRE(arena_doc.serialize(&s));
+    REQUIRE(s == t);
+  }
+}
+
+TEST_CASE("We cannot build a document from inconsistent values") {
+  Json doc;
+  REQUIRE(doc.set_integer("/x", 17));
+  PointerSet set;
+  set.add("/a", ValueType::kInteger);
+  set.add("/a/b", ValueType::kInteger);
+  std::vector<PointerValue> values(1);
+  values[0].found = true;
+  REQUIRE(!doc.build(set, values));
+  values.resize(2);
+  values[1].found = true;
+  REQUIRE(!doc.build(set, values));
+  values[0].found = false;
+  REQUIRE(doc.build(set, values));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"a":{"b":0}})");
+  set.add("/x/~2", ValueType::kInteger);
+  values.resize(3);
+  REQUIRE(!doc.build(set, values));
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"a":{"b":0}})");
+}
+
+TEST_CASE("We build objects for containers not only having indexes") {
+  PointerSet set;
+  set.add("/mixed/1", ValueType::kInteger);
+  set.add("/mixed/x", ValueType::kInteger);
+  set.add("/append/-", ValueType::kInteger);
+  set.add("/append/-", ValueType::kInteger);
+  set.add("/append/0", ValueType::kInteger);
+  set.add("/indexes/1", ValueType::kInteger);
+  set.add("/indexes/01", ValueType::kInteger);
+  std::vector<PointerValue> values(set.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    values[i].found = true;
+    values[i].integer_value = (int64_t)i;
+  }
+  Json doc;
+  REQUIRE(doc.build(set, values));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"append":{"-":3,"0":4},"indexes":{"01":6,"1":5},)"
+               R"("mixed":{"1":0,"x":1}})");
+  // Without the names, the same containers become arrays.
+  values[1].found = false;
+  values[2].found = false;
+  values[3].found = false;
+  values[6].found = false;
+  REQUIRE(doc.build(set, values));
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"append":[4],"indexes":[null,5],"mixed":[null,0]})");
+}
+
+TEST_CASE("We can build an empty document from a pointer set") {
+  Json doc;
+  REQUIRE(doc.set_integer("/x", 17));
+  PointerSet set;
+  std::vector<PointerValue> values;
+  REQUIRE(doc.build(set, values));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == "null");
+  set.add("", ValueType::kString);
+  values.resize(1);
+  values[0].found = true;
+  values[0].string_value = "foo";
+  REQUIRE(doc.build(set, values));
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"("foo")");
+}
+
 // Parse
 // -----
 //
 // Make sure that we can parse a JSON and that we can access its fields.
 
-TEST_CASE("We can parse and process a JSON") {
+static void check_parse_and_process(ParseBackend backend) {
   Json doc;
   {
     std::string input = R"abcxyz(
@@ -124,7 +917,7 @@ TEST_CASE("We can parse and process a JSON") {
         "elapsed": 1.14
       }
     )abcxyz";
-    REQUIRE(doc.parse(std::move(input)));
+    REQUIRE(doc.parse(std::move(input), backend));
   }
   {
     std::string s;
@@ -167,6 +960,540 @@ TEST_CASE("We can parse and process a JSON") {
   }
 }
 
+TEST_CASE("We can parse and process a JSON") {
+  check_parse_and_process(ParseBackend::kDefault);
+}
+
+TEST_CASE("We can parse and process a JSON with the SIMD backend") {
+  check_parse_and_process(ParseBackend::kSimd);
+}
+
+TEST_CASE("We can parse a JSON from a borrowed buffer") {
+  const char input[] = R"({"name": "Ndt", "inputs": [17]})";
+  Json doc;
+  REQUIRE(doc.parse(input, sizeof(input) - 1));
+  std::string s;
+  REQUIRE(doc.get_string("/name", &s));
+  REQUIRE(s == "Ndt");
+  int64_t value = 0;
+  REQUIRE(doc.get_integer("/inputs/0", &value));
+  REQUIRE(value == 17);
+}
+
+TEST_CASE("A failed parse does not modify the document") {
+  Json doc;
+  REQUIRE(doc.set_integer("/x", 17));
+  REQUIRE(!doc.parse(R"({"x": )"));
+  REQUIRE(!doc.parse(nullptr, 0));
+  REQUIRE(!doc.parse(""));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"x":17})");
+}
+
+TEST_CASE("We can parse a JSON from a file") {
+  const char *path = "test_parse_file.json";
+  {
+    FILE *filep = fopen(path, "wb");
+    REQUIRE(filep != nullptr);
+    REQUIRE(fputs(R"({"annotations": {"platform": "linux"}})", filep) >= 0);
+    REQUIRE(fclose(filep) == 0);
+  }
+  Json doc;
+  REQUIRE(doc.parse_file(path));
+  std::string s;
+  REQUIRE(doc.get_string("/annotations/platform", &s));
+  REQUIRE(s == "linux");
+  REQUIRE(remove(path) == 0);
+  REQUIRE(!doc.parse_file(path));
+}
+
+// Parse backends
+// --------------
+//
+// Make sure that the SIMD backend and the stream parser accept and reject
+// the same inputs as the default backend, and that they produce the same
+// document regardless of how the input is split into chunks.
+
+static std::string printable(const std::string &input) {
+  std::string output;
+  for (char ch : input) {
+    if (ch >= 0x20 && ch < 0x7f) {
+      output += ch;
+    } else {
+      char buffer[8];
+      snprintf(buffer, sizeof(buffer), "\\x%02x", (uint8_t)ch);
+      output += buffer;
+    }
+  }
+  return output;
+}
+
+// Parses |input| feeding a StreamParser with chunks of |chunk| bytes.
+static bool parse_in_chunks(const std::string &input, size_t chunk,
+                            Json *doc) {
+  StreamParser parser;
+  for (size_t pos = 0; pos < input.size(); pos += chunk) {
+    (void)parser.feed(input.data() + pos, std::min(chunk, input.size() - pos));
+  }
+  return parser.finish(doc);
+}
+
+static void check_same_parse(const std::string &input) {
+  Json reference;
+  bool reference_ok = reference.parse(input, ParseBackend::kDefault);
+  std::string expected;
+  REQUIRE(reference.serialize(&expected));
+  INFO("input: " << printable(input));
+  auto check = [&](Json &doc, bool ok) {
+    REQUIRE(reference_ok == ok);
+    if (reference_ok) {
+      std::string got;
+      REQUIRE(doc.serialize(&got));
+      REQUIRE(expected == got);
+    }
+  };
+  {
+    Json doc;
+    check(doc, doc.parse(input, ParseBackend::kSimd));
+  }
+  for (size_t chunk : {(size_t)1, (size_t)2, (size_t)7, input.size() + 1}) {
+    INFO("chunk: " << chunk);
+    Json doc;
+    check(doc, parse_in_chunks(input, chunk, &doc));
+  }
+}
+
+TEST_CASE("The SIMD backend agrees with the default backend") {
+  const char *inputs[] = {
+      "", " ", "{", "}", "[", "]", "[]", "{}", " [ ] ", "[[[]]]", "[1,]",
+      "[,1]", "{,}", "{\"a\"}", "{\"a\":}", "{\"a\":1,}", "{\"a\" 1}",
+      "{1:2}", "[1 2]", "[1:2]", "{\"a\":1 \"b\":2}", "\"a\"\"b\"",
+      "\"a\" 1", "1 \"a\"", "true", "false", "null", "tru", "truex",
+      "nulll", "[true,false,null]", "[truefalse]", "[\"a\"true]",
+      "[true\"a\"]", "0", "-0", "-0.0", "01", "-01", "1.", ".1", "1.e5",
+      "1e", "1e+", "1e-5", "1E+5", "+1", "-", "--1", "1.5e308", "1e400",
+      "-1e400", "123456789012345678", "18446744073709551615",
+      "18446744073709551616", "-9223372036854775808",
+      "-9223372036854775809", "99999999999999999999999",
+      "0.1234567890123456789", "[1.14, 17, -17, 1e2]", "\"abc",
+      "\"\\\"\"", "\"\\\\\"", "\"\\\\\\\"\"", "\"\\/\\b\\f\\n\\r\\t\"",
+      "\"\\x\"", "\"\\u\"", "\"\\u12\"", "\"\\u00e8\"", "\"\\u20AC\"",
+      "\"\\ud83d\\ude00\"", "\"\\ud83d\"", "\"\\ude00\"", "\"\\ud83d\\u0041\"",
+      "\"\\u0000\"", "\"\t\"", "\"\x01\"", "\"\xc3\xa8\"", "\"\xc3\"",
+      "\"\xe2\x82\xac\"", "\"\xf0\x9f\x98\x80\"", "\"\xed\xa0\x80\"",
+      "\"\xc0\xaf\"", "\"\xff\"", "\xef\xbb\xbf[1]", "[\x01]", "[1]\x01",
+      "{\"a\":1,\"a\":2}", "{\"a\":{\"b\":1},\"a\":[2]}",
+      "{\"a\":[{\"x\":1}],\"a\":{\"y\":[2,3]},\"b\":4}",
+      "{\"a\\u0062\":\"c\\nd\"}", "\\\"", "[\\]", "\r\n\t[1]\r\n\t",
+      "[1]]", "[1]}", "{\"a\":1}}", "[[1],[2,[3,[4]]]]",
+  };
+  for (const char *input : inputs) {
+    check_same_parse(input);
+  }
+}
+
+TEST_CASE("The SIMD backend handles escapes across block boundaries") {
+  for (size_t prefix = 0; prefix < 140; ++prefix) {
+    for (size_t backslashes = 0; backslashes < 6; ++backslashes) {
+      std::string input = "[\"" + std::string(prefix, 'x') +
+                          std::string(backslashes, '\\') + "\",\"y\", 1]";
+      check_same_parse(input);
+    }
+  }
+  std::string deep = std::string(1000, '[') + std::string(1000, ']');
+  check_same_parse(deep);
+}
+
+TEST_CASE("The SIMD backend agrees with the default backend on mutations") {
+  const std::string base = R"({"annotations": {"engine_name":
+    "libmeasurement_kit", "platform": "macos"}, "inputs": ["www.kernel.org",
+    "www.x.org"], "name": "Ndt", "version_major": 17, "elapsed": 1.14,
+    "test_keys": {"body": "a \"quoted\" \\ body\n\u00e8", "ok": true,
+    "failure": null, "rtts": [0.1, -2, 3e-2, 18446744073709551615]}})";
+  const char replacements[] = "{}[]:,\"\\ ntfe-+.0189\x01\xc3\xa8\xff";
+  uint32_t state = 17;
+  auto random = [&state]() {
+    state = state * 1103515245 + 12345;
+    return (size_t)(state >> 16);
+  };
+  for (size_t i = 0; i < 3000; ++i) {
+    std::string input = base;
+    for (size_t count = 1 + random() % 3; count > 0; --count) {
+      input[random() % input.size()] =
+          replacements[random() % (sizeof(replacements) - 1)];
+    }
+    check_same_parse(input);
+  }
+}
+
+TEST_CASE("The stream parser can be reused after finish()") {
+  StreamParser parser;
+  Json doc;
+  REQUIRE(parser.feed("{\"x\": tr"));
+  REQUIRE(!parser.feed("ux}"));
+  REQUIRE(!parser.feed("[]"));
+  REQUIRE(!parser.finish(&doc));
+  REQUIRE(parser.feed("{\"x\": [tr"));
+  REQUIRE(parser.feed("ue, 1"));
+  REQUIRE(!parser.finish(&doc));  // Incomplete
+  REQUIRE(parser.feed("{\"x\": [tr"));
+  REQUIRE(parser.feed("ue, 1"));
+  REQUIRE(parser.feed("7]}"));
+  REQUIRE(parser.finish(&doc));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"x":[true,17]})");
+}
+
+// Projection
+// ----------
+//
+// Make sure that a projection parse builds the same subtrees that we would
+// find in the full document, and nothing else.
+
+static const std::string projection_input = R"({"annotations": {
+  "engine_name": "libmeasurement_kit", "platform": "macos"}, "inputs": [
+  "www.kernel.org", "www.x.org", {"a": [1, 2]}], "name": "Ndt",
+  "test_keys": {"body": "a \"quoted\" \\ body", "ok": true, "failure": null,
+  "rtts": [0.1, -2, 3e-2, [4]], "a~b/c": {"x": []}}, "name": "Dash"})";
+
+static void check_projection(const std::vector<std::string> &paths) {
+  std::vector<Pointer> pointers;
+  nlohmann::json full = nlohmann::json::parse(projection_input);
+  nlohmann::json expected;
+  for (auto &path : paths) {
+    pointers.push_back(Pointer{path});
+    nlohmann::json::json_pointer pointer{path};
+    try {
+      expected[pointer] = full.at(pointer);
+    } catch (const std::exception &) {
+      // Not in the input
+    }
+  }
+  Json doc;
+  REQUIRE(doc.parse(projection_input, pointers));
+  std::string got;
+  REQUIRE(doc.serialize(&got));
+  REQUIRE(got == expected.dump());
+}
+
+TEST_CASE("We can parse only the requested pointers") {
+  Json doc;
+  REQUIRE(doc.parse(projection_input,
+                    {Pointer{"/annotations/engine_name"},
+                     Pointer{"/test_keys/rtts/1"}, Pointer{"/inputs/7"},
+                     Pointer{"/missing/field"}, Pointer{"/name/x"}}));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"annotations":{"engine_name":"libmeasurement_kit"},)"
+               R"("test_keys":{"rtts":[null,-2]}})");
+}
+
+TEST_CASE("A projection parse agrees with the full document") {
+  std::vector<std::vector<std::string>> cases = {
+      {""},
+      {"/annotations"},
+      {"/annotations", "/annotations/platform"},
+      {"/inputs/2/a/1", "/inputs/0"},
+      {"/test_keys/a~0b~1c/x", "/test_keys/body", "/test_keys/failure"},
+      {"/test_keys/rtts/3/0", "/test_keys/rtts/0", "/test_keys/ok"},
+      {"/name", "/inputs"},
+  };
+  for (auto &paths : cases) {
+    check_projection(paths);
+  }
+}
+
+TEST_CASE("A projection parse does not confuse keys and indexes") {
+  Json doc;
+  REQUIRE(doc.parse("{\"0\": [1, {\"1\": 2}], \"1\": 3}",
+                    {Pointer{"/0/1/1"}}));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"0":[null,{"1":2}]})");
+}
+
+TEST_CASE("A projection parse fails on invalid pointers and input") {
+  Json doc;
+  REQUIRE(doc.parse(std::string{"[17]"}));
+  REQUIRE(!doc.parse(projection_input, {Pointer{"/a"}, Pointer{"~"}}));
+  REQUIRE(!doc.parse("{\"a\": [1, 2}", {Pointer{"/a"}}));
+  REQUIRE(!doc.parse("{\"a\" 1}", {Pointer{"/b"}}));
+  REQUIRE(!doc.parse("{\"a\": {}} 1", {Pointer{"/b"}}));
+  REQUIRE(!doc.parse("{\"b\": {\"x\": [}}", {Pointer{"/a"}}));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == "[17]");
+}
+
+TEST_CASE("A projection of the root agrees with the default backend") {
+  const std::string base = projection_input;
+  const char replacements[] = "{}[]:,\"\\ ntfe-+.0189\x01\xc3\xa8\xff";
+  uint32_t state = 17;
+  auto random = [&state]() {
+    state = state * 1103515245 + 12345;
+    return (size_t)(state >> 16);
+  };
+  for (size_t i = 0; i < 1000; ++i) {
+    std::string input = base;
+    input[random() % input.size()] =
+        replacements[random() % (sizeof(replacements) - 1)];
+    INFO("input: " << printable(input));
+    Json reference;
+    bool ok = reference.parse(input, ParseBackend::kDefault);
+    Json doc;
+    REQUIRE(doc.parse(input, {Pointer{}}) == ok);
+    if (ok) {
+      std::string expected, got;
+      REQUIRE(reference.serialize(&expected));
+      REQUIRE(doc.serialize(&got));
+      REQUIRE(expected == got);
+    }
+  }
+}
+
+// SAX
+// ---
+//
+// Make sure that we emit the expected events, that unescaped strings are
+// borrowed from the input, and that handlers can stop parsing.
+
+class RecordingHandler : public SaxHandler {
+ public:
+  std::string events;
+  const char *input_begin = nullptr;
+  const char *input_end = nullptr;
+  size_t borrowed = 0;
+  size_t limit = SIZE_MAX;
+
+  bool on_start_object() noexcept override { return add("{"); }
+  bool on_end_object() noexcept override { return add("}"); }
+  bool on_start_array() noexcept override { return add("["); }
+  bool on_end_array() noexcept override { return add("]"); }
+  bool on_key(const char *base, size_t count) noexcept override {
+    check_borrowed(base);
+    return add("k:" + std::string{base, count});
+  }
+  bool on_string(const char *base, size_t count) noexcept override {
+    check_borrowed(base);
+    return add("s:" + std::string{base, count});
+  }
+  bool on_integer(int64_t value) noexcept override {
+    return add("i:" + std::to_string(value));
+  }
+  bool on_float(double value) noexcept override {
+    return add("f:" + std::to_string(value));
+  }
+  bool on_boolean(bool value) noexcept override {
+    return add(value ? "true" : "false");
+  }
+  bool on_null() noexcept override { return add("null"); }
+
+ private:
+  bool add(std::string event) {
+    events += event + " ";
+    return --limit > 0;
+  }
+
+  void check_borrowed(const char *base) {
+    if (base >= input_begin && base < input_end) {
+      borrowed += 1;
+    }
+  }
+};
+
+TEST_CASE("We can parse a JSON emitting SAX events") {
+  std::string input = R"({"name": "Ndt", "k\"ey": ["a\nb", 17, -17, 1.5,
+      18446744073709551615, true, false, null, {}]})";
+  std::string expected =
+      "{ k:name s:Ndt k:k\"ey [ s:a\nb i:17 i:-17 f:1.500000 "
+      "f:18446744073709551616.000000 true false null { } ] } ";
+  {
+    RecordingHandler handler;
+    handler.input_begin = input.data();
+    handler.input_end = input.data() + input.size();
+    REQUIRE(sax_parse(input.data(), input.size(), &handler));
+    REQUIRE(handler.events == expected);
+    REQUIRE(handler.borrowed == 2);  // "name" and "Ndt"
+  }
+  {
+    RecordingHandler handler;
+    SaxParser parser{&handler};
+    for (char ch : input) {
+      REQUIRE(parser.feed(&ch, 1));
+    }
+    REQUIRE(parser.finish());
+    REQUIRE(handler.events == expected);
+  }
+}
+
+TEST_CASE("A SAX handler can stop parsing") {
+  std::string input = R"([1, 2, 3])";
+  RecordingHandler handler;
+  handler.limit = 3;
+  REQUIRE(!sax_parse(input.data(), input.size(), &handler));
+  REQUIRE(handler.events == "[ i:1 i:2 ");
+}
+
+TEST_CASE("We cannot SAX parse invalid JSON") {
+  std::string input = R"({"a": [1, 2})";
+  SaxHandler handler;
+  REQUIRE(!sax_parse(input.data(), input.size(), &handler));
+  SaxParser parser{&handler};
+  REQUIRE(!parser.feed(input));
+  REQUIRE(!parser.finish());
+  REQUIRE(!sax_parse(input.data(), input.size(), nullptr));
+}
+
+// NDJSON
+// ------
+//
+// Make sure that we deliver every record of a JSON Lines input, in order
+// when requested, regardless of the number of threads.
+
+static std::string make_ndjson(size_t count) {
+  std::string input;
+  for (size_t i = 0; i < count; ++i) {
+    input += R"({"id": )" + std::to_string(i) +
+             R"(, "body": "line with \" and \n", "rtts": [1.5, 2.5]})";
+    input += (i % 3 == 0) ? "\r\n" : "\n";
+    if (i % 100 == 0) {
+      input += "  \n";  // Blank lines are skipped
+    }
+  }
+  return input;
+}
+
+TEST_CASE("We can read NDJSON in order") {
+  std::string input = make_ndjson(20000);
+  for (size_t threads : {1, 2, 8}) {
+    NdjsonReader reader;
+    reader.set_threads(threads);
+    std::vector<int64_t> ids;
+    size_t last_offset = 0;
+    bool sorted = true;
+    REQUIRE(reader.read(input.data(), input.size(),
+                        [&](size_t offset, bool ok, Json &doc) {
+                          int64_t id = -1;
+                          sorted = sorted && ok && offset >= last_offset &&
+                                   doc.get_integer("/id", &id);
+                          last_offset = offset;
+                          ids.push_back(id);
+                        }));
+    REQUIRE(sorted);
+    std::vector<int64_t> expected(20000);
+    std::iota(expected.begin(), expected.end(), 0);
+    REQUIRE(ids == expected);
+  }
+}
+
+TEST_CASE("We can read NDJSON out of order") {
+  std::string input = make_ndjson(20000);
+  NdjsonReader reader;
+  reader.set_threads(4);
+  reader.set_ordered(false);
+  reader.set_backend(ParseBackend::kDefault);
+  std::vector<int64_t> ids;
+  REQUIRE(reader.read(input.data(), input.size(),
+                      [&](size_t, bool ok, Json &doc) {
+                        int64_t id = -1;
+                        if (ok && doc.get_integer("/id", &id)) {
+                          ids.push_back(id);
+                        }
+                      }));
+  std::sort(ids.begin(), ids.end());
+  std::vector<int64_t> expected(20000);
+  std::iota(expected.begin(), expected.end(), 0);
+  REQUIRE(ids == expected);
+}
+
+TEST_CASE("We report invalid NDJSON records") {
+  std::string input = "{\"a\": 1}\n{\"a\": \n[17]";
+  NdjsonReader reader;
+  std::vector<size_t> offsets;
+  std::vector<bool> results;
+  REQUIRE(!reader.read(input.data(), input.size(),
+                       [&](size_t offset, bool ok, Json &) {
+                         offsets.push_back(offset);
+                         results.push_back(ok);
+                       }));
+  REQUIRE(offsets == (std::vector<size_t>{0, 9, 16}));
+  REQUIRE(results == (std::vector<bool>{true, false, true}));
+}
+
+// Arena
+// -----
+//
+// Make sure that a Json using an arena behaves like one using the heap,
+// also when it is reset and reused for many documents.
+
+static void build_document(Json *doc, int64_t seq) {
+  REQUIRE(doc->set_string("/annotations/engine_name", "libmeasurement_kit"));
+  REQUIRE(doc->set_integer("/seq", seq));
+  for (int64_t i = 0; i < 64; ++i) {
+    REQUIRE(doc->push_float("/test_keys/rtts", 0.5 * (double)i));
+    REQUIRE(doc->push_string("/test_keys/hosts",
+                             "host-" + std::to_string(i) + ".example.com"));
+  }
+  REQUIRE(doc->set_string("/test_keys/body", std::string(4096, 'x')));
+  REQUIRE(doc->set_string("/test_keys/binary", "\xff\xfe"));
+}
+
+TEST_CASE("A Json using an arena behaves like one using the heap") {
+  Json arena_doc{Allocation::kArena};
+  for (int64_t seq = 0; seq < 16; ++seq) {
+    Json heap_doc;
+    build_document(&heap_doc, seq);
+    arena_doc.reset();
+    build_document(&arena_doc, seq);
+    std::string expected, got;
+    REQUIRE(heap_doc.serialize(&expected));
+    REQUIRE(arena_doc.serialize(&got));
+    REQUIRE(expected == got);
+    // Parse the same document using all the ways we have
+    for (auto backend : {ParseBackend::kDefault, ParseBackend::kSimd}) {
+      arena_doc.reset();
+      REQUIRE(arena_doc.parse(expected, backend));
+      REQUIRE(arena_doc.serialize(&got));
+      REQUIRE(expected == got);
+    }
+    arena_doc.reset();
+    REQUIRE(arena_doc.parse(expected, {Pointer{"/test_keys/hosts/7"}}));
+    std::string value;
+    REQUIRE(arena_doc.get_string("/test_keys/hosts/7", &value));
+    REQUIRE(value == "host-7.example.com");
+    REQUIRE(!arena_doc.get_string("/test_keys/hosts/6", &value));
+  }
+}
+
+TEST_CASE("We can reset a Json") {
+  for (auto allocation : {Allocation::kHeap, Allocation::kArena}) {
+    Json doc{allocation};
+    REQUIRE(doc.parse(std::string{"{\"a\": [1, 2, 3]}"}));
+    doc.reset();
+    std::string s;
+    REQUIRE(doc.serialize(&s));
+    REQUIRE(s == "null");
+    REQUIRE(doc.set_integer("/b", 1));
+    REQUIRE(doc.serialize(&s));
+    REQUIRE(s == R"({"b":1})");
+  }
+}
+
+TEST_CASE("A Json using an arena can receive a streamed document") {
+  Json doc{Allocation::kArena};
+  REQUIRE(doc.set_string("/previous", "document"));
+  StreamParser parser;
+  REQUIRE(parser.feed("{\"a\": [\"x\", "));
+  REQUIRE(parser.feed("\"y\"]}"));
+  REQUIRE(parser.finish(&doc));
+  REQUIRE(doc.push_string("/a", "z"));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == R"({"a":["x","y","z"]})");
+}
+
 // Serialize
 // ---------
 //
@@ -198,6 +1525,893 @@ TEST_CASE("We can construct and serialize a JSON") {
   }
 }
 
+// Make sure that we produce the same output as nlohmann::json, in
+// particular when escaping strings and keys.
+
+TEST_CASE("We serialize like nlohmann::json") {
+  std::string controls;
+  for (int ch = 0; ch < 0x80; ++ch) {
+    controls += (char)ch;
+  }
+  nlohmann::json control;
+  control["controls"] = controls;
+  control[controls] = "key with controls";
+  control["unicode"] = "\xc3\xa8 \xe2\x82\xac \xf0\x9f\x98\x80 \\\"";
+  control["numbers"] = {0, -1, 17, 1.14, 1e300, -0.0, UINT64_MAX, INT64_MIN};
+  control["literals"] = {true, false, nullptr};
+  control["empty"] = {nlohmann::json::object(), nlohmann::json::array(), ""};
+  control["nested"][0]["x"][1]["y"] = "z";
+  Json doc;
+  REQUIRE(doc.parse(control.dump()));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == control.dump());
+}
+
+// The SIMD and streaming parsers tell the serializer whether a string needs
+// escaping, so make sure that what they tell is correct.
+
+TEST_CASE("We serialize parsed strings like nlohmann::json") {
+  std::string input =
+      "{\"plain\":\"abc\",\"utf8\":\"\xc3\xa8\",\"escaped\":[\"\\\"\","
+      "\"\\\\\",\"\\/\",\"\\n\",\"\\u0000\",\"\\u001f\",\"\\u0041\","
+      "\"\\u00e8\",\"\\ud83d\\ude00\",\"a\\tb\"],\"k\\u0001\":1,\"k\\/\":2}";
+  std::string expect = nlohmann::json::parse(input).dump();
+  std::string s;
+  Json doc;
+  REQUIRE(doc.parse(input, ParseBackend::kSimd));
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == expect);
+  StreamParser parser;
+  for (char ch : input) {
+    REQUIRE(parser.feed(&ch, 1));
+  }
+  REQUIRE(parser.finish(&doc));
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == expect);
+  REQUIRE(doc.parse(input, {Pointer{"/escaped"}, Pointer{"/k\x01"}}));
+  REQUIRE(doc.serialize(&s));
+  nlohmann::json control;
+  control["escaped"] = nlohmann::json::parse(input)["escaped"];
+  control["k\x01"] = 1;
+  REQUIRE(s == control.dump());
+}
+
+TEST_CASE("We cannot serialize a key that is not valid UTF-8") {
+  Json doc;
+  REQUIRE(doc.set_integer("/\xc3\x28", 17));
+  std::string s = "unchanged";
+  REQUIRE(!doc.serialize(&s));
+  REQUIRE(s == "unchanged");
+}
+
+// Make sure that streaming produces the same output in chunks of bounded
+// size, and that we stop when the writer fails.
+
+static void make_large_document(Json *doc) {
+  std::string text(1 << 20, 'x');
+  for (size_t i = 0; i < text.size(); i += 97) {
+    text[i] = (char)(i % 32);  // Control characters need escaping
+  }
+  REQUIRE(doc->set_string("/text", text));
+  REQUIRE(doc->set_bytes("/bytes", std::string(1 << 20, '\xff')));
+  for (int64_t i = 0; i < 100000; ++i) {
+    REQUIRE(doc->push_integer("/numbers", i));
+  }
+}
+
+static std::string read_file(FILE *filep) {
+  rewind(filep);
+  std::string str;
+  char buffer[4096];
+  size_t count = 0;
+  while ((count = fread(buffer, 1, sizeof(buffer), filep)) > 0) {
+    str.append(buffer, count);
+  }
+  return str;
+}
+
+TEST_CASE("We can serialize to a writer") {
+  Json doc;
+  make_large_document(&doc);
+  std::string expected;
+  REQUIRE(doc.serialize(&expected));
+  std::string got;
+  size_t chunks = 0;
+  size_t max_chunk = 0;
+  REQUIRE(doc.serialize([&](const char *data, size_t size) {
+    got.append(data, size);
+    chunks += 1;
+    max_chunk = std::max(max_chunk, size);
+    return true;
+  }));
+  REQUIRE(got == expected);
+  REQUIRE(chunks > 1);
+  REQUIRE(max_chunk < 256 * 1024);
+}
+
+TEST_CASE("We stop serializing when the writer fails") {
+  Json doc;
+  make_large_document(&doc);
+  size_t chunks = 0;
+  REQUIRE(!doc.serialize([&](const char *, size_t) {
+    chunks += 1;
+    return false;
+  }));
+  REQUIRE(chunks == 1);
+  REQUIRE(!doc.serialize(Json::Writer{}));
+  REQUIRE(!doc.serialize_file(nullptr));
+  REQUIRE(!doc.serialize_fd(-1));
+}
+
+TEST_CASE("We can serialize to a file") {
+  Json doc;
+  make_large_document(&doc);
+  std::string expected;
+  REQUIRE(doc.serialize(&expected));
+  FILE *filep = tmpfile();
+  REQUIRE(filep != nullptr);
+  REQUIRE(doc.serialize_file(filep));
+  REQUIRE(fflush(filep) == 0);
+  REQUIRE(read_file(filep) == expected);
+  (void)fclose(filep);
+}
+
+TEST_CASE("We can serialize to a file descriptor") {
+  Json doc;
+  make_large_document(&doc);
+  std::string expected;
+  REQUIRE(doc.serialize(&expected));
+  FILE *filep = tmpfile();
+  REQUIRE(filep != nullptr);
+  REQUIRE(doc.serialize_fd(fileno(filep)));
+  REQUIRE(read_file(filep) == expected);
+  (void)fclose(filep);
+}
+
+// Make sure that we can batch documents into the same buffer and that,
+// once its capacity is large enough, serializing does not allocate.
+
+TEST_CASE("We can append serialized documents to a buffer") {
+  Json first;
+  REQUIRE(first.set_string("/name", "first"));
+  Json second;
+  REQUIRE(second.push_integer("/values", 17));
+  REQUIRE(second.set_bytes("/bytes", "\x01\x02"));
+  std::string expected_first;
+  REQUIRE(first.serialize(&expected_first));
+  std::string expected_second;
+  REQUIRE(second.serialize(&expected_second));
+  std::string buffer = "prefix\n";
+  REQUIRE(first.serialize_append(&buffer));
+  buffer += "\n";
+  REQUIRE(second.serialize_append(&buffer));
+  REQUIRE(buffer == "prefix\n" + expected_first + "\n" + expected_second);
+  REQUIRE(!first.serialize_append(nullptr));
+}
+
+TEST_CASE("We truncate the buffer when we cannot append") {
+  Json doc;
+  REQUIRE(doc.set_string("/valid", std::string(1000, 'x')));
+  REQUIRE(doc.set_integer("/\xc3\x28", 17));
+  std::string buffer = "prefix";
+  REQUIRE(!doc.serialize_append(&buffer));
+  REQUIRE(buffer == "prefix");
+}
+
+TEST_CASE("Serializing into a reused buffer does not allocate") {
+  Json doc;
+  REQUIRE(doc.set_string("/annotations/engine_name", "libmeasurement_kit"));
+  REQUIRE(doc.set_string("/escaped", "\"quoted\"\n"));
+  REQUIRE(doc.set_bytes("/bytes", std::string(1000, '\0')));
+  REQUIRE(doc.set_float("/elapsed", 1.14));
+  for (int64_t i = 0; i < 100; ++i) {
+    REQUIRE(doc.push_integer("/values", -i));
+  }
+  REQUIRE(doc.push_boolean("/flags", true));
+  PooledBuffer buffer;
+  REQUIRE(doc.serialize_append(buffer.get()));  // Warm up
+  for (int i = 0; i < 10; ++i) {
+    buffer->clear();
+    size_t before = allocations();
+    bool ok = doc.serialize_append(buffer.get());
+    size_t after = allocations();
+    REQUIRE(ok);
+    REQUIRE(after == before);
+  }
+}
+
+TEST_CASE("Pooled buffers keep their capacity") {
+  const char *data = nullptr;
+  {
+    PooledBuffer buffer;
+    buffer->assign(100000, 'x');
+    data = buffer->data();
+  }
+  {
+    PooledBuffer buffer;
+    REQUIRE(buffer->empty());
+    REQUIRE(buffer->capacity() >= 100000);
+    REQUIRE(buffer->data() == data);
+    {
+      PooledBuffer other;  // The pool is empty now
+      REQUIRE(other->data() != data);
+    }
+  }
+}
+
+// UTF-8 validation
+// ----------------
+//
+// Make sure that the vectorized validator accepts the same inputs as the
+// DFA, including when sequences cross the boundaries of vectors and blocks.
+
+static bool utf8_validate_dfa(const std::string &input) {
+  uint32_t state = UTF8_ACCEPT;
+  uint32_t codepoint = 0;
+  for (char ch : input) {
+    if (utf8_decode(&state, &codepoint, (uint8_t)ch) == UTF8_REJECT) {
+      return false;
+    }
+  }
+  return state == UTF8_ACCEPT;
+}
+
+static void check_utf8_validate(const std::string &input) {
+  INFO("input: " << printable(input));
+  bool valid = utf8_validate_dfa(input);
+  REQUIRE(utf8_validate(input.data(), input.size()) == valid);
+  unsigned expect = utf8_scanned;
+  if (valid) {
+    expect |= utf8_valid | utf8_ascii;
+    for (char ch : input) {
+      if ((uint8_t)ch < 0x20 || ch == '"' || ch == '\\') {
+        expect |= utf8_escape;
+      } else if ((uint8_t)ch >= 0x80) {
+        expect &= ~utf8_ascii;
+      }
+    }
+  }
+  REQUIRE(utf8_scan(input.data(), input.size()) == expect);
+}
+
+TEST_CASE("The UTF-8 validator agrees with the DFA on short sequences") {
+  for (size_t offset : {0, 15, 31, 63}) {
+    for (uint32_t first = 0; first < 256; ++first) {
+      for (uint32_t second = 0; second < 256; ++second) {
+        std::string input(offset, 'x');
+        input += (char)first;
+        input += (char)second;
+        check_utf8_validate(input);
+        check_utf8_validate(input + "\x80");
+        check_utf8_validate(input + "\x80\xbf");
+        check_utf8_validate(input + "y");
+      }
+    }
+  }
+}
+
+TEST_CASE("The UTF-8 validator agrees with the DFA on random input") {
+  const char *pieces[] = {
+      "a",    "\x7f", "\xc3\xa8", "\xdf\xbf", "\xe2\x82\xac", "\xef\xbf\xbf",
+      "\xed\x9f\xbf", "\xf0\x9f\x98\x80", "\xf4\x8f\xbf\xbf", "\"", "\\",
+      "\x1f", "\x80", "\xbf", "\xc0\xaf", "\xc1", "\xe0\x80\xaf",
+      "\xed\xa0\x80", "\xf0\x80\x80\xaf", "\xf4\x90\x80\x80", "\xf5", "\xff",
+      "\xc3", "\xe2\x82", "\xf0\x9f\x98",
+  };
+  constexpr size_t count = sizeof(pieces) / sizeof(pieces[0]);
+  uint32_t state = 17;
+  auto random = [&state]() {
+    state = state * 1103515245 + 12345;
+    return (size_t)(state >> 16);
+  };
+  for (size_t i = 0; i < 20000; ++i) {
+    std::string input;
+    size_t size = random() % 300;
+    // Mostly valid input, so that a single error is hard to spot
+    bool valid_only = random() % 2 == 0;
+    while (input.size() < size) {
+      size_t piece = random() % (valid_only ? 12 : count);
+      input += (random() % 4 == 0) ? pieces[piece] : "abcdefgh";
+    }
+    check_utf8_validate(input);
+  }
+}
+
+TEST_CASE("We store valid UTF-8 verbatim and encode invalid UTF-8") {
+  std::string valid = std::string(100, 'x') + "\xf0\x9f\x98\x80 \xc3\xa8";
+  std::string invalid = std::string(63, 'x') + "\xe2\x82";
+  Json doc;
+  REQUIRE(doc.set_string("/valid", valid));
+  REQUIRE(doc.set_string("/invalid", invalid));
+  std::string s;
+  REQUIRE(doc.get_string("/valid", &s));
+  REQUIRE(s == valid);
+  REQUIRE(doc.get_string("/invalid", &s));
+  REQUIRE(s != invalid);
+  REQUIRE(s.size() == (invalid.size() + 2) / 3 * 4);
+}
+
+// Escaping
+// --------
+
+static size_t find_escape_scalar(const std::string &input, size_t pos) {
+  while (pos < input.size() && (uint8_t)input[pos] >= 0x20 &&
+         input[pos] != '"' && input[pos] != '\\') {
+    pos += 1;
+  }
+  return pos;
+}
+
+TEST_CASE("The escape scanner finds each special character anywhere") {
+  for (uint32_t ch = 0; ch < 256; ++ch) {
+    for (size_t size = 1; size <= 80; ++size) {
+      for (size_t where = 0; where < size; ++where) {
+        std::string input(size, 'x');
+        input[where] = (char)ch;
+        for (size_t pos : {(size_t)0, where, size - 1}) {
+          INFO("ch: " << ch << " size: " << size << " where: " << where
+                      << " pos: " << pos);
+          REQUIRE(find_escape(input.data(), input.size(), pos) ==
+                  find_escape_scalar(input, pos));
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("We escape strings with sparse special characters") {
+  std::string text;
+  for (size_t i = 0; i < 5000; ++i) {
+    text += (i % 37 == 0) ? (char)(i % 32) : (i % 101 == 0) ? '"' : 'a';
+  }
+  text += "\\";
+  nlohmann::json control;
+  control["text"] = text;
+  Json doc;
+  REQUIRE(doc.set_string("/text", text));
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  REQUIRE(s == control.dump());
+}
+
+// Base64
+// ------
+//
+// Make sure that the vectorized encoder produces the same output as the
+// original character-at-a-time implementation, for any size and content.
+
+static std::string base64_reference(const uint8_t *base, size_t len) {
+  static const std::string b64_table =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+      "abcdefghijklmnopqrstuvwxyz"
+      "0123456789+/";
+  std::string res;
+  uint8_t in[3];
+  uint8_t out[4];
+  int state = 0;
+  auto copy = [&]() {
+    out[0] = (in[0] & 0xfc) >> 2;
+    out[1] = ((in[0] & 0x03) << 4) + ((in[1] & 0xf0) >> 4);
+    out[2] = ((in[1] & 0x0f) << 2) + ((in[2] & 0xc0) >> 6);
+    out[3] = in[2] & 0x3f;
+    for (int idx = 0; idx < 4; ++idx) {
+      res += (idx <= state) ? b64_table[out[idx]] : '=';
+    }
+  };
+  while (len-- > 0) {
+    in[state++] = *(base++);
+    if (state == 3) {
+      copy();
+      state = 0;
+    }
+  }
+  if (state != 0) {
+    for (int idx = state; idx < 3; ++idx) {
+      in[idx] = '\0';
+    }
+    copy();
+  }
+  return res;
+}
+
+TEST_CASE("The base64 encoder agrees with the reference implementation") {
+  uint32_t state = 17;
+  auto random = [&state]() {
+    state = state * 1103515245 + 12345;
+    return (uint8_t)(state >> 16);
+  };
+  std::vector<uint8_t> input(600);
+  for (auto &byte : input) {
+    byte = random();
+  }
+  for (size_t offset = 0; offset < 4; ++offset) {
+    for (size_t len = 0; len + offset <= input.size(); ++len) {
+      INFO("offset: " << offset << " len: " << len);
+      REQUIRE(base64_encode(input.data() + offset, len) ==
+              base64_reference(input.data() + offset, len));
+    }
+  }
+  // Every value of each byte, so that we use every character
+  std::vector<uint8_t> all(256 * 3);
+  for (size_t i = 0; i < all.size(); ++i) {
+    all[i] = (uint8_t)(i / 3 + (i % 3) * 85);
+  }
+  REQUIRE(base64_encode(all.data(), all.size()) ==
+          base64_reference(all.data(), all.size()));
+}
+
+TEST_CASE("The base64 decoder inverts the encoder") {
+  uint32_t state = 17;
+  auto random = [&state]() {
+    state = state * 1103515245 + 12345;
+    return (uint8_t)(state >> 16);
+  };
+  std::vector<uint8_t> input(600);
+  for (auto &byte : input) {
+    byte = random();
+  }
+  std::string output = "reused buffer";
+  for (size_t offset = 0; offset < 4; ++offset) {
+    for (size_t len = 0; len + offset <= input.size(); ++len) {
+      INFO("offset: " << offset << " len: " << len);
+      std::string encoded = base64_encode(input.data() + offset, len);
+      REQUIRE(base64_decode(encoded.data(), encoded.size(), &output));
+      REQUIRE(output == std::string((char *)input.data() + offset, len));
+    }
+  }
+}
+
+TEST_CASE("The base64 decoder rejects invalid input") {
+  const char *inputs[] = {
+      "A", "AB", "ABC", "ABCDE", "====", "A===", "AB=C", "A=BC", "AB==CDEF",
+      "AB=", "AB\nCD", "AB-_", "AR==", "ABC=", "ABD=", "\x80\x80\x80\x80",
+  };
+  for (const char *input : inputs) {
+    INFO("input: " << printable(input));
+    std::string output;
+    REQUIRE(!base64_decode(input, strlen(input), &output));
+  }
+  // An invalid character anywhere in a long input
+  std::string valid = base64_encode((const uint8_t *)"0123456789", 10);
+  while (valid.size() < 200) {
+    valid += valid;
+  }
+  for (size_t pos = 0; pos < valid.size(); ++pos) {
+    for (char ch : {'=', '*', '\0', (char)0xc3}) {
+      std::string input = valid;
+      input[pos] = ch;
+      INFO("pos: " << pos << " ch: " << (int)ch);
+      std::string output;
+      REQUIRE(!base64_decode(input.data(), input.size(), &output));
+    }
+  }
+}
+
+TEST_CASE("We can get the bytes of a non-UTF8 string") {
+  std::string binary;
+  for (size_t i = 0; i < 1000; ++i) {
+    binary += (char)(i * 7 + 0x80);
+  }
+  Json doc;
+  REQUIRE(doc.set_string("/binary", binary));
+  REQUIRE(doc.set_string("/text", "not base64!"));
+  REQUIRE(doc.set_integer("/number", 17));
+  std::string value;
+  REQUIRE(doc.get_bytes("/binary", &value));
+  REQUIRE(value == binary);
+  REQUIRE(doc.get_bytes(Pointer{"/binary"}, &value));
+  REQUIRE(value == binary);
+  REQUIRE(!doc.get_bytes("/text", &value));
+  REQUIRE(!doc.get_bytes("/number", &value));
+  REQUIRE(!doc.get_bytes("/missing", &value));
+  REQUIRE(!doc.get_bytes("/binary", nullptr));
+}
+
+TEST_CASE("We can store raw bytes") {
+  std::string binary;
+  for (size_t i = 0; i < 1000; ++i) {
+    binary += (char)(i * 7);
+  }
+  for (size_t len : {0, 1, 2, 3, 31, 32, 33, 1000}) {
+    INFO("len: " << len);
+    std::string bytes = binary.substr(0, len);
+    std::string encoded = base64_encode((const uint8_t *)bytes.data(), len);
+    Json doc;
+    REQUIRE(doc.set_bytes("/bytes", bytes));
+    REQUIRE(doc.set_bytes(Pointer{"/x/bytes"}, bytes));
+    REQUIRE(doc.push_bytes("/array", bytes));
+    REQUIRE(doc.push_bytes(Pointer{"/array"}, bytes));
+    std::string value;
+    for (std::string path : {"/bytes", "/x/bytes", "/array/0", "/array/1"}) {
+      INFO("path: " << path);
+      // Even valid UTF-8 is encoded, and we see the encoding as a string
+      REQUIRE(doc.get_string(path, &value));
+      REQUIRE(value == encoded);
+      REQUIRE(doc.get_bytes(path, &value));
+      REQUIRE(value == bytes);
+    }
+    std::string s;
+    REQUIRE(doc.serialize(&s));
+    nlohmann::json control = nlohmann::json::parse(s);
+    REQUIRE(control["bytes"] == encoded);
+    REQUIRE(control["x"]["bytes"] == encoded);
+    REQUIRE(control["array"] == nlohmann::json::array({encoded, encoded}));
+    // Once parsed, the bytes are a base64 string, which we can decode
+    Json parsed;
+    REQUIRE(parsed.parse(s));
+    REQUIRE(parsed.get_bytes("/bytes", &value));
+    REQUIRE(value == bytes);
+    REQUIRE(parsed.get_bytes("/array/1", &value));
+    REQUIRE(value == bytes);
+    // Overwriting raw bytes with a string gives us a string again
+    REQUIRE(doc.set_string("/bytes", "text"));
+    REQUIRE(doc.get_string("/bytes", &value));
+    REQUIRE(value == "text");
+  }
+}
+
+TEST_CASE("We can store raw bytes in a Json using an arena") {
+  std::string binary(100000, '\xff');
+  Json doc{Allocation::kArena};
+  for (int round = 0; round < 3; ++round) {
+    doc.reset();
+    REQUIRE(doc.set_bytes("/bytes", binary));
+    REQUIRE(doc.push_bytes("/array", binary));
+    std::string s;
+    REQUIRE(doc.serialize(&s));
+    std::string encoded =
+        base64_encode((const uint8_t *)binary.data(), binary.size());
+    REQUIRE(s == "{\"array\":[\"" + encoded + "\"],\"bytes\":\"" + encoded +
+                     "\"}");
+  }
+}
+
+// Number formatting
+// -----------------
+//
+// Make sure that doubles round trip with the shortest digits, that we lay
+// them out like nlohmann::json, and that integers are correct.
+
+static std::string format(double value) {
+  char buffer[number_format_size];
+  return std::string(buffer, format_double(value, buffer));
+}
+
+// Reduces a decimal number to its significant digits followed by "e" and
+// the position of the decimal point, e.g., "-0.0120" becomes "12e-1".
+static std::string normalize(const std::string &number) {
+  std::string digits;
+  int point = 0;
+  bool seen_point = false;
+  size_t pos = number[0] == '-' ? 1 : 0;
+  for (; pos < number.size() && number[pos] != 'e'; ++pos) {
+    if (number[pos] == '.') {
+      seen_point = true;
+      continue;
+    }
+    point += seen_point ? 0 : 1;
+    digits += number[pos];
+  }
+  int exponent = pos < number.size() ? atoi(number.c_str() + pos + 1) : 0;
+  while (digits.size() > 1 && digits[0] == '0') {
+    digits.erase(0, 1);
+    point -= 1;
+  }
+  while (digits.size() > 1 && digits[digits.size() - 1] == '0') {
+    digits.erase(digits.size() - 1);
+  }
+  return digits + "e" + std::to_string(point + exponent);
+}
+
+// Returns the correctly rounded representation of |value| with the least
+// number of digits that round trips, using printf().
+static std::string shortest_reference(double value) {
+  char buffer[64];
+  for (int precision = 1; precision <= 17; ++precision) {
+    snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, value);
+    if (strtod(buffer, nullptr) == value) {
+      break;
+    }
+  }
+  return normalize(buffer);
+}
+
+static void check_shortest(double value) {
+  if (value == 0.0) {
+    return;
+  }
+  std::string got = format(value);
+  INFO("value: " << std::hexfloat << value << " got: " << got);
+  REQUIRE(strtod(got.c_str(), nullptr) == value);
+  // When the value is a power of two, the closest decimal with the least
+  // digits may be outside of the rounding interval, while another one is
+  // inside, hence we may be shorter than the reference.
+  std::string digits = normalize(got);
+  std::string expected = shortest_reference(value);
+  REQUIRE(digits.find('e') <= expected.find('e'));
+  if (digits.find('e') == expected.find('e')) {
+    REQUIRE(digits == expected);
+  }
+}
+
+TEST_CASE("The double formatter uses the shortest digits that round trip") {
+  uint64_t state = 17;
+  auto random = [&state]() {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return state;
+  };
+  for (size_t i = 0; i < 50000; ++i) {
+    uint64_t bits = random();
+    if (i % 10 == 0) {
+      bits &= 0x800fffffffffffffULL;  // Subnormal
+    } else if (i % 10 == 1) {
+      bits &= 0x8000000000000000ULL | (0x7feULL << 52);  // Power of two
+    }
+    double value = 0.0;
+    memcpy(&value, &bits, sizeof(value));
+    if (std::isfinite(value) && value != 0.0) {
+      check_shortest(value);
+    }
+  }
+  // Integers and values with few decimals, as found in measurements
+  for (size_t i = 0; i < 20000; ++i) {
+    uint64_t integer = random() >> (i % 64);
+    check_shortest((double)integer);
+    check_shortest((double)(int64_t)integer / 1000.0);
+  }
+}
+
+// Replaces the digits of the significand of |number| with "#".
+static std::string layout(std::string number) {
+  for (size_t pos = 0; pos < number.size() && number[pos] != 'e'; ++pos) {
+    if (isdigit(number[pos])) {
+      number[pos] = '#';
+    }
+  }
+  return number;
+}
+
+TEST_CASE("The double formatter lays out numbers like nlohmann::json") {
+  std::vector<double> values = {
+      0.1,
+      1.5,
+      17.0,
+      1.14,
+      0.0001234,
+      0.00001234,
+      123456789012345.0,
+      1234567890123456.0,
+      9007199254740992.0,
+      9223372036854775808.0,
+      18446744073709551616.0,
+      std::numeric_limits<double>::max(),
+      std::numeric_limits<double>::min(),
+      std::numeric_limits<double>::denorm_min(),
+      std::numeric_limits<double>::epsilon(),
+  };
+  for (double value = 1e-320; value < 1e308; value *= 10.0) {
+    values.push_back(value);
+  }
+  for (int shift = -1074; shift < 1024; ++shift) {
+    values.push_back(ldexp(1.0, shift));
+  }
+  for (double value : values) {
+    for (double signed_value : {value, -value}) {
+      char buffer[64];
+      std::string expected{buffer, nlohmann::detail::to_chars(
+                                       buffer, buffer + sizeof(buffer),
+                                       signed_value)};
+      INFO("value: " << std::hexfloat << signed_value);
+      // Grisu2, used by nlohmann::json, does not always pick the closest
+      // digits, so we may only agree on the layout.
+      std::string got = format(signed_value);
+      REQUIRE(layout(got) == layout(expected));
+      REQUIRE(strtod(got.c_str(), nullptr) == signed_value);
+    }
+  }
+  REQUIRE(format(0.0) == "0.0");
+  REQUIRE(format(-0.0) == "-0.0");
+  REQUIRE(format(std::numeric_limits<double>::infinity()) == "null");
+  REQUIRE(format(-std::numeric_limits<double>::infinity()) == "null");
+  REQUIRE(format(std::numeric_limits<double>::quiet_NaN()) == "null");
+}
+
+TEST_CASE("The integer formatter agrees with std::to_string") {
+  std::vector<uint64_t> values = {0, UINT64_MAX, INT64_MAX,
+                                  (uint64_t)INT64_MAX + 1};
+  for (uint64_t power = 1; power <= UINT64_MAX / 10; power *= 10) {
+    values.push_back(power - 1);
+    values.push_back(power);
+    values.push_back(power + 1);
+    values.push_back(power * 10 - 1);
+  }
+  uint64_t state = 17;
+  for (size_t i = 0; i < 10000; ++i) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    values.push_back(state >> (i % 64));
+  }
+  for (uint64_t value : values) {
+    INFO("value: " << value);
+    char buffer[number_format_size];
+    REQUIRE(std::string(buffer, format_unsigned(value, buffer)) ==
+            std::to_string(value));
+    int64_t integer = (int64_t)value;
+    REQUIRE(std::string(buffer, format_integer(integer, buffer)) ==
+            std::to_string(integer));
+  }
+}
+
+TEST_CASE("Serialized doubles parse back to the same value") {
+  Json doc;
+  uint64_t state = 17;
+  std::vector<double> values;
+  for (size_t i = 0; i < 10000; ++i) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    double value = 0.0;
+    memcpy(&value, &state, sizeof(value));
+    if (std::isfinite(value)) {
+      values.push_back(value);
+      REQUIRE(doc.push_float("/values", value));
+    }
+  }
+  std::string s;
+  REQUIRE(doc.serialize(&s));
+  nlohmann::json control = nlohmann::json::parse(s);
+  REQUIRE(control["values"].size() == values.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    REQUIRE(control["values"][i].get<double>() == values[i]);
+  }
+}
+
+// Make sure that parsing numbers gives the same double as strtod(), also
+// for inputs that are hard to round correctly.
+
+static void check_parse_double(const std::string &input) {
+  INFO("input: " << input);
+  double expected = strtod(input.c_str(), nullptr);
+  Number number;
+  size_t end = 0;
+  bool ok = parse_number(input.data(), input.size(), 0, &end, &number);
+  if (!std::isfinite(expected)) {
+    REQUIRE(!ok);
+    return;
+  }
+  REQUIRE(ok);
+  REQUIRE(end == input.size());
+  REQUIRE(number.type == NumberType::kFloat);
+  REQUIRE(memcmp(&number.float_value, &expected, sizeof(expected)) == 0);
+}
+
+TEST_CASE("We parse tricky numbers like strtod()") {
+  const char *inputs[] = {
+      // Around the smallest normal and subnormal numbers
+      "2.2250738585072011e-308",
+      "2.2250738585072012e-308",
+      "2.2250738585072014e-308",
+      "2.225073858507201136057409796709131975934819546351645648e-308",
+      "4.9406564584124654e-324",
+      "2.4703282292062327e-324",
+      "2.4703282292062328e-324",
+      "1e-324",
+      "1e-400",
+      "0.0000000000000000000000000000000000000000000000000000000001",
+      // Around the largest number
+      "1.7976931348623157e308",
+      "1.7976931348623158e308",
+      "1.7976931348623159e308",
+      "8.98846567431158e307",
+      "1e308",
+      "1e309",
+      "1e99999999999999999999",
+      // Halfway between two doubles, rounding to even
+      "9007199254740993.0",
+      "9007199254740995.0",
+      "1.00000000000000011102230246251565404236316680908203125",
+      "1.00000000000000011102230246251565404236316680908203124",
+      "1.00000000000000011102230246251565404236316680908203126",
+      "7.2057594037927933e16",
+      "2.0000000000000004",
+      "1.0000000000000002",
+      "1.00000000000000022",
+      // Values that are famously hard to convert
+      "0.1",
+      "0.3",
+      "1e23",
+      "8.589973e9",
+      "9.5e-5",
+      "3.141592653589793238462643383279",
+      "123456789012345678901234567890",
+      "-123456789012345678901234567890.0",
+      "7.4109846876186982e-323",
+      "4.35679098e-17",
+      "5.0216813883093446e-16",
+      "6.2e-45",
+      "1.8014398509481984e16",
+      "9.999999999999999e22",
+      // Zero and integers that are floats
+      "0.0",
+      "-0.0",
+      "0e0",
+      "0e-99999",
+      "-0E+5",
+      "1E2",
+      "18446744073709551616",
+      "-9223372036854775809",
+  };
+  for (const char *input : inputs) {
+    check_parse_double(input);
+  }
+  // Long runs of zeros compensating an exponent that we cannot store.
+  std::string zeros(1000000, '0');
+  check_parse_double("0." + zeros + "1e1000010");
+  check_parse_double("-0." + zeros + "1E+1000010");
+  check_parse_double("1" + zeros + "e-1000010");
+  check_parse_double("0." + zeros + "1e1000400");
+  check_parse_double("0." + zeros + "1e100000");
+  Json doc;
+  REQUIRE(doc.parse("[0." + zeros + "1e1000010]", ParseBackend::kSimd));
+  double value = 0.0;
+  REQUIRE(doc.get_float("/0", &value));
+  REQUIRE(value == 1e9);
+}
+
+TEST_CASE("We parse random numbers like strtod()") {
+  uint64_t state = 17;
+  auto random = [&state]() {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return state;
+  };
+  char buffer[64];
+  for (size_t i = 0; i < 50000; ++i) {
+    uint64_t bits = random();
+    double value = 0.0;
+    memcpy(&value, &bits, sizeof(value));
+    if (!std::isfinite(value)) {
+      continue;
+    }
+    // Any number of digits, with and without the exponent
+    int precision = (int)(random() % 25);
+    snprintf(buffer, sizeof(buffer), "%.*e", precision, value);
+    check_parse_double(buffer);
+    check_parse_double(format(value));
+    snprintf(buffer, sizeof(buffer), "%.*f", 1 + (int)(random() % 20),
+             (double)(int64_t)random() / 1e9);
+    check_parse_double(buffer);
+  }
+  // Random digits, which are unlikely to be close to a double
+  for (size_t i = 0; i < 50000; ++i) {
+    std::string input = std::to_string(random() % 1000);
+    input += ".";
+    for (size_t count = 1 + random() % 30; count > 0; --count) {
+      input += (char)('0' + random() % 10);
+    }
+    input += "e" + std::to_string((int)(random() % 700) - 350);
+    check_parse_double(input);
+  }
+}
+
+TEST_CASE("We parse numbers with long runs of digits") {
+  for (size_t count = 1; count < 40; ++count) {
+    std::string digits;
+    for (size_t i = 0; i < count; ++i) {
+      digits += (char)('1' + i % 9);
+    }
+    check_parse_double(digits + ".0");
+    check_parse_double("0." + digits);
+    check_parse_double("0.0000000" + digits);
+    check_parse_double(digits + "e-10");
+    check_parse_double(digits + "." + digits);
+    if (count <= 19) {
+      Number number;
+      size_t end = 0;
+      REQUIRE(parse_number(digits.data(), digits.size(), 0, &end, &number));
+      REQUIRE(number.type == NumberType::kUnsigned);
+      REQUIRE(std::to_string(number.unsigned_value) == digits);
+    }
+  }
+}
+
 // Non-UTF8-input
 // --------------
 //
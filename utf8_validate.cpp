@@ -0,0 +1,380 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+#include "utf8_validate.hpp"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "utf8_decode.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UTF8_VALIDATE_X86 1
+#include <immintrin.h>
+#endif
+
+namespace mk {
+namespace libjson {
+
+// Scalar
+// ======
+//
+// Skips eight ASCII bytes at a time and runs the DFA on everything else.
+
+static bool validate_scalar(const char *data, size_t size) noexcept {
+  uint32_t state = UTF8_ACCEPT;
+  uint32_t codepoint = 0;
+  size_t pos = 0;
+  while (pos < size) {
+    if (state == UTF8_ACCEPT && size - pos >= 8) {
+      uint64_t word = 0;
+      memcpy(&word, data + pos, sizeof(word));
+      if ((word & 0x8080808080808080ULL) == 0) {
+        pos += 8;
+        continue;
+      }
+    }
+    if (utf8_decode(&state, &codepoint, (uint8_t)data[pos++]) ==
+        UTF8_REJECT) {
+      return false;
+    }
+  }
+  return state == UTF8_ACCEPT;
+}
+
+static unsigned scan_scalar(const char *data, size_t size) noexcept {
+  uint32_t state = UTF8_ACCEPT;
+  uint32_t codepoint = 0;
+  unsigned flags = utf8_scanned | utf8_ascii;
+  for (size_t pos = 0; pos < size; ++pos) {
+    uint8_t ch = (uint8_t)data[pos];
+    if (ch < 0x20 || ch == '"' || ch == '\\') {
+      flags |= utf8_escape;
+    } else if (ch >= 0x80) {
+      flags &= ~utf8_ascii;
+    }
+    if (utf8_decode(&state, &codepoint, ch) == UTF8_REJECT) {
+      return utf8_scanned;
+    }
+  }
+  return state == UTF8_ACCEPT ? flags | utf8_valid : utf8_scanned;
+}
+
+#ifdef UTF8_VALIDATE_X86
+
+// Lookup
+// ======
+//
+// Vectorized validation from Keiser and Lemire, "Validating UTF-8 in less
+// than one instruction per byte". Each pair of adjacent bytes is classified
+// using three 16-entry tables indexed by the high nibble of the first byte,
+// its low nibble, and the high nibble of the second byte. A bit that
+// survives the AND of the three lookups is an error, except for the
+// TWO_CONTS bit, which must be set exactly where the byte two or three
+// positions before is a three or four byte lead. Blocks that only contain
+// ASCII only need to check that the previous block was complete.
+//
+// When scanning, we also accumulate the bytes we must escape in JSON, which
+// we find like find_escape() does, and the OR of all the input bytes, whose
+// high bit tells whether there are non-ASCII characters.
+//
+// The bits are:
+//
+//     0x01 TOO_SHORT      lead byte not followed by a continuation
+//     0x02 TOO_LONG       ASCII followed by a continuation
+//     0x04 OVERLONG_3     E0 followed by 80..9F
+//     0x08 TOO_LARGE      F4 followed by 90..BF, or F5..FF
+//     0x10 SURROGATE      ED followed by A0..BF
+//     0x20 OVERLONG_2     C0 or C1
+//     0x40 TOO_LARGE_1000 F5..FF followed by 80..8F
+//     0x40 OVERLONG_4     F0 followed by 80..8F
+//     0x80 TWO_CONTS      continuation followed by a continuation
+
+#define UTF8_BYTE_1_HIGH                                                  \
+  0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, (char)0x80, (char)0x80, \
+      (char)0x80, (char)0x80, 0x21, 0x01, 0x15, 0x49
+
+#define UTF8_BYTE_1_LOW                                                    \
+  (char)0xe7, (char)0xa3, (char)0x83, (char)0x83, (char)0x8b, (char)0xcb, \
+      (char)0xcb, (char)0xcb, (char)0xcb, (char)0xcb, (char)0xcb,         \
+      (char)0xcb, (char)0xcb, (char)0xdb, (char)0xcb, (char)0xcb
+
+#define UTF8_BYTE_2_HIGH                                                   \
+  0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, (char)0xe6, (char)0xae, \
+      (char)0xba, (char)0xba, 0x01, 0x01, 0x01, 0x01
+
+// The last three bytes of a block cannot be larger than these values, or
+// the sequence they start continues into the next block.
+#define UTF8_MAX_TAIL (char)0xef, (char)0xdf, (char)0xbf
+
+struct Sse {
+  __m128i error;
+  __m128i prev_input;
+  __m128i prev_incomplete;
+  __m128i escape;
+  __m128i any;
+};
+
+__attribute__((target("ssse3"))) static inline __m128i escape_ssse3(
+    __m128i input) noexcept {
+  __m128i quote = _mm_cmpeq_epi8(input, _mm_set1_epi8('"'));
+  __m128i backslash = _mm_cmpeq_epi8(input, _mm_set1_epi8('\\'));
+  __m128i control = _mm_cmpeq_epi8(
+      _mm_subs_epu8(input, _mm_set1_epi8(0x1f)), _mm_setzero_si128());
+  return _mm_or_si128(_mm_or_si128(quote, backslash), control);
+}
+
+__attribute__((target("ssse3"))) static inline void check_ssse3(
+    Sse *state, __m128i input) noexcept {
+  const __m128i byte_1_high_table = _mm_setr_epi8(UTF8_BYTE_1_HIGH);
+  const __m128i byte_1_low_table = _mm_setr_epi8(UTF8_BYTE_1_LOW);
+  const __m128i byte_2_high_table = _mm_setr_epi8(UTF8_BYTE_2_HIGH);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i prev1 = _mm_alignr_epi8(input, state->prev_input, 15);
+  __m128i byte_1_high = _mm_shuffle_epi8(
+      byte_1_high_table, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+  __m128i byte_1_low =
+      _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, nibble));
+  __m128i byte_2_high = _mm_shuffle_epi8(
+      byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+  __m128i special =
+      _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+  __m128i prev2 = _mm_alignr_epi8(input, state->prev_input, 14);
+  __m128i prev3 = _mm_alignr_epi8(input, state->prev_input, 13);
+  __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80));
+  __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80));
+  __m128i must_continue = _mm_and_si128(_mm_or_si128(third, fourth),
+                                        _mm_set1_epi8((char)0x80));
+  state->error = _mm_or_si128(state->error,
+                              _mm_xor_si128(must_continue, special));
+  state->prev_input = input;
+}
+
+template <bool Scan>
+__attribute__((target("ssse3"))) static void validate_block_ssse3(
+    Sse *state, const char *block) noexcept {
+  __m128i v0 = _mm_loadu_si128((const __m128i *)block);
+  __m128i v1 = _mm_loadu_si128((const __m128i *)(block + 16));
+  __m128i v2 = _mm_loadu_si128((const __m128i *)(block + 32));
+  __m128i v3 = _mm_loadu_si128((const __m128i *)(block + 48));
+  __m128i any = _mm_or_si128(_mm_or_si128(v0, v1), _mm_or_si128(v2, v3));
+  if (Scan) {
+    __m128i escape = _mm_or_si128(
+        _mm_or_si128(escape_ssse3(v0), escape_ssse3(v1)),
+        _mm_or_si128(escape_ssse3(v2), escape_ssse3(v3)));
+    state->escape = _mm_or_si128(state->escape, escape);
+    state->any = _mm_or_si128(state->any, any);
+  }
+  if (_mm_movemask_epi8(any) == 0) {
+    state->error = _mm_or_si128(state->error, state->prev_incomplete);
+    state->prev_input = v3;
+    state->prev_incomplete = _mm_setzero_si128();
+    return;
+  }
+  check_ssse3(state, v0);
+  check_ssse3(state, v1);
+  check_ssse3(state, v2);
+  check_ssse3(state, v3);
+  const __m128i max_tail = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         -1, -1, -1, -1, UTF8_MAX_TAIL);
+  state->prev_incomplete = _mm_subs_epu8(v3, max_tail);
+}
+
+// We pad the last block with spaces, which are valid and need no escaping.
+template <bool Scan>
+__attribute__((target("ssse3"))) static unsigned scan_ssse3(
+    const char *data, size_t size) noexcept {
+  Sse state;
+  state.error = state.prev_input = state.prev_incomplete = state.escape =
+      state.any = _mm_setzero_si128();
+  size_t pos = 0;
+  for (; size - pos >= 64; pos += 64) {
+    validate_block_ssse3<Scan>(&state, data + pos);
+  }
+  if (pos < size) {
+    char block[64];
+    memset(block, ' ', sizeof(block));
+    memcpy(block, data + pos, size - pos);
+    validate_block_ssse3<Scan>(&state, block);
+  }
+  __m128i error = _mm_or_si128(state.error, state.prev_incomplete);
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) !=
+      0xffff) {
+    return utf8_scanned;
+  }
+  unsigned flags = utf8_scanned | utf8_valid;
+  if (Scan && _mm_movemask_epi8(state.any) == 0) {
+    flags |= utf8_ascii;
+  }
+  if (Scan && _mm_movemask_epi8(state.escape) != 0) {
+    flags |= utf8_escape;
+  }
+  return flags;
+}
+
+__attribute__((target("ssse3"))) static bool validate_ssse3(
+    const char *data, size_t size) noexcept {
+  return (scan_ssse3<false>(data, size) & utf8_valid) != 0;
+}
+
+struct Avx {
+  __m256i error;
+  __m256i prev_input;
+  __m256i prev_incomplete;
+  __m256i escape;
+  __m256i any;
+};
+
+__attribute__((target("avx2"))) static inline __m256i escape_avx2(
+    __m256i input) noexcept {
+  __m256i quote = _mm256_cmpeq_epi8(input, _mm256_set1_epi8('"'));
+  __m256i backslash = _mm256_cmpeq_epi8(input, _mm256_set1_epi8('\\'));
+  __m256i control = _mm256_cmpeq_epi8(
+      _mm256_subs_epu8(input, _mm256_set1_epi8(0x1f)), _mm256_setzero_si256());
+  return _mm256_or_si256(_mm256_or_si256(quote, backslash), control);
+}
+
+// Like _mm_alignr_epi8() with 32 byte vectors. Since _mm256_alignr_epi8()
+// works within each 128 bit lane, we first build the vector made of the
+// high lane of |prev| and the low lane of |input|.
+#define UTF8_PREV_AVX2(input, prev, count)                               \
+  _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), \
+                     16 - (count))
+
+__attribute__((target("avx2"))) static inline void check_avx2(
+    Avx *state, __m256i input) noexcept {
+  const __m256i byte_1_high_table =
+      _mm256_setr_epi8(UTF8_BYTE_1_HIGH, UTF8_BYTE_1_HIGH);
+  const __m256i byte_1_low_table =
+      _mm256_setr_epi8(UTF8_BYTE_1_LOW, UTF8_BYTE_1_LOW);
+  const __m256i byte_2_high_table =
+      _mm256_setr_epi8(UTF8_BYTE_2_HIGH, UTF8_BYTE_2_HIGH);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i prev1 = UTF8_PREV_AVX2(input, state->prev_input, 1);
+  __m256i byte_1_high = _mm256_shuffle_epi8(
+      byte_1_high_table, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+  __m256i byte_1_low =
+      _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, nibble));
+  __m256i byte_2_high = _mm256_shuffle_epi8(
+      byte_2_high_table, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+  __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low),
+                                     byte_2_high);
+  __m256i prev2 = UTF8_PREV_AVX2(input, state->prev_input, 2);
+  __m256i prev3 = UTF8_PREV_AVX2(input, state->prev_input, 3);
+  __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80));
+  __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80));
+  __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth),
+                                           _mm256_set1_epi8((char)0x80));
+  state->error = _mm256_or_si256(state->error,
+                                 _mm256_xor_si256(must_continue, special));
+  state->prev_input = input;
+}
+
+template <bool Scan>
+__attribute__((target("avx2"))) static void validate_block_avx2(
+    Avx *state, const char *block) noexcept {
+  __m256i v0 = _mm256_loadu_si256((const __m256i *)block);
+  __m256i v1 = _mm256_loadu_si256((const __m256i *)(block + 32));
+  __m256i any = _mm256_or_si256(v0, v1);
+  if (Scan) {
+    state->escape = _mm256_or_si256(
+        state->escape, _mm256_or_si256(escape_avx2(v0), escape_avx2(v1)));
+    state->any = _mm256_or_si256(state->any, any);
+  }
+  if (_mm256_movemask_epi8(any) == 0) {
+    state->error = _mm256_or_si256(state->error, state->prev_incomplete);
+    state->prev_input = v1;
+    state->prev_incomplete = _mm256_setzero_si256();
+    return;
+  }
+  check_avx2(state, v0);
+  check_avx2(state, v1);
+  const __m256i max_tail = _mm256_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, UTF8_MAX_TAIL);
+  state->prev_incomplete = _mm256_subs_epu8(v1, max_tail);
+}
+
+template <bool Scan>
+__attribute__((target("avx2"))) static unsigned scan_avx2(
+    const char *data, size_t size) noexcept {
+  Avx state;
+  state.error = state.prev_input = state.prev_incomplete = state.escape =
+      state.any = _mm256_setzero_si256();
+  size_t pos = 0;
+  for (; size - pos >= 64; pos += 64) {
+    validate_block_avx2<Scan>(&state, data + pos);
+  }
+  if (pos < size) {
+    char block[64];
+    memset(block, ' ', sizeof(block));
+    memcpy(block, data + pos, size - pos);
+    validate_block_avx2<Scan>(&state, block);
+  }
+  __m256i error = _mm256_or_si256(state.error, state.prev_incomplete);
+  if (_mm256_testz_si256(error, error) == 0) {
+    return utf8_scanned;
+  }
+  unsigned flags = utf8_scanned | utf8_valid;
+  if (Scan && _mm256_movemask_epi8(state.any) == 0) {
+    flags |= utf8_ascii;
+  }
+  if (Scan && _mm256_testz_si256(state.escape, state.escape) == 0) {
+    flags |= utf8_escape;
+  }
+  return flags;
+}
+
+__attribute__((target("avx2"))) static bool validate_avx2(
+    const char *data, size_t size) noexcept {
+  return (scan_avx2<false>(data, size) & utf8_valid) != 0;
+}
+
+#endif  // UTF8_VALIDATE_X86
+
+// Dispatch
+// ========
+
+using Validator = bool (*)(const char *, size_t);
+
+static Validator select_validator() noexcept {
+#ifdef UTF8_VALIDATE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return validate_avx2;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    return validate_ssse3;
+  }
+#endif
+  return validate_scalar;
+}
+
+bool utf8_validate(const char *data, size_t size) noexcept {
+  static const Validator validate = select_validator();
+  return validate(data, size);
+}
+
+using Scanner = unsigned (*)(const char *, size_t);
+
+static Scanner select_scanner() noexcept {
+#ifdef UTF8_VALIDATE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return scan_avx2<true>;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    return scan_ssse3<true>;
+  }
+#endif
+  return scan_scalar;
+}
+
+unsigned utf8_scan(const char *data, size_t size) noexcept {
+  static const Scanner scan = select_scanner();
+  return scan(data, size);
+}
+
+}  // namespace libjson
+}  // namespace mk
@@ -0,0 +1,33 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef UTF8_VALIDATE_HPP
+#define UTF8_VALIDATE_HPP
+
+#include <stddef.h>
+
+namespace mk {
+namespace libjson {
+
+// Returns true if [data, data + size) is valid UTF-8, i.e., if it does not
+// contain overlong encodings, surrogates, code points above U+10FFFF, or
+// truncated sequences. This accepts the same inputs as utf8_decode(), but
+// it checks 64 bytes at a time using SIMD instructions when available.
+bool utf8_validate(const char *data, size_t size) noexcept;
+
+// Flags returned by utf8_scan(). When utf8_scanned is not set, we do not
+// know anything about the string.
+constexpr unsigned utf8_scanned = 1;
+constexpr unsigned utf8_valid = 2;   // Valid UTF-8
+constexpr unsigned utf8_ascii = 4;   // Only ASCII characters
+constexpr unsigned utf8_escape = 8;  // Characters that JSON must escape
+
+// Like utf8_validate() but, in the same pass, also checks whether the
+// string only contains ASCII characters and whether it contains quotes,
+// backslashes or control characters, which we must escape in JSON. When
+// the string is not valid, the result is just utf8_scanned.
+unsigned utf8_scan(const char *data, size_t size) noexcept;
+
+}  // namespace libjson
+}  // namespace mk
+#endif